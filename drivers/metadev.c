@@ -40,6 +40,7 @@
 #include "kernel/assert.h"
 #include "kernel/kmalloc.h"
 #include "kernel/interrupt.h"
+#include "vm/tlb.h"
 
 /**@name Metadevices
  *
@@ -173,6 +174,7 @@ device_t *cpustatus_init(io_descriptor_t *desc)
     if (cpu == NULL) 
         KERNEL_PANIC("Could not reserve memory for CPU status device driver.");
     spinlock_reset(&cpu->slock);
+    cpu->ipi = 0;
 
     dev->real_device = cpu;
 
@@ -205,13 +207,28 @@ int cpustatus_count() {
 }
 
 /**
- * Generate IRQ on given CPU. 
+ * Generate IRQ on given CPU, requesting it to run the scheduler.
  *
  * @param dev Device descriptor for CPU
  *
  */
 
 void cpustatus_generate_irq(device_t *dev)
+{
+    cpustatus_send_ipi(dev, CPU_IPI_SCHEDULE);
+}
+
+/**
+ * Generate IRQ on given CPU with the given requests. Requests sent
+ * before the CPU has handled the interrupt are merged.
+ *
+ * @param dev Device descriptor for CPU
+ *
+ * @param ipi Mask of requests (CPU_IPI_*)
+ *
+ */
+
+void cpustatus_send_ipi(device_t *dev, uint32_t ipi)
 {
     interrupt_status_t intr_status;
     volatile cpu_io_area_t *iobase = (cpu_io_area_t *)dev->io_address;
@@ -222,8 +239,7 @@ void cpustatus_generate_irq(device_t *dev)
     intr_status = _interrupt_disable();
     spinlock_acquire(&cpu->slock);
 
-    /* If you really want to do something with inter-cpu interrupts,
-       do it here.*/
+    cpu->ipi |= ipi;
 
     /* Generate the IRQ */
     iobase->command = CPU_COMMAND_RAISE_IRQ;
@@ -233,16 +249,17 @@ void cpustatus_generate_irq(device_t *dev)
 }
 
 /**
- * Interrupt handler for the CPU status device. Currently the CPU
- * status device driver only supports ping-ponging interrupts between
- * CPUs.
+ * Interrupt handler for the CPU status device. An interrupt from
+ * another CPU requests this CPU to run the scheduler, e.g. because a
+ * thread was placed on its ready list, and/or to invalidate TLB
+ * entries (see tlb_shootdown).
  *
  * @param device Pointer to the CPU status device
  */
 void cpustatus_interrupt_handle(device_t *dev){
     volatile cpu_io_area_t *iobase = (cpu_io_area_t *)dev->io_address;
     cpu_real_device_t *cpu = (cpu_real_device_t *)dev->real_device;
-    uint32_t this_cpu;
+    uint32_t this_cpu, ipi;
 
     KERNEL_ASSERT(dev != NULL || cpu != NULL);
     this_cpu = _interrupt_getcpu();
@@ -257,13 +274,20 @@ void cpustatus_interrupt_handle(device_t *dev){
 
     spinlock_acquire(&cpu->slock);
 
-    /* If you really want to do something with inter-cpu interrupts,
-       do it here. */
+    ipi = cpu->ipi;
+    cpu->ipi = 0;
 
     /* Clear the interrupt */
     iobase->command = CPU_COMMAND_CLEAR_IRQ;
     
     spinlock_release(&cpu->slock);
+
+    if (ipi & CPU_IPI_TLB_SHOOTDOWN)
+        tlb_shootdown_interrupt();
+
+    /* The scheduler is run for a software interrupt 0 */
+    if (ipi & CPU_IPI_SCHEDULE)
+        _interrupt_generate_sw0();
 }
 
 /** 
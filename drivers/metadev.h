@@ -51,6 +51,10 @@
 #define CPU_STATUS_IRQ(status) \
     ((status) & 0x00000002)
 
+/* Requests carried by inter-CPU interrupts */
+#define CPU_IPI_SCHEDULE       0x00000001
+#define CPU_IPI_TLB_SHOOTDOWN  0x00000002
+
 /* The structure of the YAMS CPU status device IO area */
 typedef struct {
     uint32_t status;   /* Status port of the CPU status device */
@@ -65,8 +69,8 @@ typedef struct {
 typedef struct {
     /* Spinlock to synchronize access to the driver */
     spinlock_t slock;
-    /* If you are using inter-cpu interrupts for something, the
-       necessary data may be added here. */
+    /* Requests (CPU_IPI_*) not yet handled by the CPU */
+    uint32_t ipi;
 } cpu_real_device_t;
 
 device_t *rtc_init(io_descriptor_t *desc);
@@ -79,6 +83,7 @@ uint32_t meminfo_get_pages(void);
 device_t *cpustatus_init(io_descriptor_t *desc);
 int cpustatus_count(void);
 void cpustatus_generate_irq(device_t *dev);
+void cpustatus_send_ipi(device_t *dev, uint32_t ipi);
 void cpustatus_interrupt_handle(device_t *dev);
 
 device_t *shutdown_init(io_descriptor_t *desc);
@@ -62,4 +62,17 @@ void timer_set_ticks(uint32_t ticks)
     _interrupt_set_state(intr_status);
 }
 
+/**
+ * Acknowledges the timer interrupt without scheduling a new one in
+ * the near future. The CP0 timer cannot be turned off, so the next
+ * interrupt is set to the furthest possible point in time (2^32 - 1
+ * ticks from now).
+ *
+ */
+
+void timer_stop(void)
+{
+    timer_set_ticks(0xffffffff);
+}
+
 /** @} */
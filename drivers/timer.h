@@ -40,6 +40,7 @@
 #include "lib/types.h"
 
 void timer_set_ticks(uint32_t ticks);
+void timer_stop(void);
 
 #endif /* DRIVERS_POLLTTY_H */
 
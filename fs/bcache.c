@@ -0,0 +1,405 @@
+/*
+ * Block buffer cache
+ *
+ * Copyright (C) 2003 Juha Aatrokoski, Timo Lilja,
+ *   Leena Salmela, Teemu Takanen, Aleksi Virtanen.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fs/bcache.h"
+#include "kernel/kmalloc.h"
+#include "kernel/mutex.h"
+#include "kernel/semaphore.h"
+#include "kernel/thread.h"
+#include "kernel/panic.h"
+#include "kernel/config.h"
+#include "lib/libc.h"
+#include "vm/pagepool.h"
+
+/** @name Block buffer cache
+ *
+ * The filesystems access their disks through the block cache, which
+ * keeps the most recently used CONFIG_BCACHE_BLOCKS blocks of all
+ * cached disks in memory. bcache_attach wraps a disk into a generic
+ * block device with the same interface, so the filesystem drivers do
+ * not know about the cache.
+ *
+ * Cached blocks are found through a hash table on (disk, block). On a
+ * miss the least recently used block is replaced. Writes only go to
+ * the cache and mark the block dirty. Dirty blocks are written back
+ * when they are replaced, by the flush thread CONFIG_BCACHE_FLUSH_MS
+ * milliseconds after the first block is dirtied, and when the
+ * filesystems are unmounted. The flush thread sleeps on a semaphore
+ * while the cache is clean, so an idle system has no timer armed for
+ * it and the CPUs can stop their timers (CONFIG_SCHEDULER_TICKLESS).
+ *
+ * One mutex protects the cache, and it is held while blocks are read
+ * or written back, so only one disk transfer of the cache is in
+ * progress at a time. The filesystems serialize their own operations
+ * anyway, and hits do not wait for the disk.
+ *
+ * @{
+ */
+
+/* Number of hash chains, a power of two */
+#define BCACHE_HASH_SIZE 64
+
+#define BCACHE_HASH(disk, block) \
+    ((((uint32_t)(disk) >> 4) ^ (block)) & (BCACHE_HASH_SIZE - 1))
+
+/* A cached block */
+typedef struct bcache_buf_struct {
+    /* The disk of the block, NULL if the buffer is unused */
+    gbd_t *disk;
+    uint32_t block;
+    /* Modified since it was read or written back */
+    int dirty;
+    /* Kernel address of the BCACHE_BLOCK_SIZE bytes of data */
+    uint32_t data;
+    /* Next buffer in the hash chain */
+    struct bcache_buf_struct *hash_next;
+    /* Neighbours in the LRU list */
+    struct bcache_buf_struct *lru_prev;
+    struct bcache_buf_struct *lru_next;
+} bcache_buf_t;
+
+/* A cached disk. The generic block device must be the first field,
+   the wrapper functions get a pointer to it. */
+typedef struct {
+    gbd_t gbd;
+    /* The disk under the cache */
+    gbd_t *disk;
+} bcache_disk_t;
+
+static mutex_t bcache_lock;
+
+static bcache_buf_t *bcache_bufs;
+static bcache_buf_t *bcache_hash[BCACHE_HASH_SIZE];
+
+/* The LRU list, most recently used first */
+static bcache_buf_t *bcache_lru_head;
+static bcache_buf_t *bcache_lru_tail;
+
+static bcache_disk_t bcache_disks[CONFIG_MAX_FILESYSTEMS];
+static int bcache_num_disks;
+
+static bcache_stats_t bcache_stats;
+
+/* Set when a block is dirtied after the last flush. The first write
+   to a clean cache signals bcache_flush_sem to start the flush
+   thread's countdown. */
+static int bcache_flush_pending;
+static semaphore_t *bcache_flush_sem;
+
+/**
+ * Initializes the block cache. Allocates the buffers with kmalloc, so
+ * it must be called before vm_init.
+ */
+void bcache_init(void)
+{
+    bcache_buf_t *buf;
+    uint32_t data;
+    int i;
+
+    bcache_bufs = kmalloc(CONFIG_BCACHE_BLOCKS * sizeof(bcache_buf_t));
+    data = (uint32_t) kmalloc(CONFIG_BCACHE_BLOCKS * BCACHE_BLOCK_SIZE);
+    if (bcache_bufs == NULL || data == 0)
+	KERNEL_PANIC("Could not allocate memory for the block cache.");
+
+    mutex_init(&bcache_lock);
+
+    bcache_flush_pending = 0;
+    bcache_flush_sem = semaphore_create(0);
+    if (bcache_flush_sem == NULL)
+	KERNEL_PANIC("Could not create the block cache flush semaphore.");
+
+    for (i = 0; i < BCACHE_HASH_SIZE; i++)
+	bcache_hash[i] = NULL;
+
+    for (i = 0; i < CONFIG_BCACHE_BLOCKS; i++) {
+	buf = &bcache_bufs[i];
+	buf->disk = NULL;
+	buf->dirty = 0;
+	buf->data = data + i * BCACHE_BLOCK_SIZE;
+	buf->hash_next = NULL;
+	buf->lru_prev = (i > 0) ? &bcache_bufs[i - 1] : NULL;
+	buf->lru_next = (i < CONFIG_BCACHE_BLOCKS - 1) ?
+	    &bcache_bufs[i + 1] : NULL;
+    }
+    bcache_lru_head = &bcache_bufs[0];
+    bcache_lru_tail = &bcache_bufs[CONFIG_BCACHE_BLOCKS - 1];
+
+    bcache_num_disks = 0;
+    memoryset(&bcache_stats, 0, sizeof(bcache_stats));
+}
+
+/* Moves the buffer to the front of the LRU list. */
+static void bcache_lru_touch(bcache_buf_t *buf)
+{
+    if (buf == bcache_lru_head)
+	return;
+
+    buf->lru_prev->lru_next = buf->lru_next;
+    if (buf->lru_next != NULL)
+	buf->lru_next->lru_prev = buf->lru_prev;
+    else
+	bcache_lru_tail = buf->lru_prev;
+
+    buf->lru_prev = NULL;
+    buf->lru_next = bcache_lru_head;
+    bcache_lru_head->lru_prev = buf;
+    bcache_lru_head = buf;
+}
+
+/* Removes the buffer from its hash chain. */
+static void bcache_unhash(bcache_buf_t *buf)
+{
+    bcache_buf_t **link;
+
+    link = &bcache_hash[BCACHE_HASH(buf->disk, buf->block)];
+    while (*link != buf)
+	link = &(*link)->hash_next;
+    *link = buf->hash_next;
+}
+
+/* Reads the block of the buffer from disk, or writes it back. Returns
+ * 1 on success, 0 on error. */
+static int bcache_transfer(bcache_buf_t *buf, int write)
+{
+    gbd_request_t req;
+
+    req.block = buf->block;
+    req.buf = ADDR_KERNEL_TO_PHYS(buf->data);
+    req.sem = NULL;
+
+    if (write) {
+	bcache_stats.disk_writes++;
+	return buf->disk->write_block(buf->disk, &req);
+    }
+
+    bcache_stats.disk_reads++;
+    return buf->disk->read_block(buf->disk, &req);
+}
+
+/* Returns the buffer of the given block, replacing the least recently
+ * used block if it is not cached. The block is read from disk only if
+ * read is non-zero, otherwise the caller overwrites all of it.
+ * Returns NULL on a disk error. The cache lock must be held. */
+static bcache_buf_t *bcache_get(gbd_t *disk, uint32_t block, int read)
+{
+    bcache_buf_t *buf;
+    uint32_t hash;
+
+    bcache_stats.lookups++;
+
+    hash = BCACHE_HASH(disk, block);
+    for (buf = bcache_hash[hash]; buf != NULL; buf = buf->hash_next) {
+	if (buf->disk == disk && buf->block == block) {
+	    bcache_stats.hits++;
+	    bcache_lru_touch(buf);
+	    return buf;
+	}
+    }
+
+    if (block >= disk->total_blocks(disk))
+	return NULL;
+
+    buf = bcache_lru_tail;
+    if (buf->disk != NULL) {
+	if (buf->dirty && !bcache_transfer(buf, 1))
+	    return NULL;
+	bcache_unhash(buf);
+    }
+
+    buf->disk = disk;
+    buf->block = block;
+    buf->dirty = 0;
+    if (read && !bcache_transfer(buf, 0)) {
+	buf->disk = NULL;
+	return NULL;
+    }
+
+    buf->hash_next = bcache_hash[hash];
+    bcache_hash[hash] = buf;
+    bcache_lru_touch(buf);
+
+    return buf;
+}
+
+/* Completes a request served from the cache. Returns ok, like the
+ * read_block and write_block functions of the disk driver. */
+static int bcache_complete(gbd_request_t *request, gbd_operation_t op,
+			   int ok)
+{
+    request->operation = op;
+    request->return_value = ok ? 0 : -1;
+    if (request->sem != NULL)
+	semaphore_V(request->sem);
+
+    return ok;
+}
+
+/* Implements read_block of a cached disk. */
+static int bcache_read_block(gbd_t *gbd, gbd_request_t *request)
+{
+    bcache_disk_t *cdisk = (bcache_disk_t *) gbd;
+    bcache_buf_t *buf;
+
+    mutex_acquire(&bcache_lock);
+    buf = bcache_get(cdisk->disk, request->block, 1);
+    if (buf != NULL)
+	memcopy(BCACHE_BLOCK_SIZE, (void *) ADDR_PHYS_TO_KERNEL(request->buf),
+		(void *) buf->data);
+    mutex_release(&bcache_lock);
+
+    return bcache_complete(request, GBD_OPERATION_READ, buf != NULL);
+}
+
+/* Implements write_block of a cached disk. The block is written back
+ * later. */
+static int bcache_write_block(gbd_t *gbd, gbd_request_t *request)
+{
+    bcache_disk_t *cdisk = (bcache_disk_t *) gbd;
+    bcache_buf_t *buf;
+
+    mutex_acquire(&bcache_lock);
+    buf = bcache_get(cdisk->disk, request->block, 0);
+    if (buf != NULL) {
+	memcopy(BCACHE_BLOCK_SIZE, (void *) buf->data,
+		(void *) ADDR_PHYS_TO_KERNEL(request->buf));
+	buf->dirty = 1;
+	if (!bcache_flush_pending) {
+	    bcache_flush_pending = 1;
+	    semaphore_V(bcache_flush_sem);
+	}
+    }
+    mutex_release(&bcache_lock);
+
+    return bcache_complete(request, GBD_OPERATION_WRITE, buf != NULL);
+}
+
+/* Implements block_size of a cached disk. */
+static uint32_t bcache_block_size(gbd_t *gbd)
+{
+    gbd = gbd;
+    return BCACHE_BLOCK_SIZE;
+}
+
+/* Implements total_blocks of a cached disk. */
+static uint32_t bcache_total_blocks(gbd_t *gbd)
+{
+    gbd_t *disk = ((bcache_disk_t *) gbd)->disk;
+
+    return disk->total_blocks(disk);
+}
+
+/**
+ * Writes all dirty blocks back to their disks. Blocks which can not
+ * be written stay dirty, and are tried again when the next block is
+ * dirtied or the filesystems are unmounted.
+ */
+void bcache_flush_all(void)
+{
+    bcache_buf_t *buf;
+    int i;
+
+    mutex_acquire(&bcache_lock);
+    bcache_flush_pending = 0;
+    for (i = 0; i < CONFIG_BCACHE_BLOCKS; i++) {
+	buf = &bcache_bufs[i];
+	if (buf->disk != NULL && buf->dirty && bcache_transfer(buf, 1))
+	    buf->dirty = 0;
+    }
+    mutex_release(&bcache_lock);
+}
+
+/* Writes the dirty blocks back CONFIG_BCACHE_FLUSH_MS milliseconds
+ * after the first of them was dirtied. Sleeps without a timer while
+ * the cache is clean. */
+static void bcache_flush_thread(uint32_t arg)
+{
+    arg = arg;
+
+    while (1) {
+	semaphore_P(bcache_flush_sem);
+	thread_sleep_ms(CONFIG_BCACHE_FLUSH_MS);
+	bcache_flush_all();
+    }
+}
+
+/**
+ * Puts the block cache in front of the given disk. Called when the
+ * filesystems are mounted at boot. Starts the flush thread with the
+ * first cached disk.
+ *
+ * @param disk The disk
+ *
+ * @return A block device which reads and writes the disk through the
+ * cache, or the disk itself if it can not be cached.
+ */
+gbd_t *bcache_attach(gbd_t *disk)
+{
+    bcache_disk_t *cdisk;
+    TID_t tid;
+
+    if (disk->block_size(disk) != BCACHE_BLOCK_SIZE
+	|| bcache_num_disks == CONFIG_MAX_FILESYSTEMS)
+	return disk;
+
+    if (bcache_num_disks == 0) {
+	tid = thread_create(&bcache_flush_thread, 0);
+	if (tid < 0)
+	    KERNEL_PANIC("Could not start the block cache flush thread.");
+	thread_run(tid);
+    }
+
+    cdisk = &bcache_disks[bcache_num_disks++];
+    cdisk->disk = disk;
+    cdisk->gbd.device = disk->device;
+    cdisk->gbd.read_block = bcache_read_block;
+    cdisk->gbd.write_block = bcache_write_block;
+    cdisk->gbd.block_size = bcache_block_size;
+    cdisk->gbd.total_blocks = bcache_total_blocks;
+
+    return &cdisk->gbd;
+}
+
+/**
+ * Returns the counters of the block cache. The hit ratio is hits /
+ * lookups.
+ *
+ * @param stats Filled with the counters
+ */
+void bcache_get_stats(bcache_stats_t *stats)
+{
+    mutex_acquire(&bcache_lock);
+    *stats = bcache_stats;
+    mutex_release(&bcache_lock);
+}
+
+/** @} */
@@ -0,0 +1,61 @@
+/*
+ * Block buffer cache
+ *
+ * Copyright (C) 2003 Juha Aatrokoski, Timo Lilja,
+ *   Leena Salmela, Teemu Takanen, Aleksi Virtanen.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FS_BCACHE_H
+#define FS_BCACHE_H
+
+#include "lib/types.h"
+#include "drivers/gbd.h"
+
+/* Size of the cached blocks, disks with other block sizes are not
+   cached */
+#define BCACHE_BLOCK_SIZE 512
+
+/* Counters of the block cache, see bcache_get_stats */
+typedef struct {
+    /* blocks read or written through the cache */
+    uint32_t lookups;
+    /* lookups which found the block in the cache */
+    uint32_t hits;
+    /* blocks read from disk */
+    uint32_t disk_reads;
+    /* modified blocks written back to disk */
+    uint32_t disk_writes;
+} bcache_stats_t;
+
+void bcache_init(void);
+gbd_t *bcache_attach(gbd_t *disk);
+void bcache_flush_all(void);
+void bcache_get_stats(bcache_stats_t *stats);
+
+#endif /* FS_BCACHE_H */
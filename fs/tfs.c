@@ -36,6 +36,7 @@
 
 #include "kernel/kmalloc.h"
 #include "kernel/assert.h"
+#include "kernel/mutex.h"
 #include "vm/pagepool.h"
 #include "drivers/gbd.h"
 #include "fs/vfs.h"
@@ -67,7 +68,7 @@ typedef struct {
 
     /* lock for mutual exclusion of fs-operations (we support only
        one operation at a time in any case) */
-    semaphore_t    *lock;
+    mutex_t        lock;
 
     /* Buffers for read/write operations on disk. */       
     tfs_inode_t    *buffer_inode;   /* buffer for inode blocks */
@@ -95,21 +96,12 @@ fs_t * tfs_init(gbd_t *disk)
     fs_t *fs;
     tfs_t *tfs;
     int r;
-    semaphore_t *sem;
 
     if(disk->block_size(disk) != TFS_BLOCK_SIZE)
 	return NULL;
 
-    /* check semaphore availability before memory allocation */
-    sem = semaphore_create(1);
-    if (sem == NULL) {
-	kprintf("tfs_init: could not create a new semaphore.\n");
-	return NULL;
-    }
-
     addr = pagepool_get_phys_page();
     if(addr == 0) {
-        semaphore_destroy(sem);
 	kprintf("tfs_init: could not allocate memory.\n");
 	return NULL;
     }
@@ -125,14 +117,12 @@ fs_t * tfs_init(gbd_t *disk)
     req.buf = ADDR_KERNEL_TO_PHYS(addr);   /* disk needs physical addr */
     r = disk->read_block(disk, &req);
     if(r == 0) {
-        semaphore_destroy(sem);
 	pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS(addr));
 	kprintf("tfs_init: Error during disk read. Initialization failed.\n");
 	return NULL; 
     }
 
     if(((uint32_t *)addr)[0] != TFS_MAGIC) {
-        semaphore_destroy(sem);
 	pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS(addr));
 	return NULL;
     }
@@ -154,8 +144,7 @@ fs_t * tfs_init(gbd_t *disk)
     tfs->totalblocks = MIN(disk->total_blocks(disk), 8*TFS_BLOCK_SIZE);
     tfs->disk        = disk;
 
-    /* save the semaphore to the tfs_t */
-    tfs->lock = sem;
+    mutex_init(&tfs->lock);
 
     fs->internal = (void *)tfs;
     stringcopy(fs->volume_name, name, VFS_NAME_LENGTH);
@@ -190,11 +179,10 @@ int tfs_unmount(fs_t *fs)
 
     tfs = (tfs_t *)fs->internal;
 
-    semaphore_P(tfs->lock); /* The semaphore should be free at this
+    mutex_acquire(&tfs->lock); /* The mutex should be free at this
       point, we get it just in case something has gone wrong. */
 
-    /* free semaphore and allocated memory */
-    semaphore_destroy(tfs->lock);
+    /* free allocated memory */
     pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS((uint32_t)fs));
     return VFS_OK;
 }
@@ -220,7 +208,7 @@ int tfs_open(fs_t *fs, char *filename)
 
     tfs = (tfs_t *)fs->internal;
 
-    semaphore_P(tfs->lock);
+    mutex_acquire(&tfs->lock);
     
     req.block     = TFS_DIRECTORY_BLOCK;
     req.buf       = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_md);
@@ -228,18 +216,18 @@ int tfs_open(fs_t *fs, char *filename)
     r = tfs->disk->read_block(tfs->disk,&req);
     if(r == 0) {
 	/* An error occured during read. */
-	semaphore_V(tfs->lock);
+	mutex_release(&tfs->lock);
 	return VFS_ERROR;
     }
 
     for(i=0;i < TFS_MAX_FILES;i++) {
 	if(stringcmp(tfs->buffer_md[i].name, filename) == 0) {
-	    semaphore_V(tfs->lock);
+	    mutex_release(&tfs->lock);
 	    return tfs->buffer_md[i].inode;
 	}
     }
     
-    semaphore_V(tfs->lock);
+    mutex_release(&tfs->lock);
     return VFS_NOT_FOUND;
 }
 
@@ -284,10 +272,10 @@ int tfs_create(fs_t *fs, char *filename, int size)
     int index = -1;
     int r;
 
-    semaphore_P(tfs->lock);
+    mutex_acquire(&tfs->lock);
 
     if(numblocks > (TFS_BLOCK_SIZE / 4 - 1)) {
-	semaphore_V(tfs->lock);
+	mutex_release(&tfs->lock);
 	return VFS_ERROR;
     }
     
@@ -299,13 +287,13 @@ int tfs_create(fs_t *fs, char *filename, int size)
     r = tfs->disk->read_block(tfs->disk, &req);
     if(r == 0) {
 	/* An error occured. */
-	semaphore_V(tfs->lock);
+	mutex_release(&tfs->lock);
 	return VFS_ERROR;
     }
 
     for(i=0;i<TFS_MAX_FILES;i++) {
 	if(stringcmp(tfs->buffer_md[i].name, filename) == 0) {
-	    semaphore_V(tfs->lock);
+	    mutex_release(&tfs->lock);
 	    return VFS_ERROR;
 	}
 
@@ -317,7 +305,7 @@ int tfs_create(fs_t *fs, char *filename, int size)
 
     if(index == -1) {
 	/* there was no space in directory, because index is not set */
-	semaphore_V(tfs->lock);
+	mutex_release(&tfs->lock);
 	return VFS_ERROR;
     }
 
@@ -330,7 +318,7 @@ int tfs_create(fs_t *fs, char *filename, int size)
     r = tfs->disk->read_block(tfs->disk, &req);
     if(r==0) {
 	/* An error occured. */
-	semaphore_V(tfs->lock);
+	mutex_release(&tfs->lock);
 	return VFS_ERROR;
     }
 
@@ -339,7 +327,7 @@ int tfs_create(fs_t *fs, char *filename, int size)
     tfs->buffer_md[index].inode = bitmap_findnset(tfs->buffer_bat,
 						  tfs->totalblocks);
     if((int)tfs->buffer_md[index].inode == -1) {
-	semaphore_V(tfs->lock);
+	mutex_release(&tfs->lock);
 	return VFS_ERROR;
     }
 
@@ -351,7 +339,7 @@ int tfs_create(fs_t *fs, char *filename, int size)
 						      tfs->totalblocks);
 	if((int)tfs->buffer_inode->block[i] == -1) {
 	    /* Disk full. No free block found. */
-	    semaphore_V(tfs->lock);
+	    mutex_release(&tfs->lock);
 	    return VFS_ERROR;
 	}
     }
@@ -366,7 +354,7 @@ int tfs_create(fs_t *fs, char *filename, int size)
     r = tfs->disk->write_block(tfs->disk, &req);
     if(r==0) {
 	/* An error occured. */
-	semaphore_V(tfs->lock);
+	mutex_release(&tfs->lock);
 	return VFS_ERROR;
     }
 
@@ -376,7 +364,7 @@ int tfs_create(fs_t *fs, char *filename, int size)
     r = tfs->disk->write_block(tfs->disk, &req);
     if(r==0) {
 	/* An error occured. */
-	semaphore_V(tfs->lock);
+	mutex_release(&tfs->lock);
 	return VFS_ERROR;
     }
 
@@ -386,7 +374,7 @@ int tfs_create(fs_t *fs, char *filename, int size)
     r = tfs->disk->write_block(tfs->disk, &req);
     if(r==0) {
 	/* An error occured. */
-	semaphore_V(tfs->lock);
+	mutex_release(&tfs->lock);
 	return VFS_ERROR;
     }
 
@@ -400,13 +388,13 @@ int tfs_create(fs_t *fs, char *filename, int size)
 	r = tfs->disk->write_block(tfs->disk, &req);
 	if(r==0) {
 	    /* An error occured. */
-	    semaphore_V(tfs->lock);
+	    mutex_release(&tfs->lock);
 	    return VFS_ERROR;
 	}
        
     }
 
-    semaphore_V(tfs->lock);
+    mutex_release(&tfs->lock);
     return VFS_OK;
 }
 
@@ -428,7 +416,7 @@ int tfs_remove(fs_t *fs, char *filename)
     int index = -1;
     int r;
 
-    semaphore_P(tfs->lock);
+    mutex_acquire(&tfs->lock);
 
     /* Find file and inode block number from directory block.
        If not found return VFS_NOT_FOUND. */
@@ -438,7 +426,7 @@ int tfs_remove(fs_t *fs, char *filename)
     r = tfs->disk->read_block(tfs->disk, &req);
     if(r == 0) {
 	/* An error occured. */
-	semaphore_V(tfs->lock);
+	mutex_release(&tfs->lock);
 	return VFS_ERROR;
     }
 
@@ -449,7 +437,7 @@ int tfs_remove(fs_t *fs, char *filename)
 	}
     }
     if(index == -1) {
-	semaphore_V(tfs->lock);
+	mutex_release(&tfs->lock);
 	return VFS_NOT_FOUND;
     }
 
@@ -461,7 +449,7 @@ int tfs_remove(fs_t *fs, char *filename)
     r = tfs->disk->read_block(tfs->disk, &req);
     if(r == 0) {
 	/* An error occured. */
-	semaphore_V(tfs->lock);
+	mutex_release(&tfs->lock);
 	return VFS_ERROR;
     }
 
@@ -471,7 +459,7 @@ int tfs_remove(fs_t *fs, char *filename)
     r = tfs->disk->read_block(tfs->disk, &req);
     if(r == 0) {
 	/* An error occured. */
-	semaphore_V(tfs->lock);
+	mutex_release(&tfs->lock);
 	return VFS_ERROR;
     }
 
@@ -494,7 +482,7 @@ int tfs_remove(fs_t *fs, char *filename)
     r = tfs->disk->write_block(tfs->disk, &req);
     if(r == 0) {
 	/* An error occured. */
-	semaphore_V(tfs->lock);
+	mutex_release(&tfs->lock);
 	return VFS_ERROR;
     }
 
@@ -504,11 +492,11 @@ int tfs_remove(fs_t *fs, char *filename)
     r = tfs->disk->write_block(tfs->disk, &req);
     if(r == 0) {
 	/* An error occured. */
-	semaphore_V(tfs->lock);
+	mutex_release(&tfs->lock);
 	return VFS_ERROR;
     }
 
-    semaphore_V(tfs->lock);
+    mutex_release(&tfs->lock);
     return VFS_OK;
 }
 
@@ -536,12 +524,12 @@ int tfs_read(fs_t *fs, int fileid, void *buffer, int bufsize, int offset)
     int read=0;
     int r;
 
-    semaphore_P(tfs->lock);
+    mutex_acquire(&tfs->lock);
 
     /* fileid is blocknum so ensure that we don't read system blocks
        or outside the disk */
     if(fileid < 2 || fileid > (int)tfs->totalblocks) {
-	semaphore_V(tfs->lock);
+	mutex_release(&tfs->lock);
 	return VFS_ERROR;
     }
 
@@ -551,13 +539,13 @@ int tfs_read(fs_t *fs, int fileid, void *buffer, int bufsize, int offset)
     r = tfs->disk->read_block(tfs->disk, &req);
     if(r == 0) {
 	/* An error occured. */
-	semaphore_V(tfs->lock);
+	mutex_release(&tfs->lock);
 	return VFS_ERROR;
     }   
 
     /* Check that offset is inside the file */
     if(offset < 0 || offset > (int)tfs->buffer_inode->filesize) {
-	semaphore_V(tfs->lock);
+	mutex_release(&tfs->lock);
 	return VFS_ERROR;
     }
 
@@ -565,7 +553,7 @@ int tfs_read(fs_t *fs, int fileid, void *buffer, int bufsize, int offset)
     bufsize = MIN(bufsize,((int)tfs->buffer_inode->filesize) - offset);
 
     if(bufsize==0) {
-	semaphore_V(tfs->lock);
+	mutex_release(&tfs->lock);
 	return 0;
     }
 
@@ -584,7 +572,7 @@ int tfs_read(fs_t *fs, int fileid, void *buffer, int bufsize, int offset)
     r = tfs->disk->read_block(tfs->disk, &req);
     if(r == 0) {
 	/* An error occured. */
-	semaphore_V(tfs->lock);
+	mutex_release(&tfs->lock);
 	return VFS_ERROR;
     }
 
@@ -605,7 +593,7 @@ int tfs_read(fs_t *fs, int fileid, void *buffer, int bufsize, int offset)
 	r = tfs->disk->read_block(tfs->disk, &req);
 	if(r == 0) {
 	    /* An error occured. */
-	    semaphore_V(tfs->lock);
+	    mutex_release(&tfs->lock);
 	    return VFS_ERROR;
 	}
 
@@ -627,7 +615,7 @@ int tfs_read(fs_t *fs, int fileid, void *buffer, int bufsize, int offset)
 	b1++;
     }
 
-    semaphore_V(tfs->lock);
+    mutex_release(&tfs->lock);
     return read;
 }
 
@@ -656,12 +644,12 @@ int tfs_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset)
     int written=0;
     int r;
 
-    semaphore_P(tfs->lock);
+    mutex_acquire(&tfs->lock);
 
     /* fileid is blocknum so ensure that we don't read system blocks
        or outside the disk */
     if(fileid < 2 || fileid > (int)tfs->totalblocks) {
-	semaphore_V(tfs->lock);
+	mutex_release(&tfs->lock);
 	return VFS_ERROR;
     }
  
@@ -671,13 +659,13 @@ int tfs_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset)
     r = tfs->disk->read_block(tfs->disk, &req);
     if(r == 0) {
 	/* An error occured. */
-	semaphore_V(tfs->lock);
+	mutex_release(&tfs->lock);
 	return VFS_ERROR;
     }
 
     /* check that start position is inside the disk */
     if(offset < 0 || offset > (int)tfs->buffer_inode->filesize) {
-	semaphore_V(tfs->lock);
+	mutex_release(&tfs->lock);
 	return VFS_ERROR;
     }
 
@@ -685,7 +673,7 @@ int tfs_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset)
     datasize = MIN(datasize,(int)tfs->buffer_inode->filesize-offset);
 
     if(datasize==0) {
-	semaphore_V(tfs->lock);
+	mutex_release(&tfs->lock);
 	return 0;
     }
 
@@ -711,7 +699,7 @@ int tfs_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset)
 	r = tfs->disk->read_block(tfs->disk, &req);
 	if(r == 0) {
 	    /* An error occured. */
-	    semaphore_V(tfs->lock);
+	    mutex_release(&tfs->lock);
 	    return VFS_ERROR;
 	}
     }
@@ -727,7 +715,7 @@ int tfs_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset)
     r = tfs->disk->write_block(tfs->disk, &req);
     if(r == 0) {
 	/* An error occured. */
-	semaphore_V(tfs->lock);
+	mutex_release(&tfs->lock);
 	return VFS_ERROR;
     }
 
@@ -745,7 +733,7 @@ int tfs_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset)
 		r = tfs->disk->read_block(tfs->disk, &req);
 		if(r == 0) {
 		    /* An error occured. */
-		    semaphore_V(tfs->lock);
+		    mutex_release(&tfs->lock);
 		    return VFS_ERROR;
 		}
 	    }
@@ -770,14 +758,14 @@ int tfs_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset)
 	r = tfs->disk->write_block(tfs->disk, &req);
 	if(r == 0) {
 	    /* An error occured. */
-	    semaphore_V(tfs->lock);
+	    mutex_release(&tfs->lock);
 	    return VFS_ERROR;
 	}
 
 	b1++;
     }
 
-    semaphore_V(tfs->lock);
+    mutex_release(&tfs->lock);
     return written;
 }
 
@@ -798,7 +786,7 @@ int tfs_getfree(fs_t *fs)
     uint32_t i;
     int r;
 
-    semaphore_P(tfs->lock);
+    mutex_acquire(&tfs->lock);
 
     req.block = TFS_ALLOCATION_BLOCK;
     req.buf = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_bat);
@@ -806,7 +794,7 @@ int tfs_getfree(fs_t *fs)
     r = tfs->disk->read_block(tfs->disk, &req);
     if(r == 0) {
 	/* An error occured. */
-	semaphore_V(tfs->lock);
+	mutex_release(&tfs->lock);
 	return VFS_ERROR;
     }
 
@@ -814,7 +802,7 @@ int tfs_getfree(fs_t *fs)
 	allocated += bitmap_get(tfs->buffer_bat,i);
     }
     
-    semaphore_V(tfs->lock);
+    mutex_release(&tfs->lock);
     return (tfs->totalblocks - allocated)*TFS_BLOCK_SIZE;
 }
 
@@ -829,7 +817,7 @@ int tfs_filecount(struct fs_struct *fs)
   filecount = filecount;
   tfs = (tfs_t *)fs->internal;
   
-  semaphore_P(tfs->lock);
+  mutex_acquire(&tfs->lock);
   
   req.block     = TFS_DIRECTORY_BLOCK;
   req.buf       = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_md);
@@ -837,7 +825,7 @@ int tfs_filecount(struct fs_struct *fs)
   r = tfs->disk->read_block(tfs->disk,&req);
   if(r == 0) {
     /* An error occured during read. */
-    semaphore_V(tfs->lock);
+    mutex_release(&tfs->lock);
     return VFS_ERROR;
   }
   
@@ -847,7 +835,7 @@ int tfs_filecount(struct fs_struct *fs)
     }
   }
   
-  semaphore_V(tfs->lock);
+  mutex_release(&tfs->lock);
   return filecount;
 }
 
@@ -860,7 +848,7 @@ int tfs_file(struct fs_struct *fs, int index, char* buffer){
   
   tfs = (tfs_t *)fs->internal;
   
-  semaphore_P(tfs->lock);
+  mutex_acquire(&tfs->lock);
   
   req.block     = TFS_DIRECTORY_BLOCK;
   req.buf       = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_md);
@@ -870,7 +858,7 @@ int tfs_file(struct fs_struct *fs, int index, char* buffer){
 
   if(r == 0) {
     /* An error occured during read. */
-    semaphore_V(tfs->lock);
+    mutex_release(&tfs->lock);
     return VFS_ERROR;
   }
   
@@ -882,14 +870,14 @@ int tfs_file(struct fs_struct *fs, int index, char* buffer){
   } 
   if(!(i<TFS_MAX_FILES)){
     err = -1; // error
-    semaphore_V(tfs->lock);
+    mutex_release(&tfs->lock);
     return err;
     
   }
   // copy i since when we are here i<TFS_MAX_FILES and i2 == index, ie we have been through index
   // number of real files
   stringcopy(buffer, tfs->buffer_md[i].name, VFS_NAME_LENGTH);
-  semaphore_V(tfs->lock);
+  mutex_release(&tfs->lock);
     
   return err;
 }
@@ -36,12 +36,18 @@
 
 #include "fs/vfs.h"
 #include "kernel/semaphore.h"
+#include "kernel/mutex.h"
+#include "kernel/rwlock.h"
+#include "kernel/spinlock.h"
 #include "kernel/assert.h"
 #include "kernel/config.h"
 #include "lib/libc.h"
 #include "drivers/device.h"
 #include "fs/tfs.h"
 #include "fs/filesystems.h"
+#include "fs/bcache.h"
+#include "vm/pagecache.h"
+#include "vm/swap.h"
 
 /** @name Virtual Filesystem
  *
@@ -75,8 +81,8 @@ typedef struct {
 
 /* Table of mounted filesystems. */
 static struct {
-    /* Binary semaphore for locking this table. */
-    semaphore_t *sem;
+    /* Reader-writer lock for this table. */
+    rwlock_t lock;
 
     /* Table of mounted filesystems. */
     vfs_entry_t filesystems[CONFIG_MAX_FILESYSTEMS];
@@ -85,8 +91,8 @@ static struct {
 
 /* Table of open files. */
 static struct {
-    /* Binary semaphore for locking this table. */
-    semaphore_t *sem;
+    /* Reader-writer lock for this table. */
+    rwlock_t lock;
 
     /* Table of open files. */
     openfile_entry_t files[CONFIG_MAX_OPEN_FILES];
@@ -96,15 +102,16 @@ static struct {
    used when shutting down the system so that the filesystems are
    clean. */
 
-/* Binary semaphore to synchronize access to vfs_ops and vfs_usable */
-static semaphore_t *vfs_op_sem;
+/* Mutex to serialize the forced unmount. The operations themselves
+   only update vfs_ops atomically. */
+static mutex_t vfs_op_lock;
 
 /* This semaphore is used to wake up the pending unmount operation
    when VFS is being shut down and all pending operations are
    complete */
 static semaphore_t *vfs_unmount_sem;
 
-/* The number of active operations on VFS */
+/* The number of active operations on VFS, updated with _atomic_cas */
 static int vfs_ops;
 
 /* Boolean which indicates whether VFS is currently usable. When VFS
@@ -112,6 +119,24 @@ static int vfs_ops;
    when halting the system. */
 static int vfs_usable = 0;
 
+/**
+ * Atomically adds delta to the number of active VFS operations.
+ *
+ * @param delta The change, 1 or -1
+ *
+ * @return The new number of operations
+ */
+static int vfs_ops_add(int delta)
+{
+    int old;
+
+    do {
+        old = vfs_ops;
+    } while (_atomic_cas(&vfs_ops, old, old + delta) != old);
+
+    return old + delta;
+}
+
 /**
  * Initializes Virtual Filesystem layer. This function is called
  * before virtual memory is enabled.
@@ -122,10 +147,8 @@ void vfs_init(void)
 {
     int i;
 
-    vfs_table.sem = semaphore_create(1);
-    openfile_table.sem = semaphore_create(1);
-
-    KERNEL_ASSERT(vfs_table.sem != NULL && openfile_table.sem != NULL);
+    rwlock_init(&vfs_table.lock);
+    rwlock_init(&openfile_table.lock);
 
     /* Clear table of mounted filesystems. */
     for(i=0; i<CONFIG_MAX_FILESYSTEMS; i++) {
@@ -137,12 +160,14 @@ void vfs_init(void)
 	openfile_table.files[i].filesystem = NULL;
     }
 
-    vfs_op_sem = semaphore_create(1);
+    mutex_init(&vfs_op_lock);
     vfs_unmount_sem = semaphore_create(0);
 
     vfs_ops = 0;
     vfs_usable = 1;
 
+    bcache_init();
+
     kprintf("VFS: Max filesystems: %d, Max open files: %d\n", 
 	    CONFIG_MAX_FILESYSTEMS, CONFIG_MAX_OPEN_FILES);
 }
@@ -158,23 +183,28 @@ void vfs_deinit(void)
 {
     fs_t *fs;
     int row;
+    int pending;
+    bcache_stats_t stats;
+
+    mutex_acquire(&vfs_op_lock);
 
-    semaphore_P(vfs_op_sem);
+    /* Hold an operation of our own while VFS is made unusable, so
+       that exactly one vfs_end_op sees the count drop to zero after
+       this and wakes us up. */
+    vfs_ops_add(1);
     vfs_usable = 0;
 
     kprintf("VFS: Entering forceful unmount of all filesystems.\n");
-    if (vfs_ops > 0) {
+    pending = vfs_ops_add(-1);
+    if (pending > 0) {
         kprintf("VFS: Delaying force unmount until the pending %d "
-                "operations are done.\n", vfs_ops);
-        semaphore_V(vfs_op_sem);
+                "operations are done.\n", pending);
         semaphore_P(vfs_unmount_sem);
-        semaphore_P(vfs_op_sem);
-        KERNEL_ASSERT(vfs_ops == 0);
         kprintf("VFS: Continuing forceful unmount.\n");
     }
 
-    semaphore_P(vfs_table.sem);
-    semaphore_P(openfile_table.sem);
+    rwlock_write_acquire(&vfs_table.lock);
+    rwlock_write_acquire(&openfile_table.lock);
     
     for (row = 0; row < CONFIG_MAX_FILESYSTEMS; row++) {
         fs = vfs_table.filesystems[row].filesystem;
@@ -186,9 +216,17 @@ void vfs_deinit(void)
         }
     }
 
-    semaphore_V(openfile_table.sem);
-    semaphore_V(vfs_table.sem);
-    semaphore_V(vfs_op_sem);
+    bcache_flush_all();
+    bcache_get_stats(&stats);
+    if (stats.lookups > 0)
+        kprintf("VFS: Block cache hit ratio %d%% (%d lookups, %d disk "
+                "reads, %d disk writes)\n",
+                stats.hits * 100 / stats.lookups, stats.lookups,
+                stats.disk_reads, stats.disk_writes);
+
+    rwlock_write_release(&openfile_table.lock);
+    rwlock_write_release(&vfs_table.lock);
+    mutex_release(&vfs_op_lock);
 }
 
 
@@ -242,7 +280,8 @@ int vfs_mount_fs(gbd_t *disk, char *volumename)
 }
 
 /**
- * Mounts all filesystems found in all disks of the system.
+ * Mounts all filesystems found in all disks of the system, except
+ * the swap disk.
  * Tries all known filesystems for all disks.
  *
  */
@@ -266,8 +305,12 @@ void vfs_mount_all(void)
 			"skipping\n");
 		continue;
 	    }
+
+	    /* The swap disk has no filesystem */
+	    if(gbd == swap_get_disk())
+		continue;
 	    
-	    vfs_mount_fs(gbd, NULL);
+	    vfs_mount_fs(bcache_attach(gbd), NULL);
 	}
     }
 
@@ -364,19 +407,17 @@ static int vfs_parse_pathname(char *pathname,
  */
 static int vfs_start_op()
 {
-    int ret = VFS_OK;
-
-    semaphore_P(vfs_op_sem);
+    vfs_ops_add(1);
 
-    if (vfs_usable) {
-        vfs_ops++;
-    } else {
-        ret = VFS_UNUSABLE;
+    /* vfs_deinit clears vfs_usable before it looks at the count, so
+       either it waits for this operation or we see it here. */
+    if (!vfs_usable) {
+        if (vfs_ops_add(-1) == 0)
+            semaphore_V(vfs_unmount_sem);
+        return VFS_UNUSABLE;
     }
 
-    semaphore_V(vfs_op_sem);
-
-    return ret;
+    return VFS_OK;
 }
 
 /**
@@ -384,20 +425,15 @@ static int vfs_start_op()
  */
 static void vfs_end_op()
 {
-    semaphore_P(vfs_op_sem);
+    int ops;
 
-    vfs_ops--;
+    ops = vfs_ops_add(-1);
 
-    KERNEL_ASSERT(vfs_ops >= 0);
+    KERNEL_ASSERT(ops >= 0);
 
     /* Wake up pending unmount if VFS is now idle. */
-    if (!vfs_usable && (vfs_ops == 0))
+    if (!vfs_usable && (ops == 0))
         semaphore_V(vfs_unmount_sem);
-
-    if (!vfs_usable && (vfs_ops > 0))
-        kprintf("VFS: %d operations still pending\n", vfs_ops);
-
-    semaphore_V(vfs_op_sem);
 }
 
 /**
@@ -424,7 +460,7 @@ int vfs_mount(fs_t *fs, char *name)
     if (vfs_start_op() != VFS_OK)
         return VFS_UNUSABLE;
 
-    semaphore_P(vfs_table.sem);
+    rwlock_write_acquire(&vfs_table.lock);
     
     for (i = 0; i < CONFIG_MAX_FILESYSTEMS; i++) {
 	if (vfs_table.filesystems[i].filesystem == NULL)
@@ -434,7 +470,7 @@ int vfs_mount(fs_t *fs, char *name)
     row = i;
 
     if(row >= CONFIG_MAX_FILESYSTEMS) {
-	semaphore_V(vfs_table.sem);
+	rwlock_write_release(&vfs_table.lock);
 	kprintf("VFS: Warning, maximum mount count exceeded, mount failed.\n");
         vfs_end_op();
 	return VFS_LIMIT;
@@ -442,7 +478,7 @@ int vfs_mount(fs_t *fs, char *name)
 
     for (i = 0; i < CONFIG_MAX_FILESYSTEMS; i++) {
 	if(stringcmp(vfs_table.filesystems[i].mountpoint, name) == 0) {
-	    semaphore_V(vfs_table.sem);
+	    rwlock_write_release(&vfs_table.lock);
 	    kprintf("VFS: Warning, attempt to mount 2 filesystems "
 		    "with same name\n");
             vfs_end_op();
@@ -453,7 +489,7 @@ int vfs_mount(fs_t *fs, char *name)
     stringcopy(vfs_table.filesystems[row].mountpoint, name, VFS_NAME_LENGTH);
     vfs_table.filesystems[row].filesystem = fs;
 
-    semaphore_V(vfs_table.sem);
+    rwlock_write_release(&vfs_table.lock);
     vfs_end_op();
     return VFS_OK;
 }
@@ -478,7 +514,7 @@ int vfs_unmount(char *name)
     if (vfs_start_op() != VFS_OK)
         return VFS_UNUSABLE;
 
-    semaphore_P(vfs_table.sem);
+    rwlock_write_acquire(&vfs_table.lock);
     
     for (row = 0; row < CONFIG_MAX_FILESYSTEMS; row++) {
 	if(!stringcmp(vfs_table.filesystems[row].mountpoint, name)) {
@@ -488,16 +524,16 @@ int vfs_unmount(char *name)
     }
 
     if(fs == NULL) {
-	semaphore_V(vfs_table.sem);
+	rwlock_write_release(&vfs_table.lock);
         vfs_end_op();
 	return VFS_NOT_FOUND;
     }
     
-    semaphore_P(openfile_table.sem);
+    rwlock_write_acquire(&openfile_table.lock);
     for(i = 0; i < CONFIG_MAX_OPEN_FILES; i++) {
 	if(openfile_table.files[i].filesystem == fs) {
-	    semaphore_V(openfile_table.sem);
-	    semaphore_V(vfs_table.sem);
+	    rwlock_write_release(&openfile_table.lock);
+	    rwlock_write_release(&vfs_table.lock);
             vfs_end_op();
 	    return VFS_IN_USE;
 	}
@@ -505,9 +541,10 @@ int vfs_unmount(char *name)
 
     fs->unmount(fs);
     vfs_table.filesystems[row].filesystem = NULL;
+    bcache_flush_all();
     
-    semaphore_V(openfile_table.sem);
-    semaphore_V(vfs_table.sem);
+    rwlock_write_release(&openfile_table.lock);
+    rwlock_write_release(&vfs_table.lock);
     vfs_end_op();
     return VFS_OK;
 }
@@ -539,8 +576,8 @@ openfile_t vfs_open(char *pathname)
 	return VFS_ERROR;
     }
 
-    semaphore_P(vfs_table.sem);
-    semaphore_P(openfile_table.sem);
+    rwlock_read_acquire(&vfs_table.lock);
+    rwlock_write_acquire(&openfile_table.lock);
     
     for(file=0; file<CONFIG_MAX_OPEN_FILES; file++) {
 	if(openfile_table.files[file].filesystem == NULL) {
@@ -550,8 +587,8 @@ openfile_t vfs_open(char *pathname)
 
 
     if(file >= CONFIG_MAX_OPEN_FILES) {
-	semaphore_V(openfile_table.sem);
-	semaphore_V(vfs_table.sem);
+	rwlock_write_release(&openfile_table.lock);
+	rwlock_read_release(&vfs_table.lock);
 	kprintf("VFS: Warning, maximum number of open files exceeded.");
         vfs_end_op();
 	return VFS_LIMIT;
@@ -561,23 +598,23 @@ openfile_t vfs_open(char *pathname)
     fs = vfs_get_filesystem(volumename);
 
     if(fs == NULL) {
-	semaphore_V(openfile_table.sem);
-	semaphore_V(vfs_table.sem);
+	rwlock_write_release(&openfile_table.lock);
+	rwlock_read_release(&vfs_table.lock);
         vfs_end_op();
 	return VFS_NO_SUCH_FS;
     }
 
     openfile_table.files[file].filesystem = fs;
 
-    semaphore_V(openfile_table.sem);
-    semaphore_V(vfs_table.sem);
+    rwlock_write_release(&openfile_table.lock);
+    rwlock_read_release(&vfs_table.lock);
 
     fileid = fs->open(fs, filename);
 
     if(fileid < 0) {
-	semaphore_P(openfile_table.sem);
+	rwlock_write_acquire(&openfile_table.lock);
 	openfile_table.files[file].filesystem = NULL;
-	semaphore_V(openfile_table.sem);
+	rwlock_write_release(&openfile_table.lock);
         vfs_end_op();
 	return fileid; /* negative -> error*/
     }
@@ -613,6 +650,29 @@ static openfile_entry_t *vfs_verify_open(openfile_t file)
 }
 
 
+/**
+ * Identifies the file behind an open file, e.g. for caching its
+ * contents.
+ *
+ * @param file Openfile id
+ *
+ * @param fs The filesystem of the file is stored here
+ *
+ * @return Filesystem specific id of the file.
+ *
+ */
+
+int vfs_get_fileid(openfile_t file, fs_t **fs)
+{
+    openfile_entry_t *openfile;
+
+    openfile = vfs_verify_open(file);
+    *fs = openfile->filesystem;
+
+    return openfile->fileid;
+}
+
+
 /**
  * Close open file.
  *
@@ -631,7 +691,7 @@ int vfs_close(openfile_t file)
     if (vfs_start_op() != VFS_OK)
         return VFS_UNUSABLE;
 
-    semaphore_P(openfile_table.sem);
+    rwlock_write_acquire(&openfile_table.lock);
 
     openfile = vfs_verify_open(file);
     fs = openfile->filesystem;
@@ -639,7 +699,7 @@ int vfs_close(openfile_t file)
     ret = fs->close(fs, openfile->fileid);
     openfile->filesystem = NULL;
 
-    semaphore_V(openfile_table.sem);
+    rwlock_write_release(&openfile_table.lock);
     
     vfs_end_op();
     return ret;
@@ -666,18 +726,38 @@ int vfs_seek(openfile_t file, int seek_position)
         return VFS_UNUSABLE;
 
     KERNEL_ASSERT(seek_position >= 0);
-    semaphore_P(openfile_table.sem);
+    rwlock_read_acquire(&openfile_table.lock);
 
     openfile = vfs_verify_open(file);
     openfile->seek_position = seek_position;
 
-    semaphore_V(openfile_table.sem);
+    rwlock_read_release(&openfile_table.lock);
 
     vfs_end_op();
     return VFS_OK;
 }
 
 
+/**
+ * Adds amount to the seek position of an open file. Called with the
+ * open file table locked for reading only, so other threads may
+ * update the same entry at the same time.
+ *
+ * @param openfile Open file table row
+ *
+ * @param amount Number of bytes to add
+ */
+
+static void vfs_advance_seek(openfile_entry_t *openfile, int amount)
+{
+    int pos;
+
+    do {
+	pos = openfile->seek_position;
+    } while (_atomic_cas(&openfile->seek_position, pos, pos + amount) != pos);
+}
+
+
 /**
  * Reads at most bufsize bytes from given open file to given buffer.
  * The read is started from current seek position and after read, the
@@ -712,9 +792,9 @@ int vfs_read(openfile_t file, void *buffer, int bufsize)
 			openfile->seek_position);
 
     if(ret > 0) {
-        semaphore_P(openfile_table.sem);
-	openfile->seek_position += ret;
-        semaphore_V(openfile_table.sem);
+        rwlock_read_acquire(&openfile_table.lock);
+	vfs_advance_seek(openfile, ret);
+        rwlock_read_release(&openfile_table.lock);
     }
 
     vfs_end_op();
@@ -756,9 +836,12 @@ int vfs_write(openfile_t file, void *buffer, int datasize)
 			 openfile->seek_position);
 
     if(ret > 0) {
-        semaphore_P(openfile_table.sem);
-	openfile->seek_position += ret;
-        semaphore_V(openfile_table.sem);
+        /* New processes must not run the old contents */
+        pagecache_invalidate(fs, openfile->fileid);
+
+        rwlock_read_acquire(&openfile_table.lock);
+	vfs_advance_seek(openfile, ret);
+        rwlock_read_release(&openfile_table.lock);
     }
 
     vfs_end_op();
@@ -794,19 +877,19 @@ int vfs_create(char *pathname, int size)
         return VFS_ERROR;
     }
 
-    semaphore_P(vfs_table.sem);
+    rwlock_read_acquire(&vfs_table.lock);
 
     fs = vfs_get_filesystem(volumename);
 
     if(fs == NULL) {
-	semaphore_V(vfs_table.sem);
+	rwlock_read_release(&vfs_table.lock);
         vfs_end_op();
 	return VFS_NO_SUCH_FS;
     }
 
     ret = fs->create(fs, filename, size);
     
-    semaphore_V(vfs_table.sem);
+    rwlock_read_release(&vfs_table.lock);
 
     vfs_end_op();
     return ret;
@@ -837,17 +920,25 @@ int vfs_remove(char *pathname)
         return VFS_ERROR;
     }
 
-    semaphore_P(vfs_table.sem);
+    rwlock_read_acquire(&vfs_table.lock);
     fs = vfs_get_filesystem(volumename);
     if(fs == NULL) {
-	semaphore_V(vfs_table.sem);
+	rwlock_read_release(&vfs_table.lock);
         vfs_end_op();
 	return VFS_NO_SUCH_FS;
     }
 
+    /* The file id may be reused by a new file, drop the cached pages
+       of this one */
+    ret = fs->open(fs, filename);
+    if (ret >= 0) {
+        pagecache_invalidate(fs, ret);
+        fs->close(fs, ret);
+    }
+
     ret = fs->remove(fs, filename);
     
-    semaphore_V(vfs_table.sem);
+    rwlock_read_release(&vfs_table.lock);
 
     vfs_end_op();
     return ret;
@@ -872,19 +963,19 @@ int vfs_getfree(char *filesystem)
     if (vfs_start_op() != VFS_OK)
         return VFS_UNUSABLE;
 
-    semaphore_P(vfs_table.sem);
+    rwlock_read_acquire(&vfs_table.lock);
 
     fs = vfs_get_filesystem(filesystem);
 
     if(fs == NULL) {
-	semaphore_V(vfs_table.sem);
+	rwlock_read_release(&vfs_table.lock);
         vfs_end_op();
 	return VFS_NO_SUCH_FS;
     }
 
     ret = fs->getfree(fs);
     
-    semaphore_V(vfs_table.sem);
+    rwlock_read_release(&vfs_table.lock);
     
     vfs_end_op();
     return ret;
@@ -897,8 +988,8 @@ int vfs_filecount(char *name){
   if (vfs_start_op() != VFS_OK)
     return VFS_UNUSABLE;
 
-  semaphore_P(vfs_table.sem);
-  semaphore_P(openfile_table.sem);
+  rwlock_read_acquire(&vfs_table.lock);
+  rwlock_read_acquire(&openfile_table.lock);
 
   if(name == NULL){ // return number of mounted file systems
     int i = 0;
@@ -908,8 +999,8 @@ int vfs_filecount(char *name){
       }
     }
     
-    semaphore_V(openfile_table.sem);
-    semaphore_V(vfs_table.sem);
+    rwlock_read_release(&openfile_table.lock);
+    rwlock_read_release(&vfs_table.lock);
     vfs_end_op();
     return filecount ;
   }
@@ -917,14 +1008,14 @@ int vfs_filecount(char *name){
   fs = vfs_get_filesystem(name);
 
   if(fs == NULL) {
-    semaphore_V(openfile_table.sem);
-    semaphore_V(vfs_table.sem);
+    rwlock_read_release(&openfile_table.lock);
+    rwlock_read_release(&vfs_table.lock);
     vfs_end_op();
     return VFS_NO_SUCH_FS;
   }
   
-  semaphore_V(openfile_table.sem);
-  semaphore_V(vfs_table.sem);
+  rwlock_read_release(&openfile_table.lock);
+  rwlock_read_release(&vfs_table.lock);
   
   // call the tfs function to get filecount
   filecount = fs->filecount(fs);
@@ -943,13 +1034,13 @@ int vfs_file(char* name, int index, char* buffer){
   if (vfs_start_op() != VFS_OK)
     return VFS_UNUSABLE;
 
-  semaphore_P(vfs_table.sem);
-  semaphore_P(openfile_table.sem);
+  rwlock_read_acquire(&vfs_table.lock);
+  rwlock_read_acquire(&openfile_table.lock);
 
   if(name == NULL){ // copy filesystem index
     stringcopy(buffer, vfs_table.filesystems[index].mountpoint, VFS_NAME_LENGTH);
-    semaphore_V(openfile_table.sem);
-    semaphore_V(vfs_table.sem);
+    rwlock_read_release(&openfile_table.lock);
+    rwlock_read_release(&vfs_table.lock);
     vfs_end_op();
     return 0 ;
   }
@@ -958,14 +1049,14 @@ int vfs_file(char* name, int index, char* buffer){
   
 
   if(fs == NULL) {
-    semaphore_V(openfile_table.sem);
-    semaphore_V(vfs_table.sem);
+    rwlock_read_release(&openfile_table.lock);
+    rwlock_read_release(&vfs_table.lock);
     vfs_end_op();
     return VFS_NO_SUCH_FS;
   }
   
-  semaphore_V(openfile_table.sem);
-  semaphore_V(vfs_table.sem);
+  rwlock_read_release(&openfile_table.lock);
+  rwlock_read_release(&vfs_table.lock);
   
   // call the tfs function to get filecount
   err = fs->file(fs, index, buffer);
@@ -153,6 +153,7 @@ int vfs_unmount(char *name);
 
 openfile_t vfs_open(char *pathname);
 int vfs_close(openfile_t file);
+int vfs_get_fileid(openfile_t file, fs_t **fs);
 int vfs_seek(openfile_t file, int seek_position);
 int vfs_read(openfile_t file, void *buffer, int bufsize);
 int vfs_write(openfile_t file, void *buffer, int datasize);
@@ -42,11 +42,13 @@
 #include "drivers/yams.h"
 #include "fs/vfs.h"
 #include "kernel/assert.h"
+#include "kernel/bench.h"
 #include "kernel/config.h"
 #include "kernel/halt.h"
 #include "kernel/idle.h"
 #include "kernel/interrupt.h"
 #include "kernel/kmalloc.h"
+#include "kernel/ktimer.h"
 #include "kernel/panic.h"
 #include "kernel/scheduler.h"
 #include "kernel/synch.h"
@@ -101,6 +103,22 @@ void init_startup_fallback(void)
     DEBUG("debuginit", "Console test done, %d bytes written\n", len);
   }
 
+  /* Run the mutex microbenchmark if "benchmutex" was given. */
+  if (bootargs_get("benchmutex") != NULL)
+    bench_mutex();
+
+  /* Run the page table microbenchmark if "benchvm" was given. */
+  if (bootargs_get("benchvm") != NULL)
+    bench_vm();
+
+  /* Run the page pool microbenchmark if "benchpagepool" was given. */
+  if (bootargs_get("benchpagepool") != NULL)
+    bench_pagepool();
+
+  /* Run the object cache microbenchmark if "benchslab" was given. */
+  if (bootargs_get("benchslab") != NULL)
+    bench_slab();
+
   /* Nothing else to do, so we shut the system down. */
   kprintf("Startup fallback code ends.\n");
   halt_kernel();
@@ -212,6 +230,9 @@ void init(void)
   kwrite("Initializing device drivers\n");
   device_init();
 
+  kwrite("Initializing kernel timers\n");
+  ktimer_init();
+
   kprintf("Initializing virtual filesystem\n");
   vfs_init();
 
@@ -0,0 +1,342 @@
+/*
+ * Kernel microbenchmarks
+ *
+ * Copyright (C) 2003 Juha Aatrokoski, Timo Lilja,
+ *   Leena Salmela, Teemu Takanen, Aleksi Virtanen.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "kernel/bench.h"
+#include "kernel/mutex.h"
+#include "kernel/semaphore.h"
+#include "kernel/thread.h"
+#include "kernel/assert.h"
+#include "kernel/slab.h"
+#include "kernel/config.h"
+#include "drivers/metadev.h"
+#include "vm/vm.h"
+#include "vm/pagepool.h"
+#include "lib/libc.h"
+
+/** @name Kernel microbenchmarks
+ *
+ * Microbenchmarks of kernel primitives. They are run from
+ * init_startup_fallback when the matching boot argument is given
+ * (e.g. "benchmutex") and print their results on the console.
+ *
+ * @{
+ */
+
+/* The benchmarks with threads run with 1 to this many of them */
+#define BENCH_MAX_THREADS 4
+
+/* Lock/unlock rounds done by each benchmark thread */
+#define BENCH_MUTEX_ROUNDS 5000
+
+static mutex_t bench_mutex_lock;
+static semaphore_t *bench_sem_lock;
+static semaphore_t *bench_done;
+static int bench_use_mutex;
+static volatile int bench_counter;
+
+/* Benchmark thread: increments the shared counter under the lock */
+static void bench_mutex_worker(uint32_t arg)
+{
+    int i;
+
+    arg = arg;
+
+    for (i = 0; i < BENCH_MUTEX_ROUNDS; i++) {
+	if (bench_use_mutex) {
+	    mutex_acquire(&bench_mutex_lock);
+	    bench_counter++;
+	    mutex_release(&bench_mutex_lock);
+	} else {
+	    semaphore_P(bench_sem_lock);
+	    bench_counter++;
+	    semaphore_V(bench_sem_lock);
+	}
+    }
+
+    semaphore_V(bench_done);
+}
+
+/* Runs the given number of benchmark threads and returns the time in
+ * milliseconds until all of them finished.
+ */
+static uint32_t bench_mutex_run(int use_mutex, int threads)
+{
+    uint32_t start;
+    int i;
+
+    bench_use_mutex = use_mutex;
+    bench_counter = 0;
+
+    start = rtc_get_msec();
+    for (i = 0; i < threads; i++)
+	thread_run(thread_create(&bench_mutex_worker, 0));
+    for (i = 0; i < threads; i++)
+	semaphore_P(bench_done);
+
+    KERNEL_ASSERT(bench_counter == threads * BENCH_MUTEX_ROUNDS);
+
+    return rtc_get_msec() - start;
+}
+
+/**
+ * Compares mutexes with semaphores used as locks. For 1 to
+ * BENCH_MAX_THREADS threads, measures the time it takes for each
+ * thread to increment a shared counter BENCH_MUTEX_ROUNDS times
+ * under the lock. With one thread the lock is never contended.
+ */
+void bench_mutex(void)
+{
+    int threads;
+    uint32_t sem_ms, mutex_ms;
+
+    mutex_init(&bench_mutex_lock);
+    bench_sem_lock = semaphore_create(1);
+    bench_done = semaphore_create(0);
+    KERNEL_ASSERT(bench_sem_lock != NULL && bench_done != NULL);
+
+    kprintf("Mutex benchmark, %d lock/unlock rounds per thread\n",
+	    BENCH_MUTEX_ROUNDS);
+    kprintf("threads  semaphore ms  mutex ms\n");
+
+    for (threads = 1; threads <= BENCH_MAX_THREADS; threads++) {
+	sem_ms = bench_mutex_run(0, threads);
+	mutex_ms = bench_mutex_run(1, threads);
+	kprintf("%7d  %12d  %8d\n", threads, sem_ms, mutex_ms);
+    }
+
+    semaphore_destroy(bench_done);
+    semaphore_destroy(bench_sem_lock);
+}
+
+/* Page table lookups done for each mapping count */
+#define BENCH_VM_LOOKUPS 20000
+
+/* Largest number of mapped pages, the benchmark starts from 16 pages
+   and quadruples the count on each round */
+#define BENCH_VM_MAX_PAGES 4096
+
+/* Base of the benchmark mappings. All of them map the same physical
+   page, which is never accessed. */
+#define BENCH_VM_BASE 0x10000000
+
+/**
+ * Measures the cost of page table lookups (as done on every TLB
+ * refill) as the number of mapped pages grows. For each mapping
+ * count, maps that many consecutive pages in a fresh page table and
+ * looks up BENCH_VM_LOOKUPS addresses spread over the mapped range.
+ */
+void bench_vm(void)
+{
+    pagetable_t *pagetable;
+    uint32_t pages, i, start, ms, phys_page;
+    pte_t *pte;
+
+    kprintf("Page table benchmark, %d lookups per round\n",
+	    BENCH_VM_LOOKUPS);
+    kprintf("  pages  lookup ms\n");
+
+    for (pages = 16; pages <= BENCH_VM_MAX_PAGES; pages *= 4) {
+	pagetable = vm_create_pagetable();
+	KERNEL_ASSERT(pagetable != NULL);
+
+	phys_page = pagepool_get_phys_page();
+	KERNEL_ASSERT(phys_page != 0);
+	for (i = 0; i < pages; i++) {
+	    /* Each mapping holds a reference, dropped on destroy */
+	    if (i > 0)
+		pagepool_ref_phys_page(phys_page);
+	    if (!vm_map(pagetable, phys_page, BENCH_VM_BASE + i * PAGE_SIZE, 1))
+		KERNEL_PANIC("Out of memory in the page table benchmark");
+	}
+
+	start = rtc_get_msec();
+	for (i = 0; i < BENCH_VM_LOOKUPS; i++) {
+	    /* Step through the pages in a scattered order */
+	    pte = vm_lookup(pagetable, BENCH_VM_BASE +
+			    ((i * 37) % pages) * PAGE_SIZE);
+	    KERNEL_ASSERT(pte != NULL && pte->V);
+	}
+	ms = rtc_get_msec() - start;
+
+	kprintf("%7d  %9d\n", pages, ms);
+
+	vm_destroy_pagetable(pagetable);
+    }
+}
+
+/* Allocate/free rounds done by each page pool benchmark thread */
+#define BENCH_PAGEPOOL_ROUNDS 2000
+
+/* Pages held at once by each thread */
+#define BENCH_PAGEPOOL_PAGES 4
+
+/* Benchmark thread: allocates and frees a few pages at a time */
+static void bench_pagepool_worker(uint32_t arg)
+{
+    uint32_t pages[BENCH_PAGEPOOL_PAGES];
+    int i, j;
+
+    arg = arg;
+
+    for (i = 0; i < BENCH_PAGEPOOL_ROUNDS; i++) {
+	for (j = 0; j < BENCH_PAGEPOOL_PAGES; j++) {
+	    pages[j] = pagepool_get_phys_page();
+	    KERNEL_ASSERT(pages[j] != 0);
+	}
+	for (j = 0; j < BENCH_PAGEPOOL_PAGES; j++)
+	    pagepool_free_phys_page(pages[j]);
+    }
+
+    semaphore_V(bench_done);
+}
+
+/**
+ * Measures single page allocation from the page pool. For 1 to
+ * BENCH_MAX_THREADS threads, each thread allocates and frees
+ * BENCH_PAGEPOOL_PAGES pages BENCH_PAGEPOOL_ROUNDS times. Reports the
+ * time, the number of times the global pool lock was taken and the
+ * number of operations served by the per-CPU caches. Build with
+ * CONFIG_PAGEPOOL_CPU_PAGES set to 0 to compare with the caches
+ * disabled.
+ */
+void bench_pagepool(void)
+{
+    pagepool_stats_t before, after;
+    uint32_t start, ms;
+    int threads, i;
+
+    bench_done = semaphore_create(0);
+    KERNEL_ASSERT(bench_done != NULL);
+
+    kprintf("Page pool benchmark, %d x %d pages per thread, "
+	    "%d cached pages per CPU\n", BENCH_PAGEPOOL_ROUNDS,
+	    BENCH_PAGEPOOL_PAGES, CONFIG_PAGEPOOL_CPU_PAGES);
+    kprintf("threads  ms  pool locks  cache hits\n");
+
+    for (threads = 1; threads <= BENCH_MAX_THREADS; threads++) {
+	pagepool_get_stats(&before);
+	start = rtc_get_msec();
+
+	for (i = 0; i < threads; i++)
+	    thread_run(thread_create(&bench_pagepool_worker, 0));
+	for (i = 0; i < threads; i++)
+	    semaphore_P(bench_done);
+
+	ms = rtc_get_msec() - start;
+	pagepool_get_stats(&after);
+
+	kprintf("%7d  %2d  %10d  %10d\n", threads, ms,
+		after.lock_acquisitions - before.lock_acquisitions,
+		after.magazine_hits - before.magazine_hits);
+    }
+
+    semaphore_destroy(bench_done);
+}
+
+/* Allocate/free rounds done by each object cache benchmark thread */
+#define BENCH_SLAB_ROUNDS 2000
+
+/* Objects held at once by each thread, more than a CPU cache holds so
+   that the slabs are used too */
+#define BENCH_SLAB_OBJECTS 12
+
+/* Size of the benchmark objects in bytes */
+#define BENCH_SLAB_SIZE 48
+
+static kmem_cache_t bench_slab_cache;
+
+/* Benchmark thread: allocates and frees a few objects at a time. Each
+ * object is filled with its owner's pattern and checked before it is
+ * freed, so objects handed out twice are caught. */
+static void bench_slab_worker(uint32_t arg)
+{
+    uint32_t *objects[BENCH_SLAB_OBJECTS];
+    int i, j, k;
+
+    for (i = 0; i < BENCH_SLAB_ROUNDS; i++) {
+	for (j = 0; j < BENCH_SLAB_OBJECTS; j++) {
+	    objects[j] = kmem_cache_alloc(&bench_slab_cache);
+	    KERNEL_ASSERT(objects[j] != NULL);
+	    for (k = 0; k < BENCH_SLAB_SIZE / 4; k++)
+		objects[j][k] = arg + j;
+	}
+	for (j = 0; j < BENCH_SLAB_OBJECTS; j++) {
+	    for (k = 0; k < BENCH_SLAB_SIZE / 4; k++)
+		KERNEL_ASSERT(objects[j][k] == arg + j);
+	    kmem_cache_free(&bench_slab_cache, objects[j]);
+	}
+    }
+
+    semaphore_V(bench_done);
+}
+
+/**
+ * Measures allocation from an object cache. For 1 to
+ * BENCH_MAX_THREADS threads, each thread allocates and frees
+ * BENCH_SLAB_OBJECTS objects of BENCH_SLAB_SIZE bytes
+ * BENCH_SLAB_ROUNDS times. Reports the time and the number of slabs
+ * the cache has afterwards, which stays small because empty slabs go
+ * back to the page pool.
+ */
+void bench_slab(void)
+{
+    uint32_t start, ms;
+    int threads, i;
+
+    bench_done = semaphore_create(0);
+    KERNEL_ASSERT(bench_done != NULL);
+
+    kmem_cache_init(&bench_slab_cache, "bench", BENCH_SLAB_SIZE);
+
+    kprintf("Object cache benchmark, %d x %d objects of %d bytes per "
+	    "thread\n", BENCH_SLAB_ROUNDS, BENCH_SLAB_OBJECTS,
+	    BENCH_SLAB_SIZE);
+    kprintf("threads  ms  slabs\n");
+
+    for (threads = 1; threads <= BENCH_MAX_THREADS; threads++) {
+	start = rtc_get_msec();
+
+	for (i = 0; i < threads; i++)
+	    thread_run(thread_create(&bench_slab_worker, i << 16));
+	for (i = 0; i < threads; i++)
+	    semaphore_P(bench_done);
+
+	ms = rtc_get_msec() - start;
+
+	kprintf("%7d  %2d  %5d\n", threads, ms, bench_slab_cache.slabs);
+    }
+
+    semaphore_destroy(bench_done);
+}
+
+/** @} */
@@ -40,9 +40,12 @@
 /* Define the maximum number of threads supported by the kernel 
  * Range from 2 (idle + init) to 256 (ASID size)
  */
-#define CONFIG_MAX_THREADS 32
+#define CONFIG_MAX_THREADS 128
 
-/* Size of the stack of a kernel thread */
+/* Size of the stack of a kernel thread. Stacks are allocated from
+ * the page pool when threads are created.
+ * Range from 1024 to 4096 (one page)
+ */
 #define CONFIG_THREAD_STACKSIZE 4096
 
 /* Define the maximum number of CPUs supported by the kernel
@@ -57,6 +60,38 @@
  */
 #define CONFIG_SCHEDULER_TIMESLICE 750
 
+/* Define to use the multilevel feedback queue scheduler instead of
+ * plain round robin. Can also be given in CHANGEDFLAGS of the Makefile.
+ */
+/* #define CONFIG_SCHEDULER_MLFQ */
+
+/* Number of priority levels in the multilevel feedback queue
+ * scheduler. Priority 0 is the highest. Thread priorities can be set
+ * in this range also when round robin is used, but they are ignored.
+ * Range from 2 to 32
+ */
+#define CONFIG_SCHEDULER_MLFQ_LEVELS 4
+
+/* Number of timer interrupts on a CPU after which all threads in the
+ * ready lists of that CPU are raised back to their base priority, so
+ * that demoted threads do not starve.
+ * Range from 1 to 100000
+ */
+#define CONFIG_SCHEDULER_MLFQ_BOOST 100
+
+/* Define to stop the timer of a CPU which has nothing to run and to
+ * stretch the timeslice of a thread which has no other threads
+ * waiting for its CPU. Undefine to get a timer interrupt every
+ * timeslice on every CPU.
+ */
+#define CONFIG_SCHEDULER_TICKLESS
+
+/* Multiplier of the timeslice of a thread which has no competition
+ * for its CPU in tickless mode.
+ * Range from 1 to 1000
+ */
+#define CONFIG_SCHEDULER_TICKLESS_STRETCH 16
+
 /* Sets the maximum number of boot arguments that the kernel will 
  * accept.
  * Range from 1 to 1024
@@ -68,6 +103,12 @@
  */
 #define CONFIG_MAX_SEMAPHORES 128
 
+/* Define how many rounds a thread spins on a mutex held by a thread
+ * running on another CPU before going to sleep. 0 disables spinning.
+ * Range from 0 to 100000
+ */
+#define CONFIG_MUTEX_SPIN 200
+
 /* Define maximum number of devices.
  * Range from 16 to 128
  */
@@ -111,4 +152,34 @@
  */
 #define CONFIG_USERLAND_STACK_SIZE 1
 
+/* Maximum number of executable pages shared through the page cache.
+ * Range from 1 to 4096
+ */
+#define CONFIG_PAGECACHE_PAGES 128
+
+/* Number of free pages cached by each CPU in front of the page pool,
+ * 0 disables the caches.
+ * Range from 0 to 64
+ */
+#define CONFIG_PAGEPOOL_CPU_PAGES 8
+
+/* Size of the large pages used with the boot argument "largepages",
+ * as the base 2 logarithm of the number of 4k pages (4 = 64k,
+ * 6 = 256k). Must be even.
+ * Range from 2 to 8
+ */
+#define CONFIG_VM_LARGE_PAGE_ORDER 4
+
+/* Number of 512 byte disk blocks kept in the block cache of the
+ * filesystems (fs/bcache.c).
+ * Range from 8 to 1024
+ */
+#define CONFIG_BCACHE_BLOCKS 64
+
+/* Delay in milliseconds after which the block cache writes modified
+ * blocks back to disk.
+ * Range from 100 to 60000
+ */
+#define CONFIG_BCACHE_FLUSH_MS 1000
+
 #endif /* BUENOS_CONFIG_H */
@@ -81,16 +81,22 @@ void kernel_exception_handle(int exception)
 
     switch(exception) {
     case EXCEPTION_TLBM:
-        print_tlb_debug();
-	KERNEL_PANIC("TLB Modification: not handled yet");
+	if (!tlb_modified_exception()) {
+	    print_tlb_debug();
+	    KERNEL_PANIC("TLB Modification: write to a read-only page");
+	}
 	break;
     case EXCEPTION_TLBL:
-        print_tlb_debug();
-	KERNEL_PANIC("TLB Load: not handled yet");
+	if (!tlb_load_exception()) {
+	    print_tlb_debug();
+	    KERNEL_PANIC("TLB Load: access to an unmapped page");
+	}
 	break;
     case EXCEPTION_TLBS:
-        print_tlb_debug();
-	KERNEL_PANIC("TLB Store: not handled yet");
+	if (!tlb_store_exception()) {
+	    print_tlb_debug();
+	    KERNEL_PANIC("TLB Store: access to an unmapped page");
+	}
 	break;
     case EXCEPTION_ADDRL:
 	print_tlb_debug();
@@ -185,18 +185,11 @@ void interrupt_handle(uint32_t cause) {
     if((cause & (INTERRUPT_CAUSE_SOFTWARE_0 |
 		 INTERRUPT_CAUSE_HARDWARE_5)) ||
        scheduler_current_thread[this_cpu] == IDLE_THREAD_TID) {
-	scheduler_schedule();
+	scheduler_schedule(cause);
 	
-	/* Until we have proper VM we must manually fill
-	   the TLB with pagetable entries before running code using
-	   given pagetable. Note that this method limits pagetable
-	   rows (possible mapping pairs) to 16 and can't be used
-	   with proper pagetables and VM.
-
-           Note that if you remove this call (which you probably do when
-           you implement proper VM), you must manually call _tlb_set_asid
-           here. See the implementation of tlb_fill on details how to do that.
-        */
-	tlb_fill(thread_get_current_thread_entry()->pagetable);
+	/* The TLB is filled on demand by the TLB exception handlers,
+	   here we only set the ASID of the new thread (and flush the
+	   TLB if it may hold stale mappings). */
+	tlb_switch(thread_get_current_thread_entry()->pagetable);
     }
 }
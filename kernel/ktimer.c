@@ -0,0 +1,314 @@
+/*
+ * Kernel timers (hierarchical timer wheel)
+ *
+ * Copyright (C) 2003 Juha Aatrokoski, Timo Lilja,
+ *   Leena Salmela, Teemu Takanen, Aleksi Virtanen.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "kernel/ktimer.h"
+#include "kernel/spinlock.h"
+#include "kernel/interrupt.h"
+#include "kernel/assert.h"
+#include "drivers/metadev.h"
+#include "lib/libc.h"
+
+/** @name Kernel timers
+ *
+ * Kernel timers call a function once a given number of milliseconds
+ * has passed. Pending timers are kept in a hierarchical timer wheel
+ * of KTIMER_LEVELS levels with KTIMER_SLOTS slots each. A slot of
+ * level 0 holds the timers expiring on one millisecond, a slot of
+ * level 1 the timers expiring during one 64 millisecond period and
+ * so on. Whenever level 0 wraps around, the current slot of level 1
+ * is cascaded down to level 0 (and likewise for the higher levels),
+ * so adding and cancelling a timer are O(1) and expiring a timer is
+ * O(KTIMER_LEVELS).
+ *
+ * The wheel is advanced to the time read from the system RTC by
+ * ktimer_run, which is called from the timer interrupt. The timer
+ * functions are called in interrupt context, after the wheel lock has
+ * been released, so they may add new timers but must not block.
+ *
+ * @{
+ */
+
+#define KTIMER_BITS 6
+#define KTIMER_SLOTS (1 << KTIMER_BITS)
+#define KTIMER_MASK (KTIMER_SLOTS - 1)
+#define KTIMER_LEVELS 4
+
+/* Longest delay which fits in the wheel, longer ones are clamped */
+#define KTIMER_MAX_DELAY ((1 << (KTIMER_BITS * KTIMER_LEVELS)) - 1)
+
+/* The wheel itself, each slot is a linked list of timers */
+static ktimer_t *ktimer_wheel[KTIMER_LEVELS][KTIMER_SLOTS];
+
+/* Time (msec) up to which the wheel has been run */
+static uint32_t ktimer_now;
+
+/* Number of timers in the wheel */
+static int ktimer_count;
+
+/* Protects all of the above and the links of pending timers */
+static spinlock_t ktimer_slock;
+
+/**
+ * Initializes the kernel timer wheel. Must be called after the
+ * system RTC has been initialized (device_init).
+ */
+void ktimer_init(void)
+{
+    int i, j;
+
+    for (i = 0; i < KTIMER_LEVELS; i++)
+	for (j = 0; j < KTIMER_SLOTS; j++)
+	    ktimer_wheel[i][j] = NULL;
+
+    ktimer_count = 0;
+    ktimer_now = rtc_get_msec();
+    spinlock_reset(&ktimer_slock);
+}
+
+/* Links the timer into the wheel slot matching its expiry time. The
+ * expiry time must not be before ktimer_now. The wheel lock must be
+ * held.
+ */
+static void ktimer_insert(ktimer_t *timer)
+{
+    uint32_t delta;
+    ktimer_t **slot;
+    int level;
+
+    delta = timer->expires - ktimer_now;
+    if (delta > KTIMER_MAX_DELAY) {
+	timer->expires = ktimer_now + KTIMER_MAX_DELAY;
+	delta = KTIMER_MAX_DELAY;
+    }
+
+    for (level = 0; level < KTIMER_LEVELS - 1; level++) {
+	if (delta < (1U << (KTIMER_BITS * (level + 1))))
+	    break;
+    }
+
+    slot = &ktimer_wheel[level][(timer->expires >> (KTIMER_BITS * level))
+				& KTIMER_MASK];
+
+    timer->next = *slot;
+    if (timer->next != NULL)
+	timer->next->pprev = &timer->next;
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+/* Unlinks the timer from its wheel slot. The wheel lock must be held.
+ */
+static void ktimer_unlink(ktimer_t *timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next != NULL)
+	timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/**
+ * Starts a timer which calls func(arg) after msec milliseconds. The
+ * timer must not be pending. Delays longer than the wheel can hold
+ * (about 4.6 hours) are clamped to the maximum.
+ *
+ * The timer structure is owned by the caller and must stay valid
+ * until the timer has expired or has been cancelled. If ktimer_cancel
+ * returns 0, the timer must not be added again before its function
+ * has returned.
+ *
+ * @param timer The timer to start
+ * @param msec Delay in milliseconds
+ * @param func Function to call when the timer expires
+ * @param arg Argument to func
+ */
+void ktimer_add(ktimer_t *timer, uint32_t msec,
+		void (*func)(void *arg), void *arg)
+{
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&ktimer_slock);
+
+    KERNEL_ASSERT(!timer->pending);
+
+    timer->func = func;
+    timer->arg = arg;
+    timer->expires = rtc_get_msec() + msec;
+    /* The current slot has already been run, so timers which are
+       already due expire on the next millisecond */
+    if ((int32_t)(timer->expires - ktimer_now) <= 0)
+	timer->expires = ktimer_now + 1;
+    timer->pending = 1;
+    ktimer_insert(timer);
+    ktimer_count++;
+
+    spinlock_release(&ktimer_slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Cancels a pending timer.
+ *
+ * @param timer The timer to cancel
+ *
+ * @return 1 if the timer was removed before it expired, 0 if it had
+ * already expired (its function may still be running on another
+ * CPU) or was never started.
+ */
+int ktimer_cancel(ktimer_t *timer)
+{
+    interrupt_status_t intr_status;
+    int removed = 0;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&ktimer_slock);
+
+    if (timer->pending) {
+	ktimer_unlink(timer);
+	timer->pending = 0;
+	ktimer_count--;
+	removed = 1;
+    }
+
+    spinlock_release(&ktimer_slock);
+    _interrupt_set_state(intr_status);
+
+    return removed;
+}
+
+/* Moves the timers in the current slot of the given level down to
+ * the lower levels. Returns the index of the cascaded slot. The wheel
+ * lock must be held.
+ */
+static int ktimer_cascade(int level)
+{
+    int index;
+    ktimer_t *timer, *next;
+
+    index = (ktimer_now >> (KTIMER_BITS * level)) & KTIMER_MASK;
+
+    timer = ktimer_wheel[level][index];
+    ktimer_wheel[level][index] = NULL;
+
+    while (timer != NULL) {
+	next = timer->next;
+	ktimer_insert(timer);
+	timer = next;
+    }
+
+    return index;
+}
+
+/**
+ * Advances the timer wheel to the current time and calls the
+ * functions of all expired timers. Called from the timer interrupt
+ * on every CPU; only one CPU at a time advances the wheel. Interrupts
+ * must be disabled.
+ */
+void ktimer_run(void)
+{
+    uint32_t target;
+    ktimer_t *expired, *timer;
+    void (*func)(void *arg);
+    void *arg;
+    int level;
+
+    /* Cheap unlocked check, nothing to do when the wheel is empty */
+    if (ktimer_count == 0)
+	return;
+
+    expired = NULL;
+
+    spinlock_acquire(&ktimer_slock);
+
+    target = rtc_get_msec();
+
+    while ((int32_t)(target - ktimer_now) > 0) {
+	if (ktimer_count == 0) {
+	    /* Nothing left, skip the rest of the period */
+	    ktimer_now = target;
+	    break;
+	}
+
+	ktimer_now++;
+
+	if ((ktimer_now & KTIMER_MASK) == 0) {
+	    for (level = 1; level < KTIMER_LEVELS; level++) {
+		if (ktimer_cascade(level) != 0)
+		    break;
+	    }
+	}
+
+	/* Everything in the current level 0 slot expires now */
+	timer = ktimer_wheel[0][ktimer_now & KTIMER_MASK];
+	ktimer_wheel[0][ktimer_now & KTIMER_MASK] = NULL;
+
+	while (timer != NULL) {
+	    ktimer_t *next = timer->next;
+
+	    timer->pending = 0;
+	    timer->pprev = NULL;
+	    timer->next = expired;
+	    expired = timer;
+	    ktimer_count--;
+
+	    timer = next;
+	}
+    }
+
+    spinlock_release(&ktimer_slock);
+
+    while (expired != NULL) {
+	timer = expired;
+	expired = timer->next;
+	timer->next = NULL;
+
+	func = timer->func;
+	arg = timer->arg;
+	func(arg);
+    }
+}
+
+/**
+ * Returns the number of pending timers. Used by the scheduler to keep
+ * the CPU timer running while there are timers to expire.
+ *
+ * @return Number of pending timers
+ */
+int ktimer_pending(void)
+{
+    return ktimer_count;
+}
+
+/** @} */
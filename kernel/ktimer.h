@@ -0,0 +1,63 @@
+/*
+ * Kernel timers (hierarchical timer wheel)
+ *
+ * Copyright (C) 2003 Juha Aatrokoski, Timo Lilja,
+ *   Leena Salmela, Teemu Takanen, Aleksi Virtanen.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BUENOS_KERNEL_KTIMER_H
+#define BUENOS_KERNEL_KTIMER_H
+
+#include "lib/types.h"
+
+/* A kernel timer. The fields are private to kernel/ktimer.c, callers
+ * only allocate the structure (zero filled) and pass it to ktimer_add.
+ */
+typedef struct ktimer_struct {
+    /* absolute expiry time in milliseconds since boot */
+    uint32_t expires;
+    /* function called (in interrupt context) when the timer expires */
+    void (*func)(void *arg);
+    void *arg;
+    /* links in the wheel slot: next timer and the pointer which
+       points to this timer */
+    struct ktimer_struct *next;
+    struct ktimer_struct **pprev;
+    /* non-zero while the timer is in the wheel */
+    int pending;
+} ktimer_t;
+
+void ktimer_init(void);
+void ktimer_add(ktimer_t *timer, uint32_t msec,
+                void (*func)(void *arg), void *arg);
+int ktimer_cancel(ktimer_t *timer);
+void ktimer_run(void);
+int ktimer_pending(void);
+
+#endif /* BUENOS_KERNEL_KTIMER_H */
@@ -6,7 +6,8 @@ MODULE := kernel
 
 FILES := cswitch.S panic.c kmalloc.c interrupt.c thread.c \
          scheduler.c _interrupt.S _spinlock.S idle.S sleepq.c semaphore.c \
-         exception.c halt.c
+         exception.c halt.c ktimer.c \
+         mutex.c rwlock.c bench.c slab.c
 
 SRC += $(patsubst %, $(MODULE)/%, $(FILES))
 
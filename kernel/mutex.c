@@ -0,0 +1,168 @@
+/*
+ * Kernel mutexes
+ *
+ * Copyright (C) 2003 Juha Aatrokoski, Timo Lilja,
+ *   Leena Salmela, Teemu Takanen, Aleksi Virtanen.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "kernel/mutex.h"
+#include "kernel/sleepq.h"
+#include "kernel/interrupt.h"
+#include "kernel/config.h"
+#include "kernel/assert.h"
+
+/** @name Mutexes
+ *
+ * A mutex is a sleeping lock with an owner, meant for short critical
+ * sections in threads. Unlike semaphores, mutexes are embedded in
+ * the data they protect and need not be created from a table.
+ *
+ * Acquiring a free mutex is a single compare and swap, without
+ * disabling interrupts or taking a spinlock. If the mutex is held by
+ * a thread running on another CPU, the acquiring thread spins for at
+ * most CONFIG_MUTEX_SPIN rounds, since the owner is likely to release
+ * the mutex soon. Otherwise the thread marks the mutex contended and
+ * sleeps in the sleep queue. Releasing a mutex which is not contended
+ * is again a single atomic operation.
+ *
+ * Mutexes must not be used in interrupt handlers.
+ *
+ * @{
+ */
+
+/* Values of mutex_t.state */
+#define MUTEX_FREE      0 /* not held */
+#define MUTEX_LOCKED    1 /* held, no sleepers */
+#define MUTEX_CONTENDED 2 /* held, there may be sleepers */
+
+extern thread_table_t thread_table[CONFIG_MAX_THREADS];
+
+/**
+ * Initializes a mutex to the free state.
+ *
+ * @param mutex The mutex to initialize
+ */
+void mutex_init(mutex_t *mutex)
+{
+    mutex->state = MUTEX_FREE;
+    mutex->owner = -1;
+    spinlock_reset(&mutex->slock);
+}
+
+/* Spins while the owner of the mutex is running on another CPU.
+ * Returns 1 if the mutex was acquired while spinning.
+ */
+static int mutex_spin(mutex_t *mutex)
+{
+    TID_t owner;
+    int i;
+
+    for (i = 0; i < CONFIG_MUTEX_SPIN; i++) {
+	owner = mutex->owner;
+	if (owner >= 0 && thread_table[owner].state != THREAD_RUNNING)
+	    return 0;
+
+	if (mutex->state == MUTEX_FREE
+	    && _atomic_cas((int *)&mutex->state, MUTEX_FREE,
+			   MUTEX_LOCKED) == MUTEX_FREE)
+	    return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Acquires a mutex, sleeping if it is held by another thread. The
+ * mutex is not recursive.
+ *
+ * @param mutex The mutex to acquire
+ */
+void mutex_acquire(mutex_t *mutex)
+{
+    interrupt_status_t intr_status;
+    TID_t my_tid;
+
+    my_tid = thread_get_current_thread();
+    KERNEL_ASSERT(mutex->owner != my_tid);
+
+    /* Fast path, the mutex is free */
+    if (_atomic_cas((int *)&mutex->state, MUTEX_FREE, MUTEX_LOCKED)
+	== MUTEX_FREE
+	|| mutex_spin(mutex)) {
+	mutex->owner = my_tid;
+	return;
+    }
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&mutex->slock);
+
+    /* Mark the mutex contended. If it was free, we got it (we cannot
+       know whether there are other sleepers, so it stays contended) */
+    while (_atomic_swap((int *)&mutex->state, MUTEX_CONTENDED)
+	   != MUTEX_FREE) {
+	sleepq_add(mutex);
+	spinlock_release(&mutex->slock);
+	thread_switch();
+	spinlock_acquire(&mutex->slock);
+    }
+
+    mutex->owner = my_tid;
+
+    spinlock_release(&mutex->slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Releases a mutex held by the current thread and wakes up one
+ * sleeping thread, if any.
+ *
+ * @param mutex The mutex to release
+ */
+void mutex_release(mutex_t *mutex)
+{
+    interrupt_status_t intr_status;
+
+    KERNEL_ASSERT(mutex->owner == thread_get_current_thread());
+
+    mutex->owner = -1;
+
+    /* Fast path, nobody is sleeping */
+    if (_atomic_swap((int *)&mutex->state, MUTEX_FREE) != MUTEX_CONTENDED)
+	return;
+
+    /* The sleepers add themselves to the sleep queue while holding
+       the spinlock, so taking it here ensures they are found */
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&mutex->slock);
+    sleepq_wake(mutex);
+    spinlock_release(&mutex->slock);
+    _interrupt_set_state(intr_status);
+}
+
+/** @} */
@@ -0,0 +1,251 @@
+/*
+ * Kernel reader-writer locks
+ *
+ * Copyright (C) 2003 Juha Aatrokoski, Timo Lilja,
+ *   Leena Salmela, Teemu Takanen, Aleksi Virtanen.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "kernel/rwlock.h"
+#include "kernel/sleepq.h"
+#include "kernel/thread.h"
+#include "kernel/interrupt.h"
+#include "kernel/assert.h"
+
+/** @name Reader-writer locks
+ *
+ * A reader-writer lock is held either by any number of readers or by
+ * one writer. It is meant for data which is read often and modified
+ * rarely, such as the VFS mount table.
+ *
+ * The lock state is one word holding the number of readers and the
+ * RWLOCK_WRITER and RWLOCK_WAITERS flags. As long as nobody sleeps on
+ * the lock, acquiring and releasing it are single compare and swap
+ * operations without interrupt disabling or spinlocks, so readers do
+ * not block each other.
+ *
+ * A thread which cannot get the lock sets RWLOCK_WAITERS and sleeps
+ * in the sleep queue, readers on read_waiters and writers on
+ * write_waiters. Once RWLOCK_WAITERS is set, new readers also take
+ * the slow path and give way to sleeping writers, so writers are
+ * not starved. When the last reader leaves, one writer is woken up;
+ * when a writer leaves, the sleeping readers are woken up if there
+ * are any and otherwise one writer. Woken readers do not give way to
+ * writers again, so readers are not starved either.
+ *
+ * Reader-writer locks must not be used in interrupt handlers.
+ *
+ * @{
+ */
+
+/* Flags in rwlock_t.state, the rest of the bits count readers */
+#define RWLOCK_WRITER  0x40000000 /* held by a writer */
+#define RWLOCK_WAITERS 0x20000000 /* there may be sleepers */
+#define RWLOCK_READERS 0x1fffffff /* mask for the reader count */
+
+/**
+ * Initializes a reader-writer lock to the free state.
+ *
+ * @param rwlock The lock to initialize
+ */
+void rwlock_init(rwlock_t *rwlock)
+{
+    rwlock->state = 0;
+    rwlock->read_waiters = 0;
+    rwlock->write_waiters = 0;
+    spinlock_reset(&rwlock->slock);
+}
+
+/* Returns RWLOCK_WAITERS if somebody sleeps on the lock, 0
+ * otherwise. The spinlock of the lock must be held.
+ */
+static int rwlock_waiters(rwlock_t *rwlock)
+{
+    return (rwlock->read_waiters + rwlock->write_waiters) > 0
+	? RWLOCK_WAITERS : 0;
+}
+
+/* Sets RWLOCK_WAITERS if the state is still s and puts the current
+ * thread to sleep on resource. Returns 0 without sleeping if the
+ * state had changed. The spinlock of the lock must be held and
+ * interrupts disabled; the spinlock is held again on return.
+ */
+static int rwlock_sleep(rwlock_t *rwlock, int s, int *waiters)
+{
+    if (!(s & RWLOCK_WAITERS)
+	&& _atomic_cas((int *)&rwlock->state, s, s | RWLOCK_WAITERS) != s)
+	return 0;
+
+    (*waiters)++;
+    sleepq_add(waiters);
+    spinlock_release(&rwlock->slock);
+    thread_switch();
+    spinlock_acquire(&rwlock->slock);
+    (*waiters)--;
+
+    return 1;
+}
+
+/**
+ * Acquires a reader-writer lock for reading.
+ *
+ * @param rwlock The lock to acquire
+ */
+void rwlock_read_acquire(rwlock_t *rwlock)
+{
+    interrupt_status_t intr_status;
+    int s, woken = 0;
+
+    /* Fast path, no writer and no sleepers */
+    s = rwlock->state;
+    if (!(s & (RWLOCK_WRITER | RWLOCK_WAITERS))
+	&& _atomic_cas((int *)&rwlock->state, s, s + 1) == s)
+	return;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&rwlock->slock);
+
+    for (;;) {
+	s = rwlock->state;
+	if (!(s & RWLOCK_WRITER)
+	    && (woken || rwlock->write_waiters == 0)) {
+	    if (_atomic_cas((int *)&rwlock->state, s,
+			    ((s & RWLOCK_READERS) + 1)
+			    | rwlock_waiters(rwlock)) == s)
+		break;
+	} else {
+	    woken |= rwlock_sleep(rwlock, s, &rwlock->read_waiters);
+	}
+    }
+
+    spinlock_release(&rwlock->slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Releases a reader-writer lock held for reading.
+ *
+ * @param rwlock The lock to release
+ */
+void rwlock_read_release(rwlock_t *rwlock)
+{
+    interrupt_status_t intr_status;
+    int s;
+
+    /* Fast path, nobody sleeping */
+    for (;;) {
+	s = rwlock->state;
+	KERNEL_ASSERT((s & RWLOCK_READERS) > 0);
+	if (s & RWLOCK_WAITERS)
+	    break;
+	if (_atomic_cas((int *)&rwlock->state, s, s - 1) == s)
+	    return;
+    }
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&rwlock->slock);
+
+    do {
+	s = rwlock->state;
+    } while (_atomic_cas((int *)&rwlock->state, s, s - 1) != s);
+
+    /* The last reader wakes up a writer */
+    if ((s & RWLOCK_READERS) == 1) {
+	if (rwlock->write_waiters > 0)
+	    sleepq_wake(&rwlock->write_waiters);
+	else if (rwlock->read_waiters > 0)
+	    sleepq_wake_all(&rwlock->read_waiters);
+    }
+
+    spinlock_release(&rwlock->slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Acquires a reader-writer lock for writing.
+ *
+ * @param rwlock The lock to acquire
+ */
+void rwlock_write_acquire(rwlock_t *rwlock)
+{
+    interrupt_status_t intr_status;
+    int s;
+
+    /* Fast path, the lock is free */
+    if (_atomic_cas((int *)&rwlock->state, 0, RWLOCK_WRITER) == 0)
+	return;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&rwlock->slock);
+
+    for (;;) {
+	s = rwlock->state;
+	if ((s & ~RWLOCK_WAITERS) == 0) {
+	    if (_atomic_cas((int *)&rwlock->state, s,
+			    RWLOCK_WRITER | rwlock_waiters(rwlock)) == s)
+		break;
+	} else {
+	    rwlock_sleep(rwlock, s, &rwlock->write_waiters);
+	}
+    }
+
+    spinlock_release(&rwlock->slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Releases a reader-writer lock held for writing.
+ *
+ * @param rwlock The lock to release
+ */
+void rwlock_write_release(rwlock_t *rwlock)
+{
+    interrupt_status_t intr_status;
+
+    KERNEL_ASSERT(rwlock->state & RWLOCK_WRITER);
+
+    /* Fast path, nobody sleeping */
+    if (_atomic_cas((int *)&rwlock->state, RWLOCK_WRITER, 0)
+	== RWLOCK_WRITER)
+	return;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&rwlock->slock);
+
+    rwlock->state = RWLOCK_WAITERS;
+
+    if (rwlock->read_waiters > 0)
+	sleepq_wake_all(&rwlock->read_waiters);
+    else if (rwlock->write_waiters > 0)
+	sleepq_wake(&rwlock->write_waiters);
+
+    spinlock_release(&rwlock->slock);
+    _interrupt_set_state(intr_status);
+}
+
+/** @} */
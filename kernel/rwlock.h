@@ -0,0 +1,55 @@
+/*
+ * Kernel reader-writer locks
+ *
+ * Copyright (C) 2003 Juha Aatrokoski, Timo Lilja,
+ *   Leena Salmela, Teemu Takanen, Aleksi Virtanen.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BUENOS_KERNEL_RWLOCK_H
+#define BUENOS_KERNEL_RWLOCK_H
+
+#include "kernel/spinlock.h"
+
+typedef struct {
+    /* reader count and RWLOCK_* flags (see rwlock.c) */
+    volatile int state;
+    /* number of sleeping readers and writers, protected by slock */
+    int read_waiters;
+    int write_waiters;
+    /* serializes sleepers with the releasing threads */
+    spinlock_t slock;
+} rwlock_t;
+
+void rwlock_init(rwlock_t *rwlock);
+void rwlock_read_acquire(rwlock_t *rwlock);
+void rwlock_read_release(rwlock_t *rwlock);
+void rwlock_write_acquire(rwlock_t *rwlock);
+void rwlock_write_release(rwlock_t *rwlock);
+
+#endif /* BUENOS_KERNEL_RWLOCK_H */
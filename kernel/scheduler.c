@@ -35,20 +35,55 @@
  */
 
 #include "kernel/thread.h"
+#include "kernel/scheduler.h"
 #include "kernel/spinlock.h"
 #include "kernel/assert.h"
 #include "kernel/panic.h"
 #include "kernel/interrupt.h"
 #include "lib/libc.h"
 #include "kernel/config.h"
+#include "kernel/ktimer.h"
 #include "drivers/timer.h"
+#include "drivers/device.h"
+#include "drivers/metadev.h"
 
 /** @name Scheduler
  *
- * This module implements simple round robin scheduler.
+ * This module implements simple round robin scheduler. Each CPU has
+ * its own list of threads ready to be run, protected by its own
+ * spinlock, so scheduling decisions on different CPUs do not
+ * contend with each other. A CPU whose own list is empty steals the
+ * first ready thread from the list of some other CPU before falling
+ * back to the idle thread.
+ *
+ * If CONFIG_SCHEDULER_MLFQ is defined, the scheduler is a multilevel
+ * feedback queue instead: each CPU has a ready list for every
+ * priority level and the highest priority ready thread is run. A
+ * thread which is preempted by the timer is demoted one level and
+ * gets a longer timeslice, and a thread woken up from the sleep
+ * queue is raised back to its base priority. Every
+ * CONFIG_SCHEDULER_MLFQ_BOOST timer interrupts all threads waiting
+ * on the CPU are raised back to their base priority.
+ *
+ * If CONFIG_SCHEDULER_TICKLESS is defined, a CPU running the idle
+ * thread does not keep its timer running. Instead, a CPU which has
+ * threads waiting on its ready lists sends an inter-CPU interrupt to
+ * a stopped CPU, which then steals work. A thread with no other
+ * threads waiting for its CPU gets a timeslice stretched by
+ * CONFIG_SCHEDULER_TICKLESS_STRETCH. While kernel timers are pending
+ * (see kernel/ktimer.c) timers are neither stopped nor stretched, so
+ * that the timers expire on time.
  *
  */
 
+#ifdef CONFIG_SCHEDULER_MLFQ
+#define SCHEDULER_LEVELS CONFIG_SCHEDULER_MLFQ_LEVELS
+#define SCHEDULER_LEVEL(t) (thread_table[(t)].priority)
+#else
+#define SCHEDULER_LEVELS 1
+#define SCHEDULER_LEVEL(t) 0
+#endif
+
 /* Import thread table and its lock from thread.c */
 extern spinlock_t thread_table_slock;
 extern thread_table_t thread_table[CONFIG_MAX_THREADS];
@@ -56,31 +91,159 @@ extern thread_table_t thread_table[CONFIG_MAX_THREADS];
 /** Currently running thread on each CPU */
 TID_t scheduler_current_thread[CONFIG_MAX_CPUS];
 
-/** List of threads ready to be run. */
+/** Mask of the CPUs present in the system */
+static uint32_t scheduler_cpu_mask;
+
+/* Timer states of a CPU */
+#define SCHEDULER_TIMER_NORMAL    0 /* normal timeslice */
+#define SCHEDULER_TIMER_STRETCHED 1 /* stretched timeslice, no competition */
+#define SCHEDULER_TIMER_STOPPED   2 /* idle, timer not running */
+
+/** Lists of threads ready to be run, one for each CPU and priority. */
 static struct {
-    TID_t head; /* the first thread in ready to run queue, negative if none */
-    TID_t tail; /* the last thread in ready to run queue, negative if none */
-} scheduler_ready_to_run = {-1, -1};
+    spinlock_t slock; /* protects the lists of this CPU */
+    /* the first thread in ready to run queue, negative if none */
+    TID_t head[SCHEDULER_LEVELS];
+    /* the last thread in ready to run queue, negative if none */
+    TID_t tail[SCHEDULER_LEVELS];
+    /* timer interrupts since the last priority boost */
+    int boost_ticks;
+    /* state of the timer of this CPU, SCHEDULER_TIMER_* */
+    int timer;
+    /* CPU status device used to interrupt this CPU, NULL if none */
+    device_t *cpu_device;
+    /* statistics, only updated by the CPU itself */
+    scheduler_stats_t stats;
+} scheduler_ready_to_run[CONFIG_MAX_CPUS];
 
 /**
- * Initializes the scheduler current thread table to 0 for each processor.
+ * Initializes the scheduler current thread table to 0 for each
+ * processor and empties the ready to run lists of all processors.
+ * Must be called after device_init.
  */
 void scheduler_init(void) {
-    int i;
-    for (i=0; i<CONFIG_MAX_CPUS; i++)
+    int i, j;
+
+    scheduler_cpu_mask = 0;
+    for (i=0; i<cpustatus_count() && i<CONFIG_MAX_CPUS; i++)
+	scheduler_cpu_mask |= 1U << i;
+
+    for (i=0; i<CONFIG_MAX_CPUS; i++) {
 	scheduler_current_thread[i] = 0;
+	spinlock_reset(&scheduler_ready_to_run[i].slock);
+	for (j=0; j<SCHEDULER_LEVELS; j++) {
+	    scheduler_ready_to_run[i].head[j] = -1;
+	    scheduler_ready_to_run[i].tail[j] = -1;
+	}
+	scheduler_ready_to_run[i].boost_ticks = 0;
+	scheduler_ready_to_run[i].timer = SCHEDULER_TIMER_NORMAL;
+	scheduler_ready_to_run[i].cpu_device =
+	    device_get(YAMS_TYPECODE_CPUSTATUS + i, 0);
+	memoryset(&scheduler_ready_to_run[i].stats, 0,
+		  sizeof(scheduler_stats_t));
+    }
 }
 
-/**
- * Adds given thread to scheduler's ready to run list. Doesn't do 
- * any synchronization, it is assumed that spinlock to the thread table
- * is held and interrups are disabled when calling this function.
- * 
- * @param t thread to add to ready list
- *
+/* Appends thread t to the ready list of given CPU and level. The
+ * spinlock of the CPU's ready lists must be held.
+ */
+static void scheduler_append(int cpu, int level, TID_t t)
+{
+    thread_table[t].next = -1;
+    if (scheduler_ready_to_run[cpu].tail[level] < 0) {
+	/* ready queue was empty */
+	scheduler_ready_to_run[cpu].head[level] = t;
+	scheduler_ready_to_run[cpu].tail[level] = t;
+    } else {
+	/* ready queue was not empty */
+	thread_table[scheduler_ready_to_run[cpu].tail[level]].next = t;
+	scheduler_ready_to_run[cpu].tail[level] = t;
+    }
+}
+
+/* Returns nonzero if the ready lists of given CPU are empty. Does
+ * not lock, the answer may be out of date immediately.
  */
+static int scheduler_ready_lists_empty(int cpu)
+{
+    int level;
 
-void scheduler_add_to_ready_list(TID_t t)
+    for (level = 0; level < SCHEDULER_LEVELS; level++) {
+	if (scheduler_ready_to_run[cpu].head[level] >= 0)
+	    return 0;
+    }
+    return 1;
+}
+
+#ifdef CONFIG_SCHEDULER_TICKLESS
+/* Sends an interrupt to given CPU, which makes it run the scheduler
+ * (see cpustatus_interrupt_handle). The timer state of the other CPU
+ * is changed without locking: at worst a CPU is interrupted
+ * needlessly or a CPU which is just leaving idle is not interrupted.
+ */
+static void scheduler_kick(int this_cpu, int cpu)
+{
+    if (scheduler_ready_to_run[cpu].cpu_device == NULL)
+	return;
+
+    scheduler_ready_to_run[cpu].timer = SCHEDULER_TIMER_NORMAL;
+    scheduler_ready_to_run[this_cpu].stats.idle_kicks++;
+    cpustatus_generate_irq(scheduler_ready_to_run[cpu].cpu_device);
+}
+
+/* Sends an interrupt to one CPU which is idle with its timer
+ * stopped, so that it steals the threads waiting on this CPU.
+ */
+static void scheduler_kick_idle_cpu(int this_cpu)
+{
+    int i, cpu;
+
+    for (i = 1; i < CONFIG_MAX_CPUS; i++) {
+	cpu = (this_cpu + i) % CONFIG_MAX_CPUS;
+	if (scheduler_ready_to_run[cpu].timer == SCHEDULER_TIMER_STOPPED
+	    && scheduler_ready_to_run[cpu].cpu_device != NULL) {
+	    scheduler_kick(this_cpu, cpu);
+	    return;
+	}
+    }
+}
+#endif
+
+/* Returns nonzero if thread t may run on given CPU. */
+static int scheduler_allowed(TID_t t, int cpu)
+{
+    return (thread_table[t].affinity & scheduler_cpu_mask & (1U << cpu)) != 0;
+}
+
+/* Chooses the CPU on whose ready list thread t is placed: the CPU it
+ * last ran on if its affinity allows, otherwise this CPU or the first
+ * allowed CPU.
+ */
+static int scheduler_choose_cpu(TID_t t, int this_cpu)
+{
+    int cpu;
+
+    cpu = thread_table[t].last_cpu;
+    if (cpu >= 0 && scheduler_allowed(t, cpu))
+	return cpu;
+
+    if (scheduler_allowed(t, this_cpu))
+	return this_cpu;
+
+    for (cpu = 0; cpu < CONFIG_MAX_CPUS; cpu++) {
+	if (scheduler_allowed(t, cpu))
+	    return cpu;
+    }
+
+    /* scheduler_set_affinity does not allow this to happen */
+    KERNEL_PANIC("Thread is not allowed to run on any CPU");
+    return this_cpu;
+}
+
+/* Adds given thread to the ready to run list of given CPU. Acquires
+ * the spinlock of the list.
+ */
+static void scheduler_enqueue(int cpu, TID_t t)
 {
     /* Idle thread should never go into the ready list */
     KERNEL_ASSERT(t != IDLE_THREAD_TID);
@@ -88,34 +251,91 @@ void scheduler_add_to_ready_list(TID_t t)
     /* Sanity check */
     KERNEL_ASSERT(t >= 0 && t < CONFIG_MAX_THREADS);
 
-    if (scheduler_ready_to_run.tail < 0) {
-	/* ready queue was empty */
-	scheduler_ready_to_run.head = t;
-	scheduler_ready_to_run.tail = t;
-	thread_table[t].next = -1;
-    } else {
-	/* ready queue was not empty */
-	thread_table[scheduler_ready_to_run.tail].next = t;
-	thread_table[t].next = -1;
-	scheduler_ready_to_run.tail = t;
+    spinlock_acquire(&scheduler_ready_to_run[cpu].slock);
+    scheduler_append(cpu, SCHEDULER_LEVEL(t), t);
+    spinlock_release(&scheduler_ready_to_run[cpu].slock);
+}
+
+/**
+ * Adds given thread to a ready to run list. The thread is placed on
+ * the list of the CPU it last ran on, if its affinity mask allows,
+ * so that it keeps its cache warm. The thread must already be in
+ * state THREAD_READY, since other CPUs may steal it as soon as it is
+ * on the list. Acquires the spinlock of the list, so interrupts must
+ * be disabled when calling this function. The thread table spinlock
+ * may be held by the caller.
+ * 
+ * @param t thread to add to ready list
+ *
+ */
+
+void scheduler_add_to_ready_list(TID_t t)
+{
+    int this_cpu, cpu;
+
+    this_cpu = _interrupt_getcpu();
+    cpu = scheduler_choose_cpu(t, this_cpu);
+
+    scheduler_enqueue(cpu, t);
+
+#ifdef CONFIG_SCHEDULER_TICKLESS
+    if (cpu != this_cpu) {
+	/* The other CPU might not look at its lists for a long time */
+	if (scheduler_ready_to_run[cpu].timer != SCHEDULER_TIMER_NORMAL)
+	    scheduler_kick(this_cpu, cpu);
+    } else if (scheduler_current_thread[this_cpu] != IDLE_THREAD_TID) {
+	/* If this CPU is idle it will run the thread right after the
+	   current interrupt. Otherwise the thread must not wait for a
+	   stretched timeslice, and an idle CPU could take it. */
+	if (scheduler_ready_to_run[this_cpu].timer
+	    == SCHEDULER_TIMER_STRETCHED) {
+	    scheduler_ready_to_run[this_cpu].timer = SCHEDULER_TIMER_NORMAL;
+	    timer_set_ticks(CONFIG_SCHEDULER_TIMESLICE);
+	}
+	scheduler_kick_idle_cpu(this_cpu);
     }
+#endif
 }
 
 /**
- * Removes the first thread from the ready to run list and returns it.
- * if the list was empty, returns the idle thread (TID 0). It is assumed
- * that interrupts are disabled and thread table spinlock is held when
- * this function is called.
+ * Removes the first thread of the highest priority which may run on
+ * CPU 'for_cpu' from the ready to run lists of CPU 'cpu' and returns
+ * it. If there is no such thread, returns a negative value. Acquires
+ * the spinlock of the lists, so interrupts must be disabled when
+ * calling this function.
  *
- * @return The removed thread.
+ * @param cpu The CPU whose ready lists are used.
+ *
+ * @param for_cpu The CPU which is going to run the thread.
+ *
+ * @return The removed thread, or negative if none was found.
  *
  */
 
-static TID_t scheduler_remove_first_ready(void)
+static TID_t scheduler_remove_first_ready(int cpu, int for_cpu)
 {
-    TID_t t;
-
-    t = scheduler_ready_to_run.head;
+    TID_t t, prev;
+    int level;
+
+    /* Peek without locking, empty lists are the common case when
+       looking for threads to steal. */
+    if (scheduler_ready_lists_empty(cpu))
+	return -1;
+
+    spinlock_acquire(&scheduler_ready_to_run[cpu].slock);
+
+    t = -1;
+    prev = -1;
+    for (level = 0; level < SCHEDULER_LEVELS; level++) {
+	prev = -1;
+	t = scheduler_ready_to_run[cpu].head[level];
+	while (t >= 0 && !scheduler_allowed(t, for_cpu)) {
+	    prev = t;
+	    t = thread_table[t].next;
+	}
+	if (t >= 0)
+	    break;
+    }
 
     /* Idle thread should never be on the ready list. */
     KERNEL_ASSERT(t != IDLE_THREAD_TID);
@@ -123,25 +343,55 @@ static TID_t scheduler_remove_first_ready(void)
     if(t >= 0) {
         /* Threads in ready queue should be in state Ready */
         KERNEL_ASSERT(thread_table[t].state == THREAD_READY);
-	if(scheduler_ready_to_run.tail == t) {
-	    scheduler_ready_to_run.tail = -1;
+	if(scheduler_ready_to_run[cpu].tail[level] == t) {
+	    scheduler_ready_to_run[cpu].tail[level] = prev;
+	}
+	if (prev < 0) {
+	    scheduler_ready_to_run[cpu].head[level] = thread_table[t].next;
+	} else {
+	    thread_table[prev].next = thread_table[t].next;
 	}
-	scheduler_ready_to_run.head =
-	    thread_table[scheduler_ready_to_run.head].next;
-
     }
 
-    if(t < 0) {
-	return IDLE_THREAD_TID;
-    } else {
-	return t;
+    spinlock_release(&scheduler_ready_to_run[cpu].slock);
+
+    return t;
+}
+
+#ifdef CONFIG_SCHEDULER_MLFQ
+/* Raises all threads on the lower priority ready lists of the given
+ * CPU back to their base priority. Acquires the spinlock of the
+ * lists, so interrupts must be disabled.
+ */
+static void scheduler_boost(int cpu)
+{
+    TID_t t, next;
+    int level;
+
+    spinlock_acquire(&scheduler_ready_to_run[cpu].slock);
+
+    for (level = 1; level < SCHEDULER_LEVELS; level++) {
+	t = scheduler_ready_to_run[cpu].head[level];
+	scheduler_ready_to_run[cpu].head[level] = -1;
+	scheduler_ready_to_run[cpu].tail[level] = -1;
+
+	while (t >= 0) {
+	    next = thread_table[t].next;
+	    thread_table[t].priority = thread_table[t].base_priority;
+	    scheduler_append(cpu, thread_table[t].priority, t);
+	    t = next;
+	}
     }
+
+    spinlock_release(&scheduler_ready_to_run[cpu].slock);
 }
+#endif
 
 /**
  * Adds given thread to scheduler's ready to run list. This function
  * handles syncronization and can be called from anywhere where
- * needed. Must not be called if thread table spinlock is already held.
+ * needed. Must not be called if the ready list spinlock of the
+ * current CPU is already held.
  *
  * @param t Thread to add. The thread must not already be on the ready
  * list or running.
@@ -154,65 +404,245 @@ void scheduler_add_ready(TID_t t)
     
     intr_status = _interrupt_disable();
 
-    spinlock_acquire(&thread_table_slock);
-
-    scheduler_add_to_ready_list(t);
     thread_table[t].state = THREAD_READY;
+    scheduler_add_to_ready_list(t);
+
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Sets the base priority of given thread and resets its current
+ * priority to it. The new priority takes effect the next time the
+ * thread is placed on a ready list. Priorities are stored but
+ * ignored by the round robin scheduler.
+ *
+ * @param t The thread whose priority is set.
+ *
+ * @param priority The new priority, from SCHEDULER_PRIORITY_HIGHEST
+ * to SCHEDULER_PRIORITY_LOWEST.
+ *
+ * @return The previous base priority of the thread, or negative if
+ * the priority was out of range.
+ */
+int scheduler_set_priority(TID_t t, int priority)
+{
+    int old;
+
+    KERNEL_ASSERT(t > IDLE_THREAD_TID && t < CONFIG_MAX_THREADS);
+
+    if (priority < SCHEDULER_PRIORITY_HIGHEST
+	|| priority > SCHEDULER_PRIORITY_LOWEST)
+	return -1;
+
+    old = thread_table[t].base_priority;
+    thread_table[t].base_priority = priority;
+    thread_table[t].priority = priority;
+
+    return old;
+}
+
+/**
+ * Sets the CPU affinity mask of given thread. The thread will only
+ * be run on CPUs whose bit (1 << CPU number) is set in the mask. If
+ * the calling thread excludes the CPU it is running on, it moves to
+ * an allowed CPU before this function returns.
+ *
+ * @param t The thread whose affinity is set.
+ *
+ * @param mask The new affinity mask. Must include at least one CPU
+ * present in the system.
+ *
+ * @return The previous affinity mask of the thread, or 0 if the mask
+ * did not include any CPU present in the system.
+ */
+uint32_t scheduler_set_affinity(TID_t t, uint32_t mask)
+{
+    uint32_t old;
+    interrupt_status_t intr_status;
+    int move;
+
+    KERNEL_ASSERT(t > IDLE_THREAD_TID && t < CONFIG_MAX_THREADS);
 
-    spinlock_release(&thread_table_slock);
+    if ((mask & scheduler_cpu_mask) == 0)
+	return 0;
+
+    intr_status = _interrupt_disable();
+
+    old = thread_table[t].affinity;
+    thread_table[t].affinity = mask;
+    move = (t == scheduler_current_thread[_interrupt_getcpu()]
+	    && !scheduler_allowed(t, _interrupt_getcpu()));
 
     _interrupt_set_state(intr_status);
+
+    /* The scheduler places the thread on an allowed CPU */
+    if (move)
+	thread_switch();
+
+    return old;
+}
+
+/**
+ * Returns the scheduler statistics of given CPU. The counters are
+ * updated without locking by the CPU itself.
+ *
+ * @param cpu The CPU whose statistics are returned.
+ *
+ * @return The statistics, or NULL if cpu is out of range.
+ */
+const scheduler_stats_t *scheduler_get_stats(int cpu)
+{
+    if (cpu < 0 || cpu >= CONFIG_MAX_CPUS)
+	return NULL;
+
+    return &scheduler_ready_to_run[cpu].stats;
 }
 
 
 /**
  * Select next thread for running. Removes the currently running
  * thread running on this CPU and selects new running thread.
- * Circulates threads in round robin manner. Must be called only from
- * interrupt/exception handlers and code assumes that interrupts are
- * disabled (which is the case in interrupt handlers).
+ * Circulates threads in round robin manner (within each priority
+ * level). Must be called only from interrupt/exception handlers and
+ * code assumes that interrupts are disabled (which is the case in
+ * interrupt handlers).
  *
- * Scheduler also handles thread table row freeing when thread is
- * DYING and removes threads wishing to sleep (sleeps_on != 0) from
- * ready status and places them SLEEPING. Syncronizes access to thread
- * table by acquiring the thread table spinlock.
+ * Scheduler also frees the thread table row of a DYING thread with
+ * thread_reap and removes threads wishing to sleep (sleeps_on != 0)
+ * from ready status and places them SLEEPING. Only these two transitions
+ * need the thread table spinlock; the common case of rotating a
+ * preempted thread touches only the ready list of this CPU. If this
+ * CPU has nothing to run, a ready thread is stolen from another CPU.
  *
  * After selecting new thread for running the scheduler will reset the
  * CP0 timer to cause timer interrupt after thread's timeslice is
- * over.
+ * over. In tickless mode the timer is stopped instead if there is
+ * nothing to run, and the timeslice is stretched if the new thread
+ * has no competition.
+ *
+ * @param cause The Cause register from CP0. A timer interrupt means
+ * that the running thread used up its whole timeslice.
  *
  */
 
-void scheduler_schedule(void)
+void scheduler_schedule(uint32_t cause)
 {
     TID_t t;
     thread_table_t *current_thread;
-    int this_cpu;
+    int this_cpu, cpu, i;
+    uint32_t timeslice;
 
     this_cpu = _interrupt_getcpu();
 
-    spinlock_acquire(&thread_table_slock);
-
     current_thread = &(thread_table[scheduler_current_thread[this_cpu]]);
 
+    if (cause & INTERRUPT_CAUSE_HARDWARE_5) {
+	scheduler_ready_to_run[this_cpu].stats.timer_interrupts++;
+	/* Expire kernel timers, this may wake up sleeping threads */
+	ktimer_run();
+    }
+
+#ifdef CONFIG_SCHEDULER_MLFQ
+    if (cause & INTERRUPT_CAUSE_HARDWARE_5) {
+	/* Demote threads which used their whole timeslice */
+	if (current_thread->priority < SCHEDULER_PRIORITY_LOWEST)
+	    current_thread->priority++;
+
+	if (++scheduler_ready_to_run[this_cpu].boost_ticks
+	    >= CONFIG_SCHEDULER_MLFQ_BOOST) {
+	    scheduler_ready_to_run[this_cpu].boost_ticks = 0;
+	    scheduler_boost(this_cpu);
+	}
+    }
+#endif
+
+    thread_check_stack(scheduler_current_thread[this_cpu]);
+
     if(current_thread->state == THREAD_DYING) {
-	current_thread->state = THREAD_FREE;
+	thread_reap(scheduler_current_thread[this_cpu]);
     } else if(current_thread->sleeps_on != 0) {
-	current_thread->state = THREAD_SLEEPING;
-    } else {
-	if(scheduler_current_thread[this_cpu] != IDLE_THREAD_TID)
+	/* sleepq_wake may clear sleeps_on concurrently, so decide
+	   under the thread table spinlock. Only the thread itself
+	   sets sleeps_on, so a zero value needs no locking. */
+	spinlock_acquire(&thread_table_slock);
+	if (current_thread->sleeps_on != 0) {
+	    current_thread->state = THREAD_SLEEPING;
+	} else {
+	    current_thread->state = THREAD_READY;
 	    scheduler_add_to_ready_list(scheduler_current_thread[this_cpu]);
+	}
+	spinlock_release(&thread_table_slock);
+    } else {
 	current_thread->state = THREAD_READY;
+	if(scheduler_current_thread[this_cpu] != IDLE_THREAD_TID) {
+	    cpu = scheduler_choose_cpu(scheduler_current_thread[this_cpu],
+				       this_cpu);
+	    scheduler_enqueue(cpu, scheduler_current_thread[this_cpu]);
+#ifdef CONFIG_SCHEDULER_TICKLESS
+	    /* The thread moves away when its affinity excludes this
+	       CPU, and the other CPU may be idle with its timer
+	       stopped */
+	    if (cpu != this_cpu
+		&& scheduler_ready_to_run[cpu].timer != SCHEDULER_TIMER_NORMAL)
+		scheduler_kick(this_cpu, cpu);
+#endif
+	}
     }
 
-    t = scheduler_remove_first_ready();
+    t = scheduler_remove_first_ready(this_cpu, this_cpu);
+
+    /* Nothing to run locally, try to steal from other CPUs */
+    for (i = 1; t < 0 && i < CONFIG_MAX_CPUS; i++)
+	t = scheduler_remove_first_ready((this_cpu + i) % CONFIG_MAX_CPUS,
+					 this_cpu);
+
+    if (t < 0)
+	t = IDLE_THREAD_TID;
+
     thread_table[t].state = THREAD_RUNNING;
 
-    spinlock_release(&thread_table_slock);
+    if (t != scheduler_current_thread[this_cpu])
+	scheduler_ready_to_run[this_cpu].stats.switches++;
+
+    if (t != IDLE_THREAD_TID) {
+	if (thread_table[t].last_cpu >= 0
+	    && thread_table[t].last_cpu != this_cpu)
+	    scheduler_ready_to_run[this_cpu].stats.migrations++;
+	thread_table[t].last_cpu = this_cpu;
+    }
 
     scheduler_current_thread[this_cpu] = t;
 
-    /* Schedule timer interrupt to occur after thread timeslice is spent */
-    timer_set_ticks(_get_rand(CONFIG_SCHEDULER_TIMESLICE) + 
-                    CONFIG_SCHEDULER_TIMESLICE / 2);
+    /* Schedule timer interrupt to occur after thread timeslice is
+       spent. Lower priority levels get longer timeslices. */
+    timeslice = (_get_rand(CONFIG_SCHEDULER_TIMESLICE) + 
+                 CONFIG_SCHEDULER_TIMESLICE / 2) << SCHEDULER_LEVEL(t);
+
+#ifdef CONFIG_SCHEDULER_TICKLESS
+    if (t == IDLE_THREAD_TID && !ktimer_pending()) {
+	/* Nothing to run, sleep until some interrupt arrives */
+	if (scheduler_ready_to_run[this_cpu].timer != SCHEDULER_TIMER_STOPPED)
+	    scheduler_ready_to_run[this_cpu].stats.tickless_idle++;
+	scheduler_ready_to_run[this_cpu].timer = SCHEDULER_TIMER_STOPPED;
+	timer_stop();
+	return;
+    }
+
+    if (t == IDLE_THREAD_TID || scheduler_ready_lists_empty(this_cpu)) {
+	if (t == IDLE_THREAD_TID || ktimer_pending()) {
+	    /* Keep ticking to expire the pending kernel timers */
+	    scheduler_ready_to_run[this_cpu].timer = SCHEDULER_TIMER_NORMAL;
+	} else {
+	    scheduler_ready_to_run[this_cpu].timer = SCHEDULER_TIMER_STRETCHED;
+	    scheduler_ready_to_run[this_cpu].stats.stretched_slices++;
+	    timeslice *= CONFIG_SCHEDULER_TICKLESS_STRETCH;
+	}
+    } else {
+	/* Others are waiting here, let an idle CPU help */
+	scheduler_ready_to_run[this_cpu].timer = SCHEDULER_TIMER_NORMAL;
+	scheduler_kick_idle_cpu(this_cpu);
+    }
+#endif
+
+    timer_set_ticks(timeslice);
 }
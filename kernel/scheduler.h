@@ -38,10 +38,34 @@
 #define BUENOS_KERNEL_SCHEDULER_H
 
 #include "kernel/thread.h"
+#include "kernel/config.h"
+
+/* Thread priorities, 0 is the highest */
+#define SCHEDULER_PRIORITY_HIGHEST 0
+#define SCHEDULER_PRIORITY_LOWEST (CONFIG_SCHEDULER_MLFQ_LEVELS - 1)
+
+/* Per-CPU scheduler statistics */
+typedef struct {
+    /* timer interrupts handled */
+    uint32_t timer_interrupts;
+    /* switches to a different thread */
+    uint32_t switches;
+    /* times the CPU went idle with its timer stopped (tickless) */
+    uint32_t tickless_idle;
+    /* timeslices stretched because of no competition (tickless) */
+    uint32_t stretched_slices;
+    /* interrupts sent to idle CPUs to make them steal work (tickless) */
+    uint32_t idle_kicks;
+    /* threads started on this CPU after last running on another one */
+    uint32_t migrations;
+} scheduler_stats_t;
 
 /* function definitions */
 void scheduler_init(void);
 void scheduler_add_ready(TID_t t);
-void scheduler_schedule(void);
+int scheduler_set_priority(TID_t t, int priority);
+uint32_t scheduler_set_affinity(TID_t t, uint32_t mask);
+void scheduler_schedule(uint32_t cause);
+const scheduler_stats_t *scheduler_get_stats(int cpu);
 
 #endif /* BUENOS_KERNEL_SCHEDULER_H */
@@ -39,12 +39,17 @@
 #include "kernel/sleepq.h"
 #include "kernel/config.h"
 #include "kernel/assert.h"
+#include "kernel/slab.h"
 #include "lib/libc.h"
 
 /** @name Semaphores
  *
  * This module implements semaphores.
  *
+ * Semaphores are taken from a static table, which is available during
+ * boot. Once the table is full, more semaphores are allocated from an
+ * object cache.
+ *
  * @{
  */
 
@@ -54,6 +59,9 @@ static semaphore_t semaphore_table[CONFIG_MAX_SEMAPHORES];
 /** Lock which must be held before accessing the semaphore_table */
 static spinlock_t semaphore_table_slock;
 
+/** Semaphores created when the table is full */
+static kmem_cache_t semaphore_cache;
+
 /**
  * Initializes semaphore subsystem. Sets all system semaphores
  * as unreserved (non-existing).
@@ -66,6 +74,8 @@ void semaphore_init(void)
     spinlock_reset(&semaphore_table_slock);
     for(i = 0; i < CONFIG_MAX_SEMAPHORES; i++)
         semaphore_table[i].creator = -1;
+
+    kmem_cache_init(&semaphore_cache, "semaphore", sizeof(semaphore_t));
 }
 
 /**
@@ -74,7 +84,7 @@ void semaphore_init(void)
  *
  * @param value Initial value of the created semaphore
  *
- * @return Pointer to the created semaphore
+ * @return Pointer to the created semaphore, NULL if out of memory
  *
  * @see semaphore_destroy
  */
@@ -85,6 +95,7 @@ semaphore_t *semaphore_create(int value)
     static int next = 0;
     int i;
     int sem_id;
+    semaphore_t *sem;
 
     KERNEL_ASSERT(value >= 0);
 
@@ -105,14 +116,19 @@ semaphore_t *semaphore_create(int value)
     _interrupt_set_state(intr_status);
 
     if (i == CONFIG_MAX_SEMAPHORES) {
-	/* semaphore table does not have any free semaphores, creation fails */
-        return NULL;
+	/* semaphore table does not have any free semaphores, grow */
+        sem = (semaphore_t *) kmem_cache_alloc(&semaphore_cache);
+        if (sem == NULL)
+            return NULL;
+        sem->creator = thread_get_current_thread();
+    } else {
+        sem = &semaphore_table[sem_id];
     }
 
-    semaphore_table[sem_id].value = value;
-    spinlock_reset(&semaphore_table[sem_id].slock);
+    sem->value = value;
+    spinlock_reset(&sem->slock);
 
-    return &semaphore_table[sem_id];
+    return sem;
 }
 
 /**
@@ -124,7 +140,10 @@ semaphore_t *semaphore_create(int value)
 
 void semaphore_destroy(semaphore_t *sem)
 {
-    sem->creator = -1;
+    if (sem >= semaphore_table && sem < semaphore_table + CONFIG_MAX_SEMAPHORES)
+        sem->creator = -1;
+    else
+        kmem_cache_free(&semaphore_cache, sem);
 }
 
 /**
@@ -157,6 +176,49 @@ void semaphore_P(semaphore_t *sem)
     _interrupt_set_state(intr_status);
 }
 
+/**
+ * Decreases value of the semaphore sem by one like semaphore_P, but
+ * waits at most msec milliseconds for the semaphore to be raised.
+ *
+ * This function must not be called by interrupt handlers.
+ *
+ * @param sem Semaphore to lower by one.
+ * @param msec Maximum time to wait in milliseconds.
+ *
+ * @return 1 if the semaphore was lowered, 0 if the wait timed out
+ * (the value of the semaphore is then unchanged).
+ */
+
+int semaphore_P_timeout(semaphore_t *sem, uint32_t msec)
+{
+    interrupt_status_t intr_status;
+    int acquired = 1;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&sem->slock);
+
+    sem->value--;
+    if (sem->value < 0) {
+        sleepq_add_timeout(sem, msec);
+        spinlock_release(&sem->slock);
+        thread_switch();
+
+        if (sleepq_timed_out()) {
+            /* We were removed from the sleep queue without being
+               given the semaphore, so give back our decrement */
+            spinlock_acquire(&sem->slock);
+            sem->value++;
+            spinlock_release(&sem->slock);
+            acquired = 0;
+        }
+    } else {
+        spinlock_release(&sem->slock);
+    }
+    _interrupt_set_state(intr_status);
+
+    return acquired;
+}
+
 /**
  * Increases the value of the semaphore sem by one. Wakes up
  * one waiter, if needed. 
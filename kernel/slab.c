@@ -0,0 +1,363 @@
+/*
+ * Kernel object caches (slab allocator)
+ *
+ * Copyright (C) 2003 Juha Aatrokoski, Timo Lilja,
+ *   Leena Salmela, Teemu Takanen, Aleksi Virtanen.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "kernel/slab.h"
+#include "kernel/interrupt.h"
+#include "kernel/assert.h"
+#include "vm/pagepool.h"
+#include "lib/libc.h"
+
+/** @name Kernel object caches
+ *
+ * kmalloc can only be used during boot and never frees memory. Kernel
+ * objects which come and go after boot are allocated from object
+ * caches instead. A cache hands out objects of one size, cut from
+ * slabs: blocks of physically contiguous pages from the page pool.
+ * The slab header is at the start of the block, and since pool blocks
+ * are aligned to their size the slab of an object is found by masking
+ * its address. A slab is returned to the page pool as soon as all of
+ * its objects are free.
+ *
+ * Each CPU keeps a few free objects of every cache, so that most
+ * allocations and frees only take the lock of the CPU cache. The CPU
+ * caches are refilled from and drained to the slabs
+ * KMEM_CPU_OBJECTS / 2 objects at a time.
+ *
+ * Objects can be allocated once vm_init has initialized the page
+ * pool. Before that kmem_cache_alloc returns NULL, so caches used
+ * during boot must have a fallback (see semaphore_create). Caches
+ * themselves can be set up at any time with kmem_cache_init.
+ *
+ * Lock order: CPU cache, cache, page pool.
+ *
+ * @{
+ */
+
+/* Objects moved between a CPU cache and the slabs at a time */
+#define KMEM_BATCH (KMEM_CPU_OBJECTS / 2)
+
+/* Smallest number of objects per slab, larger slabs are used for
+   large objects until this many fit */
+#define KMEM_MIN_OBJECTS 8
+
+/* Largest slab order */
+#define KMEM_MAX_ORDER 3
+
+/* Set once the page pool can be used */
+static int kmem_ready = 0;
+
+/* Cache of the cache descriptors made by kmem_cache_create */
+static kmem_cache_t kmem_cache_cache;
+
+/**
+ * Enables allocation from the object caches. Called by vm_init after
+ * the page pool has been initialized.
+ */
+void kmem_init(void)
+{
+    kmem_cache_init(&kmem_cache_cache, "kmem_cache", sizeof(kmem_cache_t));
+    kmem_ready = 1;
+}
+
+/**
+ * Sets up an object cache in the given (usually static) descriptor.
+ * Allocates no memory, so it can be called before vm_init.
+ *
+ * @param cache The cache descriptor
+ *
+ * @param name Name of the cache, for debugging
+ *
+ * @param size Size of the objects in bytes, at most a quarter of the
+ * largest slab
+ */
+void kmem_cache_init(kmem_cache_t *cache, const char *name, uint32_t size)
+{
+    int i;
+
+    /* Free objects hold a link, and keep the objects aligned */
+    if (size < sizeof(void *))
+	size = sizeof(void *);
+    size = (size + 3) & ~3;
+
+    cache->name = name;
+    cache->size = size;
+
+    cache->order = 0;
+    while (cache->order < KMEM_MAX_ORDER
+	   && ((PAGE_SIZE << cache->order) - sizeof(kmem_slab_t)) / size
+	   < KMEM_MIN_OBJECTS)
+	cache->order++;
+    cache->objects = ((PAGE_SIZE << cache->order) - sizeof(kmem_slab_t))
+	/ size;
+    KERNEL_ASSERT(cache->objects >= 4);
+
+    spinlock_reset(&cache->slock);
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->slabs = 0;
+
+    for (i = 0; i < CONFIG_MAX_CPUS; i++) {
+	spinlock_reset(&cache->cpu[i].slock);
+	cache->cpu[i].count = 0;
+    }
+}
+
+/**
+ * Creates an object cache with a dynamically allocated descriptor.
+ * Can be used after vm_init.
+ *
+ * @param name Name of the cache, for debugging
+ *
+ * @param size Size of the objects in bytes
+ *
+ * @return The cache, NULL if out of memory
+ */
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t size)
+{
+    kmem_cache_t *cache;
+
+    cache = (kmem_cache_t *) kmem_cache_alloc(&kmem_cache_cache);
+    if (cache != NULL)
+	kmem_cache_init(cache, name, size);
+
+    return cache;
+}
+
+/* Links a slab to the front of a slab list. */
+static void kmem_slab_link(kmem_slab_t **list, kmem_slab_t *slab)
+{
+    slab->prev = NULL;
+    slab->next = *list;
+    if (slab->next != NULL)
+	slab->next->prev = slab;
+    *list = slab;
+}
+
+/* Unlinks a slab from a slab list. */
+static void kmem_slab_unlink(kmem_slab_t **list, kmem_slab_t *slab)
+{
+    if (slab->prev != NULL)
+	slab->prev->next = slab->next;
+    else
+	*list = slab->next;
+    if (slab->next != NULL)
+	slab->next->prev = slab->prev;
+}
+
+/* Allocates a new slab from the page pool and adds it to the partial
+ * list. Returns 0 if out of memory. The cache lock must be held. */
+static int kmem_slab_grow(kmem_cache_t *cache)
+{
+    kmem_slab_t *slab;
+    uint32_t phys, obj;
+    int i;
+
+    phys = pagepool_get_phys_pages(cache->order);
+    if (phys == 0)
+	return 0;
+
+    slab = (kmem_slab_t *) ADDR_PHYS_TO_KERNEL(phys);
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->free = NULL;
+
+    /* Link the objects in address order */
+    obj = (uint32_t) slab + sizeof(kmem_slab_t)
+	+ (cache->objects - 1) * cache->size;
+    for (i = 0; i < cache->objects; i++) {
+	*(void **) obj = slab->free;
+	slab->free = (void *) obj;
+	obj -= cache->size;
+    }
+
+    kmem_slab_link(&cache->partial, slab);
+    cache->slabs++;
+
+    return 1;
+}
+
+/* Takes a free object from the slabs, NULL if out of memory. The cache
+ * lock must be held. */
+static void *kmem_slab_take(kmem_cache_t *cache)
+{
+    kmem_slab_t *slab;
+    void *object;
+
+    if (cache->partial == NULL && !kmem_slab_grow(cache))
+	return NULL;
+
+    slab = cache->partial;
+    object = slab->free;
+    slab->free = *(void **) object;
+    slab->inuse++;
+
+    if (slab->free == NULL) {
+	kmem_slab_unlink(&cache->partial, slab);
+	kmem_slab_link(&cache->full, slab);
+    }
+
+    return object;
+}
+
+/* Returns an object to its slab, freeing the slab if it becomes
+ * empty. The cache lock must be held. */
+static void kmem_slab_give(kmem_cache_t *cache, void *object)
+{
+    kmem_slab_t *slab;
+
+    slab = (kmem_slab_t *)
+	((uint32_t) object & ~((PAGE_SIZE << cache->order) - 1));
+    KERNEL_ASSERT(slab->cache == cache && slab->inuse > 0);
+
+    if (slab->free == NULL) {
+	kmem_slab_unlink(&cache->full, slab);
+	kmem_slab_link(&cache->partial, slab);
+    }
+
+    *(void **) object = slab->free;
+    slab->free = object;
+    slab->inuse--;
+
+    if (slab->inuse == 0) {
+	kmem_slab_unlink(&cache->partial, slab);
+	cache->slabs--;
+	pagepool_free_phys_pages(ADDR_KERNEL_TO_PHYS((uint32_t) slab),
+				 cache->order);
+    }
+}
+
+/* Returns the objects cached by all CPUs to the slabs, so that they
+ * can be used by the current CPU or freed with their slabs.
+ * Interrupts must be disabled and no lock of the cache held. */
+static void kmem_drain_all(kmem_cache_t *cache)
+{
+    kmem_cpu_cache_t *cpu;
+    int i;
+
+    for (i = 0; i < CONFIG_MAX_CPUS; i++) {
+	cpu = &cache->cpu[i];
+	spinlock_acquire(&cpu->slock);
+	if (cpu->count > 0) {
+	    spinlock_acquire(&cache->slock);
+	    while (cpu->count > 0)
+		kmem_slab_give(cache, cpu->objects[--cpu->count]);
+	    spinlock_release(&cache->slock);
+	}
+	spinlock_release(&cpu->slock);
+    }
+}
+
+/**
+ * Allocates an object from the given cache. The contents of the
+ * object are undefined. Can be called with interrupts disabled.
+ *
+ * @param cache The cache
+ *
+ * @return The object, NULL if out of memory or called before vm_init
+ */
+void *kmem_cache_alloc(kmem_cache_t *cache)
+{
+    interrupt_status_t intr_status;
+    kmem_cpu_cache_t *cpu;
+    void *object;
+
+    if (!kmem_ready)
+	return NULL;
+
+    intr_status = _interrupt_disable();
+
+    cpu = &cache->cpu[_interrupt_getcpu()];
+    spinlock_acquire(&cpu->slock);
+
+    if (cpu->count == 0) {
+	spinlock_acquire(&cache->slock);
+	while (cpu->count < KMEM_BATCH) {
+	    object = kmem_slab_take(cache);
+	    if (object == NULL)
+		break;
+	    cpu->objects[cpu->count++] = object;
+	}
+	spinlock_release(&cache->slock);
+    }
+
+    object = (cpu->count > 0) ? cpu->objects[--cpu->count] : NULL;
+
+    spinlock_release(&cpu->slock);
+
+    if (object == NULL) {
+	/* Out of memory, but other CPUs may have free objects */
+	kmem_drain_all(cache);
+	spinlock_acquire(&cache->slock);
+	object = kmem_slab_take(cache);
+	spinlock_release(&cache->slock);
+    }
+
+    _interrupt_set_state(intr_status);
+
+    return object;
+}
+
+/**
+ * Frees an object allocated from the given cache. Can be called with
+ * interrupts disabled.
+ *
+ * @param cache The cache the object was allocated from
+ *
+ * @param object The object
+ */
+void kmem_cache_free(kmem_cache_t *cache, void *object)
+{
+    interrupt_status_t intr_status;
+    kmem_cpu_cache_t *cpu;
+
+    KERNEL_ASSERT(object != NULL);
+
+    intr_status = _interrupt_disable();
+
+    cpu = &cache->cpu[_interrupt_getcpu()];
+    spinlock_acquire(&cpu->slock);
+
+    if (cpu->count == KMEM_CPU_OBJECTS) {
+	spinlock_acquire(&cache->slock);
+	while (cpu->count > KMEM_CPU_OBJECTS - KMEM_BATCH)
+	    kmem_slab_give(cache, cpu->objects[--cpu->count]);
+	spinlock_release(&cache->slock);
+    }
+
+    cpu->objects[cpu->count++] = object;
+
+    spinlock_release(&cpu->slock);
+    _interrupt_set_state(intr_status);
+}
+
+/** @} */
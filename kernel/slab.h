@@ -0,0 +1,94 @@
+/*
+ * Kernel object caches (slab allocator)
+ *
+ * Copyright (C) 2003 Juha Aatrokoski, Timo Lilja,
+ *   Leena Salmela, Teemu Takanen, Aleksi Virtanen.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BUENOS_KERNEL_SLAB_H
+#define BUENOS_KERNEL_SLAB_H
+
+#include "lib/types.h"
+#include "kernel/spinlock.h"
+#include "kernel/config.h"
+
+/* Objects cached by each CPU in front of the slabs of a cache */
+#define KMEM_CPU_OBJECTS 8
+
+/* A slab: a block of pages cut into objects of one cache. The header
+   is at the start of the block. */
+typedef struct kmem_slab_struct {
+    struct kmem_cache_struct *cache;
+    /* links in the partial or full list of the cache */
+    struct kmem_slab_struct *next;
+    struct kmem_slab_struct *prev;
+    /* first free object, the free objects are linked through their
+       first word */
+    void *free;
+    /* number of allocated objects (including the ones in the CPU
+       caches) */
+    int inuse;
+} kmem_slab_t;
+
+/* Free objects cached by one CPU */
+typedef struct {
+    spinlock_t slock;
+    int count;
+    void *objects[KMEM_CPU_OBJECTS];
+} kmem_cpu_cache_t;
+
+/* An object cache. The fields are private to kernel/slab.c, use
+   kmem_cache_init or kmem_cache_create to set them up. */
+typedef struct kmem_cache_struct {
+    const char *name;
+    /* object size, rounded up to a word */
+    uint32_t size;
+    /* slabs are blocks of 2^order pages */
+    int order;
+    /* objects per slab */
+    int objects;
+    /* protects the slab lists */
+    spinlock_t slock;
+    /* slabs with free objects and slabs without */
+    kmem_slab_t *partial;
+    kmem_slab_t *full;
+    /* number of slabs */
+    int slabs;
+    kmem_cpu_cache_t cpu[CONFIG_MAX_CPUS];
+} kmem_cache_t;
+
+void kmem_init(void);
+
+void kmem_cache_init(kmem_cache_t *cache, const char *name, uint32_t size);
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t size);
+
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *object);
+
+#endif /* BUENOS_KERNEL_SLAB_H */
@@ -40,6 +40,7 @@
 #include "kernel/config.h"
 #include "kernel/interrupt.h"
 #include "kernel/assert.h"
+#include "kernel/ktimer.h"
 
 /** @name Sleep queue
  *
@@ -53,36 +54,71 @@
  * The resources are referenced by memory address. The address is used
  * only as a key, it is never referenced by the sleep queue mechanism.
  *
+ * Each bucket of the hash table is a FIFO list with its own spinlock,
+ * so threads sleeping on unrelated resources do not contend for the
+ * same lock. The thread table spinlock is taken only after the woken
+ * thread has been removed from its bucket and the bucket lock has
+ * been released.
+ *
+ * A thread may also sleep with a timeout (sleepq_add_timeout). If the
+ * timeout expires before the resource is woken up, a kernel timer
+ * removes the thread from the sleep queue and wakes it.
+ *
  * @{
  */
 
-/* Size of the sleep queue hashtable (prime number) */
-#define SLEEPQ_HASHTABLE_SIZE 127
+/* Size of the sleep queue hashtable (power of two) */
+#define SLEEPQ_HASHTABLE_BITS 7
+#define SLEEPQ_HASHTABLE_SIZE (1 << SLEEPQ_HASHTABLE_BITS)
 
 extern thread_table_t thread_table[CONFIG_MAX_THREADS];
 extern spinlock_t thread_table_slock;
 
-/* spinlock for synchronizing sleep queue table access */
-static spinlock_t sleepq_slock;
 /* the sleep queue hashtable itself */
-static TID_t sleepq_hashtable[SLEEPQ_HASHTABLE_SIZE];
-
-
-/* Hash function used to index the sleep queue table */
-#define SLEEPQ_HASH(res) ((uint32_t)(res) % SLEEPQ_HASHTABLE_SIZE)
+static struct {
+    spinlock_t slock; /* protects this bucket */
+    TID_t head; /* first thread in the bucket, negative if none */
+    TID_t tail; /* last thread in the bucket, negative if none */
+} sleepq_hashtable[SLEEPQ_HASHTABLE_SIZE];
+
+/* States of a sleep timeout */
+#define SLEEPQ_TIMEOUT_NONE  0 /* no timeout set */
+#define SLEEPQ_TIMEOUT_ARMED 1 /* timer pending or its function running */
+#define SLEEPQ_TIMEOUT_DONE  2 /* timer function has returned */
+
+/* Sleep timeouts, indexed by TID */
+static struct {
+    ktimer_t timer;
+    uint32_t resource; /* the resource the thread sleeps on */
+    int timed_out; /* set if the timer woke the thread */
+    volatile int state; /* SLEEPQ_TIMEOUT_* */
+} sleepq_timeouts[CONFIG_MAX_THREADS];
+
+
+/* Hash function used to index the sleep queue table. Multiplicative
+ * (Fibonacci) hashing takes the top bits of the product, so the
+ * always-zero low bits of word aligned addresses do not matter.
+ */
+#define SLEEPQ_HASH(res) \
+    (((uint32_t)(res) * 0x9e3779b9) >> (32 - SLEEPQ_HASHTABLE_BITS))
 
 /** Initializes the sleep queue system. The hashtable entries are all
- * set to -1 (NULL) and the spinlock is reset (set to 0=free).
+ * set to -1 (NULL) and the spinlocks are reset (set to 0=free).
  */
 void sleepq_init(void)
 {
     int i;
 
     for (i=0; i<SLEEPQ_HASHTABLE_SIZE; i++) {
-	sleepq_hashtable[i] = -1;
+	spinlock_reset(&sleepq_hashtable[i].slock);
+	sleepq_hashtable[i].head = -1;
+	sleepq_hashtable[i].tail = -1;
     }
 
-    spinlock_reset(&sleepq_slock);
+    for (i=0; i<CONFIG_MAX_THREADS; i++) {
+	sleepq_timeouts[i].timer.pending = 0;
+	sleepq_timeouts[i].state = SLEEPQ_TIMEOUT_NONE;
+    }
 }
 
 /** Adds the currently running thread into the sleep queue. The thread
@@ -116,83 +152,132 @@ void sleepq_add(void *resource)
     /* Idle thread should never do _anything_ (other than its own wait loop) */
     KERNEL_ASSERT(my_tid != IDLE_THREAD_TID);
 
-    spinlock_acquire(&sleepq_slock);
+    spinlock_acquire(&sleepq_hashtable[hash].slock);
 
     /* Add the current thread to the end of the sleepqueue */
-    if (sleepq_hashtable[hash] <= 0) {
+    if (sleepq_hashtable[hash].tail < 0) {
 	/* hashtable entry empty */
-	sleepq_hashtable[hash] = my_tid;
+	sleepq_hashtable[hash].head = my_tid;
     } else {
-	TID_t prev;
-	/* hashtable entry nonempty, chain to end of linked list */
-	prev = sleepq_hashtable[hash];
-	while (thread_table[prev].next > 0) {
-	    prev = thread_table[prev].next;
-	}
-	thread_table[prev].next = my_tid;
+	thread_table[sleepq_hashtable[hash].tail].next = my_tid;
     }
+    sleepq_hashtable[hash].tail = my_tid;
 
-    spinlock_release(&sleepq_slock);
+    spinlock_release(&sleepq_hashtable[hash].slock);
 }
 
 /* Import prototype for unsafe function from scheduler.c */
 void scheduler_add_to_ready_list(TID_t t);
 
-
-/** Wake the first thread waiting for given resource from the sleep
- * queue. If such a thread exists, it is removed from the sleep queue
- * and placed on the scheduler's ready-to-run list.
- *
- * @param resource Wake the first thread waiting for this resource
+/* Removes the first thread waiting for 'resource' from the bucket
+ * 'hash' and returns it, or returns a negative value if there is no
+ * such thread. The spinlock of the bucket must be held.
  */
-void sleepq_wake(void *resource)
+static TID_t sleepq_unlink_first(uint32_t hash, void *resource)
 {
-    uint32_t hash;
-    interrupt_status_t intr_state;
     TID_t first, prev;
 
-    hash = SLEEPQ_HASH(resource);
-
-    intr_state = _interrupt_disable();
-    spinlock_acquire(&sleepq_slock);
-
     /* Find the first entry actually waiting for 'resource', since
      * multiple resources may hash to the same index. 
      */
     prev = -1;
-    first = sleepq_hashtable[hash];
+    first = sleepq_hashtable[hash].head;
     while (first > 0 && thread_table[first].sleeps_on != (uint32_t)resource) {
 	prev = first;
 	first = thread_table[first].next;
     }
 
-    /* First entry with correct resource found */
     if (first > 0) {
 	/* remove it from the sleep queue */
-	if (prev <= 0) { 
+	if (prev < 0) { 
 	    /* it was the first entry in the table slot */
-	    sleepq_hashtable[hash] = thread_table[first].next;
+	    sleepq_hashtable[hash].head = thread_table[first].next;
 	} else {
 	    thread_table[prev].next = thread_table[first].next;
 	}
+	if (sleepq_hashtable[hash].tail == first)
+	    sleepq_hashtable[hash].tail = prev;
+    }
 
-	/* Clear the sleeps_on field and add the thread to the ready
-	 * list (if necessary)
-	 */
-	spinlock_acquire(&thread_table_slock);
-
-	thread_table[first].sleeps_on = 0;
-	thread_table[first].next = -1;
-	
-	if (thread_table[first].state == THREAD_SLEEPING) {
-	    thread_table[first].state = THREAD_READY;
-	    scheduler_add_to_ready_list(first);
-	}
+    return first;
+}
+
+/* Removes thread t from the bucket 'hash'. Returns 1 if the thread
+ * was found in the bucket, 0 otherwise. The spinlock of the bucket
+ * must be held.
+ */
+static int sleepq_unlink_thread(uint32_t hash, TID_t t)
+{
+    TID_t cur, prev;
 
-	spinlock_release(&thread_table_slock);
+    prev = -1;
+    cur = sleepq_hashtable[hash].head;
+    while (cur > 0 && cur != t) {
+	prev = cur;
+	cur = thread_table[cur].next;
+    }
+
+    if (cur <= 0)
+	return 0;
+
+    if (prev < 0) {
+	sleepq_hashtable[hash].head = thread_table[cur].next;
+    } else {
+	thread_table[prev].next = thread_table[cur].next;
+    }
+    if (sleepq_hashtable[hash].tail == cur)
+	sleepq_hashtable[hash].tail = prev;
+
+    return 1;
+}
+
+/* Wakes a thread which has been removed from the sleep queue: clears
+ * its sleeps_on field and adds it to the ready list if it has
+ * already gone to sleep. Interrupts must be disabled.
+ */
+static void sleepq_wake_thread(TID_t t)
+{
+    spinlock_acquire(&thread_table_slock);
+
+    thread_table[t].sleeps_on = 0;
+    thread_table[t].next = -1;
+    /* raise the thread back to its base priority after sleeping */
+    thread_table[t].priority = thread_table[t].base_priority;
+
+    if (thread_table[t].state == THREAD_SLEEPING) {
+	thread_table[t].state = THREAD_READY;
+	scheduler_add_to_ready_list(t);
     }
 
-    spinlock_release(&sleepq_slock);
+    spinlock_release(&thread_table_slock);
+}
+
+
+/** Wake the first thread waiting for given resource from the sleep
+ * queue. If such a thread exists, it is removed from the sleep queue
+ * and placed on the scheduler's ready-to-run list.
+ *
+ * @param resource Wake the first thread waiting for this resource
+ */
+void sleepq_wake(void *resource)
+{
+    uint32_t hash;
+    interrupt_status_t intr_state;
+    TID_t first;
+
+    hash = SLEEPQ_HASH(resource);
+
+    intr_state = _interrupt_disable();
+    spinlock_acquire(&sleepq_hashtable[hash].slock);
+
+    first = sleepq_unlink_first(hash, resource);
+
+    spinlock_release(&sleepq_hashtable[hash].slock);
+
+    /* First entry with correct resource found */
+    if (first > 0)
+	sleepq_wake_thread(first);
+
     _interrupt_set_state(intr_state);
 }
 
@@ -207,59 +292,119 @@ void sleepq_wake_all(void *resource)
 {
     uint32_t hash;
     interrupt_status_t intr_state;
-    TID_t first, prev, wake;
+    TID_t first, wake, last;
 
     hash = SLEEPQ_HASH(resource);
 
     intr_state = _interrupt_disable();
-    spinlock_acquire(&sleepq_slock);
+    spinlock_acquire(&sleepq_hashtable[hash].slock);
 
-    /* init linked list traversing variables to the first item */
-    prev = -1;
-    first = sleepq_hashtable[hash];
+    /* Move all threads waiting for 'resource' to a private list,
+     * linked through the same next fields.
+     */
+    first = -1;
+    last = -1;
+    while ((wake = sleepq_unlink_first(hash, resource)) > 0) {
+	thread_table[wake].next = -1;
+	if (last < 0) {
+	    first = wake;
+	} else {
+	    thread_table[last].next = wake;
+	}
+	last = wake;
+    }
 
-    /* Traverse the whole linked list in order to wake up all threads */
+    spinlock_release(&sleepq_hashtable[hash].slock);
+
+    /* Waking a thread overwrites its next field */
     while (first > 0) {
+	wake = first;
+	first = thread_table[wake].next;
+	sleepq_wake_thread(wake);
+    }
 
-	/* Find the next entry actually waiting for 'resource', since
-	 * multiple resources may hash to the same index. 
-	 */
-	while (first > 0 
-	       && thread_table[first].sleeps_on != (uint32_t)resource) {
-	    prev = first;
-	    first = thread_table[first].next;
-	}
+    _interrupt_set_state(intr_state);
+}
 
-	/* Next entry w/ resource found */
-	if (first > 0) {
-	    wake = first;
-	    /* remove it from the sleep queue */
-	    if (prev <= 0) { 
-		/* it was the first entry in the table slot */
-		first = sleepq_hashtable[hash] = thread_table[wake].next;
-	    } else {
-		first = thread_table[prev].next = thread_table[wake].next;
-	    }
-
-	    /* Clear the sleeps_on field and add the thread to the ready
-	     * list (if necessary)
-	     */
-	    spinlock_acquire(&thread_table_slock);
-
-	    thread_table[wake].sleeps_on = 0;
-	    thread_table[wake].next      = -1;
-	
-	    if (thread_table[wake].state == THREAD_SLEEPING) {
-		thread_table[wake].state = THREAD_READY;
-		scheduler_add_to_ready_list(wake);
-	    }
-
-	    spinlock_release(&thread_table_slock);
-	}
+/* Timer function of sleep timeouts. Wakes the thread given as
+ * argument if it is still in the sleep queue. Called in interrupt
+ * context.
+ */
+static void sleepq_timeout_expired(void *arg)
+{
+    TID_t t = (TID_t)(uint32_t)arg;
+    uint32_t hash;
+    int found;
+
+    hash = SLEEPQ_HASH(sleepq_timeouts[t].resource);
+
+    spinlock_acquire(&sleepq_hashtable[hash].slock);
+    found = sleepq_unlink_thread(hash, t);
+    spinlock_release(&sleepq_hashtable[hash].slock);
+
+    if (found)
+	sleepq_wake_thread(t);
+
+    sleepq_timeouts[t].timed_out = found;
+    sleepq_timeouts[t].state = SLEEPQ_TIMEOUT_DONE;
+}
+
+/** Adds the currently running thread into the sleep queue like
+ * sleepq_add, but also starts a timer which wakes the thread after
+ * msec milliseconds if the resource has not been woken before
+ * that. After switching, the thread must call sleepq_timed_out to
+ * stop the timer and find out why it was woken.
+ *
+ * Note that interrupts must be disabled before calling this function.
+ *
+ * @param resource The resource to wait for
+ * @param msec Maximum time to sleep in milliseconds
+ */
+void sleepq_add_timeout(void *resource, uint32_t msec)
+{
+    TID_t my_tid;
+
+    my_tid = thread_get_current_thread();
+
+    KERNEL_ASSERT(sleepq_timeouts[my_tid].state == SLEEPQ_TIMEOUT_NONE);
+
+    sleepq_add(resource);
+
+    sleepq_timeouts[my_tid].resource = (uint32_t)resource;
+    sleepq_timeouts[my_tid].timed_out = 0;
+    sleepq_timeouts[my_tid].state = SLEEPQ_TIMEOUT_ARMED;
+    ktimer_add(&sleepq_timeouts[my_tid].timer, msec,
+	       &sleepq_timeout_expired, (void *)my_tid);
+}
+
+/** Stops the timeout started by sleepq_add_timeout for the currently
+ * running thread. Must be called after the thread has been woken up
+ * and before it sleeps again, with no spinlocks held: if the timer
+ * is just expiring on another CPU, this function waits for it.
+ *
+ * @return 1 if the thread was woken by the timeout, 0 if it was woken
+ * by sleepq_wake or sleepq_wake_all (or no timeout was set).
+ */
+int sleepq_timed_out(void)
+{
+    TID_t my_tid;
+
+    my_tid = thread_get_current_thread();
+
+    if (sleepq_timeouts[my_tid].state == SLEEPQ_TIMEOUT_NONE)
+	return 0;
+
+    if (ktimer_cancel(&sleepq_timeouts[my_tid].timer)) {
+	sleepq_timeouts[my_tid].state = SLEEPQ_TIMEOUT_NONE;
+	return 0;
     }
 
-    spinlock_release(&sleepq_slock);
-    _interrupt_set_state(intr_state);
+    /* The timer has expired, wait until its function has returned */
+    while (sleepq_timeouts[my_tid].state != SLEEPQ_TIMEOUT_DONE)
+	/* nothing */ ;
+
+    sleepq_timeouts[my_tid].state = SLEEPQ_TIMEOUT_NONE;
+    return sleepq_timeouts[my_tid].timed_out;
 }
 
 /** @} */
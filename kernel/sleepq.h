@@ -37,10 +37,14 @@
 #ifndef BUENOS_KERNEL_SLEEPQ_H
 #define BUENOS_KERNEL_SLEEPQ_H
 
+#include "lib/types.h"
+
 /* Prototypes for sleep queue functions */
 void sleepq_init(void);
 void sleepq_add(void *resource);
 void sleepq_wake(void *resource);
 void sleepq_wake_all(void *resource);
+void sleepq_add_timeout(void *resource, uint32_t msec);
+int sleepq_timed_out(void);
 
 #endif /* BUENOS_KERNEL_SLEEPQ_H */
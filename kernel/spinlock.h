@@ -43,4 +43,8 @@ void spinlock_reset(spinlock_t *slock);
 void spinlock_acquire(spinlock_t *slock);
 void spinlock_release(spinlock_t *slock);
 
+/* Atomic operations on words, implemented with LL/SC in _spinlock.S */
+int _atomic_cas(int *p, int old, int new);
+int _atomic_swap(int *p, int new);
+
 #endif /* BUENOS_KERNEL_SPINLOCK_H */
@@ -43,6 +43,8 @@
 #include "kernel/config.h"
 #include "kernel/interrupt.h"
 #include "kernel/idle.h"
+#include "kernel/sleepq.h"
+#include "vm/pagepool.h"
 
 /** @name Thread library
  *
@@ -57,14 +59,38 @@ spinlock_t thread_table_slock;
 /** The table containing all threads in the system, whether active or not. */
 thread_table_t thread_table[CONFIG_MAX_THREADS];
 
-/* Thread stack areas for kernel threads */
-char thread_stack_areas[CONFIG_THREAD_STACKSIZE * CONFIG_MAX_THREADS];
+/* Stack area of the idle thread. The stacks of other threads are
+   allocated from the page pool when they are created. */
+static char thread_idle_stack[CONFIG_THREAD_STACKSIZE];
+
+/* Magic word written to the lowest word of each thread stack. If it
+   has been overwritten, the thread has overflowed its stack. */
+#define THREAD_STACK_MAGIC 0x57ac4b0d
+
+/* List of free thread table entries, linked through the next field.
+ * Entries are taken from the head and returned to the tail, so that
+ * a TID (and thus the ASID of a process) is not reused immediately.
+ * Protected by thread_table_slock.
+ */
+static struct {
+    TID_t head; /* negative if the list is empty */
+    TID_t tail; /* negative if the list is empty */
+} thread_free_list;
+
+#if CONFIG_MAX_THREADS > 256
+#error "CONFIG_MAX_THREADS must not exceed the number of ASIDs (256)"
+#endif
+
+#if CONFIG_THREAD_STACKSIZE > PAGE_SIZE
+#error "CONFIG_THREAD_STACKSIZE must fit in one page"
+#endif
 
 /* Import running thread id table from scheduler */
 extern TID_t scheduler_current_thread[CONFIG_MAX_CPUS];
 
 /** Initializes the threading system. Does this by setting all thread
- *  table entry states to THREAD_FREE. Called only once before any
+ *  table entry states to THREAD_FREE and putting all entries except
+ *  the idle thread on the free list. Called only once before any
  *  threads are created.
  */
 void thread_table_init(void)
@@ -82,20 +108,32 @@ void thread_table_init(void)
 
     /* Init all entries to 'NULL' */
     for (i=0; i<CONFIG_MAX_THREADS; i++) {
-	/* Set context pointers to the top of the stack*/
-	thread_table[i].context      = (context_t *) (thread_stack_areas
-	    +CONFIG_THREAD_STACKSIZE*i + CONFIG_THREAD_STACKSIZE - 
-						      sizeof(context_t));
+	thread_table[i].context      = NULL;
 	thread_table[i].user_context = NULL;
 	thread_table[i].state        = THREAD_FREE;
 	thread_table[i].sleeps_on    = 0;
 	thread_table[i].pagetable    = NULL;
 	thread_table[i].process_id   = -1;	
-	thread_table[i].next         = -1;	
+	thread_table[i].next         = i + 1;
+	thread_table[i].priority     = 0;
+	thread_table[i].base_priority = 0;
+	thread_table[i].stack        = 0;
+	thread_table[i].affinity     = THREAD_AFFINITY_ALL;
+	thread_table[i].last_cpu     = -1;
     }
 
+    /* The free list runs from 1 to CONFIG_MAX_THREADS - 1 */
+    thread_table[CONFIG_MAX_THREADS - 1].next = -1;
+    thread_table[IDLE_THREAD_TID].next = -1;
+    thread_free_list.head = IDLE_THREAD_TID + 1;
+    thread_free_list.tail = CONFIG_MAX_THREADS - 1;
+
+    /* Set the context pointer of the idle thread to the top of its stack */
+    thread_table[IDLE_THREAD_TID].stack = (uint32_t) thread_idle_stack;
+    thread_table[IDLE_THREAD_TID].context = (context_t *) 
+	(thread_idle_stack + CONFIG_THREAD_STACKSIZE - sizeof(context_t));
     thread_table[IDLE_THREAD_TID].context->cpu_regs[MIPS_REGISTER_SP] =
-	(uint32_t) thread_stack_areas + CONFIG_THREAD_STACKSIZE -4 -
+	(uint32_t) thread_idle_stack + CONFIG_THREAD_STACKSIZE -4 -
 	sizeof(context_t);
     thread_table[IDLE_THREAD_TID].context->pc = 
         (uint32_t) _idle_thread_wait_loop;
@@ -109,58 +147,60 @@ void thread_table_init(void)
 
 /** Creates a new thread. A free slot is allocated from the thread
  * table for the new thread and its content is initialized to 'nil'
- * values. The new thread will call function 'func' with the argument
- * 'arg' when the thread is run by thread_run().
+ * values. A page is allocated from the page pool for the stack of
+ * the thread. The new thread will call function 'func' with the
+ * argument 'arg' when the thread is run by thread_run().
  *
  * @param func Function pointer to the threads 'main' function.
  * @param arg Argument to pass to 'func' (meaning defined by 'func').
  *
  * @return The thread ID of the created thread, or negative if
- * creation failed (thread table is full).
+ * creation failed (thread table is full or out of memory).
  */
 TID_t thread_create(void (*func)(uint32_t), uint32_t arg)
 {
-    static TID_t next_tid = 0;
-    TID_t i, tid = -1;
-
+    TID_t i, tid;
+    uint32_t stack;
 
     interrupt_status_t intr_status;
+
+    stack = pagepool_get_phys_page();
+    if (stack == 0)
+	return -1;
+    stack = ADDR_PHYS_TO_KERNEL(stack);
       
     intr_status = _interrupt_disable();
 
     spinlock_acquire(&thread_table_slock);
     
-    /* Find the first free thread table entry starting from 'next_tid' */
-    for (i=0; i<CONFIG_MAX_THREADS; i++) {
-	TID_t t = (i + next_tid) % CONFIG_MAX_THREADS;
-
-	if(t == IDLE_THREAD_TID)
-	    continue;
-	
-	if (thread_table[t].state
-	    == THREAD_FREE) {
-	    tid = t;
-	    break;
-	}
-    }
+    /* Take the first entry of the free list */
+    tid = thread_free_list.head;
 
     /* Is the thread table full? */
     if (tid < 0) { 
 	spinlock_release(&thread_table_slock);
 	_interrupt_set_state(intr_status);
+	pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS(stack));
 	return tid;
     }
 
-    next_tid = (tid+1) % CONFIG_MAX_THREADS;
+    KERNEL_ASSERT(thread_table[tid].state == THREAD_FREE);
+
+    thread_free_list.head = thread_table[tid].next;
+    if (thread_free_list.head < 0)
+	thread_free_list.tail = -1;
 
     thread_table[tid].state = THREAD_NONREADY;
 
     spinlock_release(&thread_table_slock);
     _interrupt_set_state(intr_status);
 
-    thread_table[tid].context      = (context_t *) (thread_stack_areas
-	+CONFIG_THREAD_STACKSIZE*tid + CONFIG_THREAD_STACKSIZE - 
-	 sizeof(context_t));
+    thread_table[tid].stack        = stack;
+    *(uint32_t *)stack = THREAD_STACK_MAGIC;
+
+    /* Set context pointer to the top of the stack */
+    thread_table[tid].context      = (context_t *) (stack
+	+ CONFIG_THREAD_STACKSIZE - sizeof(context_t));
 
     for (i=0; i< (int) sizeof(context_t)/4; i++) {
 	*(((uint32_t *) thread_table[tid].context) + i) = 0;
@@ -171,15 +211,17 @@ TID_t thread_create(void (*func)(uint32_t), uint32_t arg)
     thread_table[tid].sleeps_on    = 0;
     thread_table[tid].process_id   = -1;
     thread_table[tid].next         = -1;
+    thread_table[tid].priority     = 0;
+    thread_table[tid].base_priority = 0;
+    thread_table[tid].affinity     = THREAD_AFFINITY_ALL;
+    thread_table[tid].last_cpu     = -1;
 
     /* Make sure that we always have a valid back reference on context chain */
     thread_table[tid].context->prev_context = thread_table[tid].context;
 
     /* set stack pointer to the end of stack */
     thread_table[tid].context->cpu_regs[MIPS_REGISTER_SP] = 
-	(uint32_t)thread_stack_areas
-	+ (CONFIG_THREAD_STACKSIZE * tid) 
-	+ CONFIG_THREAD_STACKSIZE-4-
+	stack + CONFIG_THREAD_STACKSIZE-4-
 	sizeof(context_t); /* to the end of stack */
 
     /* set program counter to the specified function */
@@ -204,6 +246,59 @@ TID_t thread_create(void (*func)(uint32_t), uint32_t arg)
 }
 
 
+/** Checks that the given thread has not overflowed its stack, and
+ * panics if it has. The check relies on a magic word at the bottom
+ * of the stack, so it detects overflows only after the fact.
+ *
+ * @param t The ID of the thread to check.
+ */
+void thread_check_stack(TID_t t)
+{
+    if (t == IDLE_THREAD_TID)
+	return;
+
+    if (*(uint32_t *)thread_table[t].stack != THREAD_STACK_MAGIC) {
+	kprintf("Thread %d overflowed its stack\n", t);
+	KERNEL_PANIC("Kernel stack overflow");
+    }
+}
+
+/** Frees the thread table entry and the stack of a dead thread and
+ * returns the entry to the tail of the free list. Called by the
+ * scheduler when it switches away from a DYING thread for the last
+ * time, so the stack is no longer in use. Interrupts must be
+ * disabled.
+ *
+ * @param t The ID of the dead thread.
+ */
+void thread_reap(TID_t t)
+{
+    uint32_t stack;
+
+    KERNEL_ASSERT(t > IDLE_THREAD_TID && t < CONFIG_MAX_THREADS);
+    KERNEL_ASSERT(thread_table[t].state == THREAD_DYING);
+
+    stack = thread_table[t].stack;
+    thread_table[t].stack = 0;
+    thread_table[t].context = NULL;
+
+    spinlock_acquire(&thread_table_slock);
+
+    thread_table[t].state = THREAD_FREE;
+    thread_table[t].next = -1;
+    if (thread_free_list.tail < 0) {
+	thread_free_list.head = t;
+    } else {
+	thread_table[thread_free_list.tail].next = t;
+    }
+    thread_free_list.tail = t;
+
+    spinlock_release(&thread_table_slock);
+
+    pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS(stack));
+}
+
+
 /** Run a thread. The given thread is added to the scheduler's
  * ready-to-run list. This is really just a wrapper for
  * scheduler_add_ready().
@@ -233,6 +328,25 @@ void thread_switch(void)
       _interrupt_set_state(intr_status);
 }
 
+/** Put the current (=calling) thread to sleep for the given number
+ * of milliseconds. The thread sleeps on its own thread table entry,
+ * which nobody else wakes, so only the timeout ends the sleep. The
+ * sleep lasts at least msec milliseconds, rounded up to the next
+ * timer interrupt.
+ *
+ * @param msec Time to sleep in milliseconds.
+ */
+void thread_sleep_ms(uint32_t msec)
+{
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+    sleepq_add_timeout(thread_get_current_thread_entry(), msec);
+    thread_switch();
+    sleepq_timed_out();
+    _interrupt_set_state(intr_status);
+}
+
 /**
  * Return the TID of the calling thread. 
  * Finds out what is the TID of the thread calling this function.
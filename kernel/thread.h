@@ -55,6 +55,9 @@ typedef enum {
 
 #define IDLE_THREAD_TID 0
 
+/* Affinity mask allowing a thread to run on any CPU */
+#define THREAD_AFFINITY_ALL 0xffffffff
+
 /* thread table data structure */
 typedef struct {
     /* context save areas context and user_context*/
@@ -76,20 +79,37 @@ typedef struct {
     /* pointer to the next thread in list (<0 = end of list) */
     TID_t next; 
 
+    /* current scheduling priority (0 = highest) */
+    int priority;
+    /* priority set through scheduler_set_priority, the thread is
+       raised back to this when it wakes up */
+    int base_priority;
+
+    /* kernel address of the bottom of this thread's stack */
+    uint32_t stack;
+
+    /* CPUs this thread may run on, bit (1 << n) for CPU n */
+    uint32_t affinity;
+    /* the CPU this thread last ran on (<0 = none yet) */
+    int last_cpu;
+
     /* pad to 64 bytes */
-    uint32_t dummy_alignment_fill[9]; 
+    uint32_t dummy_alignment_fill[4]; 
 } thread_table_t;
 
 /* function prototypes */
 void thread_table_init(void);
 TID_t thread_create(void (*func)(uint32_t), uint32_t arg);
 void thread_run(TID_t t);
+void thread_reap(TID_t t);
+void thread_check_stack(TID_t t);
 
 TID_t thread_get_current_thread(void);
 thread_table_t *thread_get_current_thread_entry(void);
 
 void thread_switch(void);
 #define thread_yield thread_switch
+void thread_sleep_ms(uint32_t msec);
 
 void thread_goto_userland(context_t *usercontext);
 
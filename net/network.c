@@ -69,7 +69,7 @@ typedef struct {
     network_frame_header_t header;
 
     /* Payload of this frame. */
-    uint8_t payload[PAGE_SIZE-sizeof(network_frame_header_t)] ;
+    uint8_t payload[NETWORK_MAX_MTU-sizeof(network_frame_header_t)] ;
                                     
 } network_frame_t;
 
@@ -88,6 +88,12 @@ typedef struct {
 /* A table of network interfaces. */
 network_interface_info_t network_interfaces[CONFIG_MAX_GNDS];
 
+/* Frames are blocks of 2^network_frame_order pages */
+static int network_frame_order = 0;
+
+/* Size of a frame block in bytes */
+#define NETWORK_FRAME_SIZE (PAGE_SIZE << network_frame_order)
+
 /** 
  * Forwards a received frame to the upper protocol layers. 
  *
@@ -129,8 +135,8 @@ static void network_receive_thread(uint32_t interface)
 
     while(1) {
 	if(ret != 0) {
-	    /* We need new page */
-	    frame_phys_addr = pagepool_get_phys_page();
+	    /* We need new frame */
+	    frame_phys_addr = pagepool_get_phys_pages(network_frame_order);
 	    KERNEL_ASSERT(frame_phys_addr != 0);
 	    frame = (network_frame_t *) ADDR_PHYS_TO_KERNEL(frame_phys_addr);
 	}
@@ -171,10 +177,11 @@ void network_init(void)
 	    network_interfaces[i].gnd = gnd;
 	    network_interfaces[i].mtu = gnd->frame_size(gnd);
 
-            /* The network code is unable to handle frames which don't
-               fit into one page. This is because there is no way to
-               allocate two consecutive memory pages. */
-	    KERNEL_ASSERT(network_interfaces[i].mtu <= PAGE_SIZE);
+            /* Frames are allocated as blocks of at most
+               NETWORK_MAX_MTU bytes. */
+	    KERNEL_ASSERT(network_interfaces[i].mtu <= NETWORK_MAX_MTU);
+	    while (network_interfaces[i].mtu > NETWORK_FRAME_SIZE)
+		network_frame_order++;
 
 	    network_interfaces[i].address = gnd->hwaddr(gnd);
 	}
@@ -264,7 +271,7 @@ int network_get_mtu(network_address_t local_address)
 	
 	return (min - sizeof(network_frame_header_t));
     } else if(local_address == NETWORK_LOOPBACK_ADDRESS) {
-        return (PAGE_SIZE - sizeof(network_frame_header_t)); 
+        return (NETWORK_FRAME_SIZE - sizeof(network_frame_header_t)); 
     } else {
 	/* Find MTU of given interface address. */
 	for(n = network_interfaces; n->gnd != NULL; n++) {
@@ -350,12 +357,12 @@ int network_send(network_address_t source,
     network_frame_t *frame;
     int send_ret=NET_OK;
 
-    /* The frame should fit into one page. */
+    /* The frame should fit into one frame block. */
     KERNEL_ASSERT(length > 0 &&
-		  length <= (int)(PAGE_SIZE-sizeof(network_frame_header_t)));
+		  length <= (int)(NETWORK_FRAME_SIZE-sizeof(network_frame_header_t)));
 
-    /* Allocate a page for this frame. */
-    phys_frame = pagepool_get_phys_page();
+    /* Allocate pages for this frame. */
+    phys_frame = pagepool_get_phys_pages(network_frame_order);
     if(phys_frame == 0)
 	return NET_ERROR;
     frame = (network_frame_t *) ADDR_PHYS_TO_KERNEL(phys_frame);
@@ -372,7 +379,7 @@ int network_send(network_address_t source,
 	    frame->header.source = NETWORK_LOOPBACK_ADDRESS;
 	if(network_receive_frame(frame) == 0) {
 	    /* push failed */
-	    pagepool_free_phys_page(phys_frame);
+	    pagepool_free_phys_pages(phys_frame, network_frame_order);
 	    return NET_ERROR;
 	}
 	
@@ -387,7 +394,7 @@ int network_send(network_address_t source,
 	interface = network_get_interface(source);
 	if(interface < 0) {
             /* No such interface. */
-	    pagepool_free_phys_page(phys_frame);
+	    pagepool_free_phys_pages(phys_frame, network_frame_order);
 	    return NET_DOESNT_EXIST;
 	}
 
@@ -407,7 +414,7 @@ int network_send(network_address_t source,
 	}
     }
 
-    pagepool_free_phys_page(phys_frame);
+    pagepool_free_phys_pages(phys_frame, network_frame_order);
     return send_ret;
 }
 
@@ -419,8 +426,21 @@ int network_send(network_address_t source,
  */
 void network_free_frame(void *payload_frame)
 {
+    /* Frame blocks are aligned to their size */
     uint32_t frame = ADDR_KERNEL_TO_PHYS((uint32_t)payload_frame) 
-	& PAGE_SIZE_MASK;
-    pagepool_free_phys_page(frame);
+	& ~(NETWORK_FRAME_SIZE - 1);
+    pagepool_free_phys_pages(frame, network_frame_order);
+}
+
+/**
+ * Returns the allocation order of the network frames: frames are
+ * blocks of 2^order physical pages, large enough for the largest MTU
+ * of the network interfaces. Set by network_init.
+ *
+ * @return The order, at most NETWORK_MAX_FRAME_ORDER
+ */
+int network_get_frame_order(void)
+{
+    return network_frame_order;
 }
 
@@ -39,6 +39,7 @@
 
 #include "lib/types.h"
 #include "drivers/gnd.h"
+#include "drivers/yams.h"
 
 void network_init(void);
 
@@ -54,6 +55,7 @@ int network_send(network_address_t source,
 		 void *buffer);
 
 void network_free_frame(void *frame);
+int network_get_frame_order(void);
 
 /* Return values of the network frame layer functions. */
 #define NET_OK 0
@@ -62,7 +64,10 @@ void network_free_frame(void *frame);
 
 #define NETWORK_BROADCAST_ADDRESS 0xffffffff
 #define NETWORK_LOOPBACK_ADDRESS  0x00000000
-#define NETWORK_MAX_MTU 4096
+/* Frames are allocated as blocks of 2^network_get_frame_order()
+   pages, just large enough for the largest MTU of the interfaces. */
+#define NETWORK_MAX_FRAME_ORDER 1
+#define NETWORK_MAX_MTU (PAGE_SIZE << NETWORK_MAX_FRAME_ORDER)
 
 #endif /* NET_NETWORK_H */
 
@@ -104,11 +104,12 @@ int socket_sendto(sock_t s,
     /* parameter sanity... */
     KERNEL_ASSERT(size >= 1 && buf != NULL);
 
-    /* Limit the size to the MTU or page size */
+    /* Limit the size to the MTU or send buffer size */
     size = MIN(MIN((uint32_t)size, 
 		   network_get_mtu(NETWORK_BROADCAST_ADDRESS) -
 		   sizeof(pop_header_t)),
-	       PAGE_SIZE - sizeof(pop_header_t));
+	       (PAGE_SIZE << network_get_frame_order())
+	       - sizeof(pop_header_t));
 
     semaphore_P(open_sockets_sem);
 
@@ -242,8 +243,8 @@ void pop_init()
      */
     KERNEL_ASSERT(sizeof(pop_header_t) == 8);
 
-    /* Allocate a page for the send buffer */
-    addr = pagepool_get_phys_page();
+    /* Allocate the send buffer, large enough for any frame */
+    addr = pagepool_get_phys_pages(network_get_frame_order());
 
     if (addr == 0) {
 	KERNEL_PANIC("pop_init: page allocation failed\n");
@@ -44,7 +44,10 @@
 #include "vm/pagepool.h"
 #include "lib/types.h"
 
-/* open socket table and a semaphore to synch access to it */
+/* open socket table and a semaphore to synch access to it. The table
+   stays fixed size instead of using an object cache (kernel/slab.h):
+   sock_t is the index of the socket in the table, and the network
+   stack looks sockets up by scanning it for a port. */
 socket_descriptor_t open_sockets[CONFIG_MAX_OPEN_SOCKETS];
 semaphore_t *open_sockets_sem;
 
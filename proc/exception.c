@@ -39,6 +39,8 @@
 #include "lib/libc.h"
 #include "kernel/thread.h"
 #include "kernel/exception.h"
+#include "proc/process.h"
+#include "vm/tlb.h"
 
 void syscall_handle(context_t *user_context);
 
@@ -54,6 +56,7 @@ void syscall_handle(context_t *user_context);
 void user_exception_handle(int exception)
 {
     thread_table_t *my_entry;
+    tlb_exception_state_t state;
 
     /* While interrupts are disabled here, they can be enabled when
        handling system calls and certain other exceptions if needed.
@@ -68,21 +71,28 @@ void user_exception_handle(int exception)
     my_entry= thread_get_current_thread_entry();
     my_entry->user_context = my_entry->context;
 
+    /* The faulting address, before a page fault handler that enables
+       interrupts lets another exception overwrite it */
+    _tlb_get_exception_state(&state);
+
     switch(exception) {
     case EXCEPTION_TLBM:
-	KERNEL_PANIC("TLB Modification: not handled yet");
+	if (!tlb_modified_exception() && !process_page_fault())
+	    process_kill("write to a read-only page", state.badvaddr);
 	break;
     case EXCEPTION_TLBL:
-	KERNEL_PANIC("TLB Load: not handled yet");
+	if (!tlb_load_exception() && !process_page_fault())
+	    process_kill("load from an unmapped page", state.badvaddr);
 	break;
     case EXCEPTION_TLBS:
-	KERNEL_PANIC("TLB Store: not handled yet");
+	if (!tlb_store_exception() && !process_page_fault())
+	    process_kill("store to an unmapped page", state.badvaddr);
 	break;
     case EXCEPTION_ADDRL:
-	KERNEL_PANIC("Address Error Load: not handled yet");
+	process_kill("address error on load", state.badvaddr);
 	break;
     case EXCEPTION_ADDRS:
-	KERNEL_PANIC("Address Error Store: not handled yet");
+	process_kill("address error on store", state.badvaddr);
 	break;
     case EXCEPTION_BUSI:
 	KERNEL_PANIC("Bus Error Instruction: not handled yet");
@@ -46,6 +46,8 @@
 #include "drivers/yams.h"
 #include "vm/vm.h"
 #include "vm/pagepool.h"
+#include "vm/pagecache.h"
+#include "vm/swap.h"
 
 /** @name Process startup
  *
@@ -56,6 +58,42 @@ process_table_t process_table[PROCESS_MAX_PROCESSES];
 
 spinlock_t process_table_slock;
 
+/* The executables of the processes, open while the process runs.
+   Their segments are loaded on demand, the read-only pages through
+   the page cache. */
+static struct {
+  openfile_t file;
+  elf_info_t elf;
+  /* Identity of the file in the page cache */
+  fs_t *fs;
+  int fileid;
+  /* End of the heap, which starts after the segments and grows with
+     process_memlimit */
+  uint32_t heap_end;
+  /* The address space, owned by the process and destroyed when it
+     finishes */
+  pagetable_t *pagetable;
+} process_image[PROCESS_MAX_PROCESSES];
+
+/* Largest number of user buffers pinned by one system call */
+#define PROCESS_MAX_PINS 4
+
+/* The user buffers pinned by the running system call of each
+   process (see process_prefault) */
+static struct {
+  struct {
+    uint32_t addr;
+    uint32_t len;
+  } ranges[PROCESS_MAX_PINS];
+  int count;
+} process_pins[PROCESS_MAX_PROCESSES];
+
+/* Start state of forked processes, handed from process_fork to the
+   new thread */
+static struct {
+  context_t context;
+} process_fork_start_state[PROCESS_MAX_PROCESSES];
+
 void process_reset(process_id_t pid)
 {
   process_table[pid].state         = PROCESS_FREE;
@@ -67,7 +105,7 @@ void process_init()
 {
   int i;
   spinlock_reset(&process_table_slock);
-  for (i = 0; i <= PROCESS_MAX_PROCESSES; ++i)
+  for (i = 0; i < PROCESS_MAX_PROCESSES; ++i)
     process_reset(i);
 }
 
@@ -80,7 +118,7 @@ process_id_t alloc_process_id(process_state_t newstate)
   intr_status = _interrupt_disable();
 
   spinlock_acquire(&process_table_slock);
-  for (i = 0; i <= PROCESS_MAX_PROCESSES; i++) {
+  for (i = 0; i < PROCESS_MAX_PROCESSES; i++) {
     if (process_table[i].state == PROCESS_FREE) {
       process_reset(i);
       process_table[i].state = newstate;
@@ -89,9 +127,451 @@ process_id_t alloc_process_id(process_state_t newstate)
   }
   spinlock_release(&process_table_slock);
   _interrupt_set_state(intr_status);
-  return i <= PROCESS_MAX_PROCESSES ? i : -1;
+  return i < PROCESS_MAX_PROCESSES ? i : -1;
+}
+
+
+/* Lowest address of the userland stack */
+#define USERLAND_STACK_BOTTOM \
+  ((USERLAND_STACK_TOP & PAGE_SIZE_MASK) - \
+   (CONFIG_USERLAND_STACK_SIZE-1)*PAGE_SIZE)
+
+/* Returns the first address of the heap: the page after the RW
+ * segment, or after the RO segment if there is no RW segment.
+ */
+static uint32_t process_heap_start(elf_info_t *elf)
+{
+  if (elf->rw_pages > 0)
+    return (elf->rw_vaddr & PAGE_SIZE_MASK) + elf->rw_pages*PAGE_SIZE;
+  return (elf->ro_vaddr & PAGE_SIZE_MASK) + elf->ro_pages*PAGE_SIZE;
+}
+
+/* Checks whether the given user page belongs to the current process.
+ * Sets *write to whether the page is writable.
+ */
+static int process_valid_page(uint32_t page, int *write)
+{
+  process_id_t pid = process_get_current_process();
+  elf_info_t *elf = &process_image[pid].elf;
+
+  *write = 1;
+  if (page >= USERLAND_STACK_BOTTOM
+      && page <= (USERLAND_STACK_TOP & PAGE_SIZE_MASK))
+    return 1;
+  if (page >= elf->rw_vaddr
+      && page < elf->rw_vaddr + elf->rw_pages*PAGE_SIZE)
+    return 1;
+  if (page >= process_heap_start(elf)
+      && page < process_image[pid].heap_end)
+    return 1;
+
+  *write = 0;
+  if (page >= elf->ro_vaddr
+      && page < elf->ro_vaddr + elf->ro_pages*PAGE_SIZE)
+    return 1;
+
+  return 0;
+}
+
+/* Reads the part of a segment which falls on the given page from the
+ * executable to the page frame at kaddr. Returns the number of bytes
+ * read.
+ */
+static int process_load_segment(uint32_t page, uint32_t kaddr,
+                                 uint32_t vaddr, uint32_t location,
+                                 uint32_t size)
+{
+  openfile_t file = process_image[process_get_current_process()].file;
+  uint32_t offset, len;
+
+  if (page < vaddr || page - vaddr >= size)
+    return 0;
+
+  offset = page - vaddr;
+  len = size - offset;
+  if (len > PAGE_SIZE)
+    len = PAGE_SIZE;
+
+  KERNEL_ASSERT(vfs_seek(file, location + offset) == VFS_OK);
+  KERNEL_ASSERT(vfs_read(file, (void *)kaddr, len) == (int)len);
+  return len;
+}
+
+/* Checks whether the given page of the current process can be loaded
+ * on a new large page: the pair of large pages around it must be in
+ * the RW segment and the heap above it, the large page must not have
+ * any pages yet and the other one of the pair must not have 4k pages.
+ * The heap only gets large pages once its end covers a whole pair, so
+ * a heap grown in small steps is mapped with 4k pages until then.
+ */
+static int process_large_page_ok(pagetable_t *pagetable, uint32_t page)
+{
+  process_id_t pid = process_get_current_process();
+  elf_info_t *elf = &process_image[pid].elf;
+  uint32_t pair, large, start, i;
+  pte_t *pte;
+
+  if (!vm_use_large_pages())
+    return 0;
+
+  /* The heap starts right after the RW segment */
+  start = (elf->rw_pages > 0) ? elf->rw_vaddr : process_heap_start(elf);
+
+  pair = page & ~(2*VM_LARGE_PAGE_SIZE - 1);
+  large = page & ~(VM_LARGE_PAGE_SIZE - 1);
+  if (pair < start
+      || pair + 2*VM_LARGE_PAGE_SIZE > process_image[pid].heap_end)
+    return 0;
+
+  pte = vm_lookup(pagetable, pair);
+  if (pte == NULL)
+    return 1;
+
+  for (i = 0; i < 2*VM_LARGE_PAGE_PAGES; i++) {
+    if (!pte[i].V && !(pte[i].soft & (PTE_SWAPPED | PTE_EVICTING)))
+      continue;
+    if (pair + i*PAGE_SIZE - large < VM_LARGE_PAGE_SIZE
+        || !(pte[i].soft & PTE_LARGE))
+      return 0;
+  }
+
+  return 1;
+}
+
+/* Loads the large page containing the given page of the RW segment or
+ * the heap of the current process, see process_large_page_ok. Returns
+ * 0 if there is no free block for it or no memory for its leaf table.
+ */
+static int process_load_large_page(pagetable_t *pagetable, uint32_t page)
+{
+  elf_info_t *elf = &process_image[process_get_current_process()].elf;
+  uint32_t phys_pages, kaddr, i;
+
+  phys_pages = pagepool_get_phys_pages(CONFIG_VM_LARGE_PAGE_ORDER);
+  if (phys_pages == 0)
+    return 0;
+
+  page &= ~(VM_LARGE_PAGE_SIZE - 1);
+  for (i = 0; i < VM_LARGE_PAGE_PAGES; i++) {
+    kaddr = ADDR_PHYS_TO_KERNEL(phys_pages + i*PAGE_SIZE);
+    memoryset((void *)kaddr, 0, PAGE_SIZE);
+    if (process_load_segment(page + i*PAGE_SIZE, kaddr, elf->rw_vaddr,
+                             elf->rw_location, elf->rw_size) == 0)
+      vm_stat_inc(pagetable, VM_STAT_ZERO_FILLS);
+  }
+
+  if (!vm_map_large(pagetable, phys_pages, page, 1)) {
+    pagepool_free_phys_pages(phys_pages, CONFIG_VM_LARGE_PAGE_ORDER);
+    return 0;
+  }
+  return 1;
+}
+
+/* Maps the given valid page of the current process to a new page
+ * frame, which is zeroed and filled from the executable if the page
+ * has data in it. With large pages enabled the whole large page
+ * around a page of the RW segment or the heap is loaded when possible.
+ * Interrupts must be enabled, as this may block on reading the
+ * executable.
+ */
+static void process_load_page(uint32_t page, int write)
+{
+  process_id_t pid = process_get_current_process();
+  elf_info_t *elf = &process_image[pid].elf;
+  pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
+  uint32_t phys_page, kaddr, offset;
+
+  /* Read-only pages are the same in every process running the
+     executable, share them if they are cached */
+  offset = elf->ro_location + (page - elf->ro_vaddr);
+  if (!write) {
+    phys_page = pagecache_get(process_image[pid].fs,
+                              process_image[pid].fileid, offset);
+    if (phys_page != 0) {
+      if (!vm_map_shared(pagetable, phys_page, page)) {
+        pagecache_put(phys_page);
+        process_kill("out of memory", page);
+      }
+      return;
+    }
+  }
+
+  if (write && process_large_page_ok(pagetable, page)
+      && process_load_large_page(pagetable, page))
+    return;
+
+  /* A 4k page can not be mapped next to large pages */
+  if (vm_use_large_pages())
+    vm_split_large(pagetable, page);
+
+  phys_page = swap_get_phys_page();
+  if (phys_page == 0)
+    process_kill("out of memory", page);
+
+  kaddr = ADDR_PHYS_TO_KERNEL(phys_page);
+  memoryset((void *)kaddr, 0, PAGE_SIZE);
+
+  if (process_load_segment(page, kaddr, elf->ro_vaddr, elf->ro_location,
+                           elf->ro_size)
+      + process_load_segment(page, kaddr, elf->rw_vaddr, elf->rw_location,
+                             elf->rw_size) == 0)
+    vm_stat_inc(pagetable, VM_STAT_ZERO_FILLS);
+
+  if (!write) {
+    phys_page = pagecache_insert(process_image[pid].fs,
+                                 process_image[pid].fileid, offset,
+                                 phys_page);
+    if (!vm_map_shared(pagetable, phys_page, page)) {
+      pagecache_put(phys_page);
+      process_kill("out of memory", page);
+    }
+  } else if (!vm_map(pagetable, phys_page, page, write)) {
+    pagepool_free_phys_page(phys_page);
+    process_kill("out of memory", page);
+  }
 }
 
+/* Makes the given valid page of the current process present, loading
+ * it or reading it back from the swap disk. Interrupts must be
+ * enabled.
+ */
+static void process_fault_in(uint32_t page, int write)
+{
+  pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
+  pte_t *pte;
+
+  pte = vm_lookup(pagetable, page);
+  if (pte != NULL && pte->V)
+    return;
+
+  if (pte != NULL && (pte->soft & (PTE_SWAPPED | PTE_EVICTING))) {
+    if (!swap_in(pagetable, page))
+      process_kill("out of memory", page);
+  } else {
+    process_load_page(page, write);
+  }
+
+  vm_stat_inc(pagetable, VM_STAT_PAGE_FAULTS);
+}
+
+/* Makes the given copy-on-write page of the current process
+ * writable, evicting pages until there is memory for the copy. Does
+ * nothing if the page is not copy-on-write. Interrupts must be
+ * enabled. Returns 0 if out of memory.
+ */
+static int process_copy_on_write(uint32_t page)
+{
+  pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
+  pte_t *pte;
+
+  pte = vm_lookup(pagetable, page);
+  if (pte == NULL || !pte->V || !(pte->soft & PTE_COW))
+    return 1;
+
+  while (!vm_copy_on_write(pagetable, page)) {
+    if (!swap_reclaim())
+      return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * Handles a TLB exception of the current process: stack and BSS pages
+ * which are not present are zero filled, segment pages are read from
+ * the executable and swapped out pages are read from the swap disk.
+ * A write to a copy-on-write page copies the page. Called from the
+ * user exception handler with interrupts disabled, they are enabled
+ * while the page is loaded or copied.
+ *
+ * @return 1 if the faulting instruction can be retried, 0 if the
+ * address does not belong to the process.
+ */
+int process_page_fault(void)
+{
+  tlb_exception_state_t state;
+  uint32_t page;
+  pte_t *pte;
+  int write, copied;
+
+  _tlb_get_exception_state(&state);
+  page = state.badvaddr & PAGE_SIZE_MASK;
+
+  if (!process_valid_page(page, &write))
+    return 0;
+
+  /* Already mapped, so the fault was not caused by a missing page
+     but by a write to a read-only or copy-on-write page */
+  pte = vm_lookup(thread_get_current_thread_entry()->pagetable, page);
+  if (pte != NULL && pte->V) {
+    if (!(pte->soft & PTE_COW))
+      return 0;
+    _interrupt_enable();
+    copied = process_copy_on_write(page);
+    if (!copied)
+      process_kill("out of memory", page);
+    _interrupt_disable();
+    return 1;
+  }
+
+  _interrupt_enable();
+  process_fault_in(page, write);
+  _interrupt_disable();
+
+  return 1;
+}
+
+/* Releases the pins of the pages of the given user buffer. */
+static void process_unpin_range(pagetable_t *pagetable, uint32_t addr,
+                                uint32_t len)
+{
+  uint32_t page, last;
+
+  if (len == 0)
+    return;
+
+  last = (addr + len - 1) & PAGE_SIZE_MASK;
+  for (page = addr & PAGE_SIZE_MASK; ; page += PAGE_SIZE) {
+    swap_unpin(pagetable, page);
+    if (page == last)
+      break;
+  }
+}
+
+/* Faults in and pins one page of a system call buffer, see
+ * process_prefault. Returns 0 if out of memory.
+ */
+static int process_pin_page(pagetable_t *pagetable, uint32_t page,
+                            int writable, int write)
+{
+  /* The page may be swapped out again before it is pinned */
+  do {
+    process_fault_in(page, writable);
+
+    /* Copy now, the kernel can not copy when it writes to the page */
+    if (write && !process_copy_on_write(page))
+      return 0;
+  } while (!swap_pin(pagetable, page));
+
+  return 1;
+}
+
+/**
+ * Makes sure that a buffer given to a system call is mapped, so that
+ * the kernel does not fault when accessing it. The pages of the
+ * buffer stay in memory until the system call returns and calls
+ * process_unpin (see swap_pin). Called with interrupts enabled.
+ *
+ * @param addr Userland address of the buffer
+ * @param len Length of the buffer in bytes
+ * @param write Whether the kernel will write to the buffer
+ *
+ * @return 1 if the buffer is valid, 0 if some part of it does not
+ * belong to the process (or is read-only and write is set), there is
+ * no memory for it or the system call has too many buffers.
+ */
+int process_prefault(uint32_t addr, uint32_t len, int write)
+{
+  process_id_t pid = process_get_current_process();
+  pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
+  uint32_t first, page, last, start, old_len, end;
+  int writable, n;
+
+  if (len == 0)
+    return 1;
+  if (addr + len < addr)
+    return 0;
+
+  /* Record the buffer for process_unpin before pinning, so that the
+     pins are released also if the process is killed on the way. A
+     string is prefaulted a page at a time, its pieces are merged into
+     one buffer. */
+  n = process_pins[pid].count;
+  if (n > 0 && (addr & ~PAGE_SIZE_MASK) == 0
+      && process_pins[pid].ranges[n-1].addr
+         + process_pins[pid].ranges[n-1].len == addr) {
+    n--;
+  } else {
+    if (n == PROCESS_MAX_PINS)
+      return 0;
+    process_pins[pid].ranges[n].addr = addr;
+    process_pins[pid].ranges[n].len = 0;
+    process_pins[pid].count++;
+  }
+  start = process_pins[pid].ranges[n].addr;
+  old_len = process_pins[pid].ranges[n].len;
+
+  first = addr & PAGE_SIZE_MASK;
+  last = (addr + len - 1) & PAGE_SIZE_MASK;
+  for (page = first; ; page += PAGE_SIZE) {
+    if (!process_valid_page(page, &writable) || (write && !writable)
+        || !process_pin_page(pagetable, page, writable, write)) {
+      /* Release the pages pinned so far */
+      process_unpin_range(pagetable, first, page - first);
+      process_pins[pid].ranges[n].len = old_len;
+      if (old_len == 0)
+        process_pins[pid].count--;
+      return 0;
+    }
+
+    end = (page == last) ? addr + len : page + PAGE_SIZE;
+    process_pins[pid].ranges[n].len = end - start;
+
+    if (page == last)
+      break;
+  }
+
+  return 1;
+}
+
+/**
+ * Releases the pages pinned by process_prefault for the system call
+ * of the current process. Called when the system call returns and
+ * when the process finishes.
+ */
+void process_unpin(void)
+{
+  process_id_t pid = process_get_current_process();
+  pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
+  int i;
+
+  for (i = 0; i < process_pins[pid].count; i++)
+    process_unpin_range(pagetable, process_pins[pid].ranges[i].addr,
+                        process_pins[pid].ranges[i].len);
+  process_pins[pid].count = 0;
+}
+
+/**
+ * Makes sure that a NUL terminated string given to a system call is
+ * mapped. Called with interrupts enabled.
+ *
+ * @param addr Userland address of the string
+ * @param maxlen Longest accepted string, including the NUL
+ *
+ * @return 1 if the string is valid, 0 if it does not belong to the
+ * process or is not terminated within maxlen bytes.
+ */
+int process_prefault_string(uint32_t addr, uint32_t maxlen)
+{
+  uint32_t end, i;
+
+  end = addr + maxlen;
+  while (addr < end) {
+    /* Map the rest of the page and look for the terminator in it */
+    i = PAGE_SIZE - (addr & ~PAGE_SIZE_MASK);
+    if (i > end - addr)
+      i = end - addr;
+    if (!process_prefault(addr, i, 0))
+      return 0;
+
+    for (; i > 0; i--, addr++) {
+      if (*(char *)addr == '\0')
+        return 1;
+    }
+  }
+
+  return 0;
+}
 
 /**
  * Starts one userland process. The thread calling this function will
@@ -109,15 +589,11 @@ void process_start(process_id_t pid)
 {
   thread_table_t *my_entry;
   pagetable_t *pagetable;
-  uint32_t phys_page;
   context_t user_context;
-  uint32_t stack_bottom;
   elf_info_t elf;
   openfile_t file;
   char *executable;
 
-  int i;
-
   interrupt_status_t intr_status;
 
   my_entry = thread_get_current_thread_entry();
@@ -129,15 +605,22 @@ void process_start(process_id_t pid)
      This is not possible. */
   KERNEL_ASSERT(my_entry->pagetable == NULL);
 
-  pagetable = vm_create_pagetable(thread_get_current_thread());
-  KERNEL_ASSERT(pagetable != NULL);
+  process_image[pid].file = -1;
+  process_pins[pid].count = 0;
+
+  pagetable = vm_create_pagetable();
+  process_image[pid].pagetable = pagetable;
+  if (pagetable == NULL) {
+    kprintf("Process %d killed: out of memory for the page table\n", pid);
+    process_finish(PROCESS_RETVAL_KILLED);
+  }
 
   intr_status = _interrupt_disable();
   my_entry->pagetable = pagetable;
 
-  /* Update TLB to allow access to the virtual addresses of the
-     segments. */
-  _tlb_set_asid(thread_get_current_thread());
+  /* Set the ASID so that the TLB exception handlers fill the TLB
+     from our pagetable. */
+  tlb_switch(pagetable);
 
   _interrupt_set_state(intr_status);
 
@@ -149,83 +632,17 @@ void process_start(process_id_t pid)
   /* Trivial and naive sanity check for entry point: */
   KERNEL_ASSERT(elf.entry_point >= PAGE_SIZE);
 
-  /* Calculate the number of pages needed by the whole process
-     (including userland stack). Since we don't have proper tlb
-     handling code, all these pages must fit into TLB. */
-  KERNEL_ASSERT(elf.ro_pages + elf.rw_pages + CONFIG_USERLAND_STACK_SIZE
-                <= _tlb_get_maxindex() + 1);
-
-  /* Allocate and map stack */
-  for(i = 0; i < CONFIG_USERLAND_STACK_SIZE; i++) {
-    phys_page = pagepool_get_phys_page();
-    KERNEL_ASSERT(phys_page != 0);
-    vm_map(my_entry->pagetable, phys_page,
-           (USERLAND_STACK_TOP & PAGE_SIZE_MASK) - i*PAGE_SIZE, 1);
-  }
-
-  /* Put the mapped pages into TLB. Here we again assume that the
-     pages fit into the TLB. After writing proper TLB exception
-     handling this call should be skipped. */
-  intr_status = _interrupt_disable();
-  tlb_fill(my_entry->pagetable);
-  _interrupt_set_state(intr_status);
-
-  /* Now we may use the virtual addresses of the segments. */
-
-  /* Allocate and map pages for the segments. We assume that
-     segments begin at page boundary. (The linker script in tests
-     directory creates this kind of segments) */
-  for(i = 0; i < (int)elf.ro_pages; i++) {
-    phys_page = pagepool_get_phys_page();
-    KERNEL_ASSERT(phys_page != 0);
-    vm_map(my_entry->pagetable, phys_page,
-           elf.ro_vaddr + i*PAGE_SIZE, 1);
-  }
-
-  for(i = 0; i < (int)elf.rw_pages; i++) {
-    phys_page = pagepool_get_phys_page();
-    KERNEL_ASSERT(phys_page != 0);
-    vm_map(my_entry->pagetable, phys_page,
-           elf.rw_vaddr + i*PAGE_SIZE, 1);
-  }
-
-  /* Zero the pages. */
-  memoryset((void *)elf.ro_vaddr, 0, elf.ro_pages*PAGE_SIZE);
-  memoryset((void *)elf.rw_vaddr, 0, elf.rw_pages*PAGE_SIZE);
-
-  stack_bottom = (USERLAND_STACK_TOP & PAGE_SIZE_MASK) -
-    (CONFIG_USERLAND_STACK_SIZE-1)*PAGE_SIZE;
-  memoryset((void *)stack_bottom, 0, CONFIG_USERLAND_STACK_SIZE*PAGE_SIZE);
-
-  /* Copy segments */
-
-  if (elf.ro_size > 0) {
-    /* Make sure that the segment is in proper place. */
-    KERNEL_ASSERT(elf.ro_vaddr >= PAGE_SIZE);
-    KERNEL_ASSERT(vfs_seek(file, elf.ro_location) == VFS_OK);
-    KERNEL_ASSERT(vfs_read(file, (void *)elf.ro_vaddr, elf.ro_size)
-                  == (int)elf.ro_size);
-  }
-
-  if (elf.rw_size > 0) {
-    /* Make sure that the segment is in proper place. */
-    KERNEL_ASSERT(elf.rw_vaddr >= PAGE_SIZE);
-    KERNEL_ASSERT(vfs_seek(file, elf.rw_location) == VFS_OK);
-    KERNEL_ASSERT(vfs_read(file, (void *)elf.rw_vaddr, elf.rw_size)
-                  == (int)elf.rw_size);
-  }
-
-
-  /* Set the dirty bit to zero (read-only) on read-only pages. */
-  for(i = 0; i < (int)elf.ro_pages; i++) {
-    vm_set_dirty(my_entry->pagetable, elf.ro_vaddr + i*PAGE_SIZE, 0);
-  }
-
-  /* Insert page mappings again to TLB to take read-only bits into use */
-  intr_status = _interrupt_disable();
-  tlb_fill(my_entry->pagetable);
-  _interrupt_set_state(intr_status);
-
+  /* Nothing is mapped here. The stack and the segments are mapped
+     page by page when the process first touches them, see
+     process_page_fault. We assume that segments begin at page
+     boundary. (The linker script in tests directory creates this
+     kind of segments) */
+  KERNEL_ASSERT(elf.ro_size == 0 || elf.ro_vaddr >= PAGE_SIZE);
+  KERNEL_ASSERT(elf.rw_size == 0 || elf.rw_vaddr >= PAGE_SIZE);
+  process_image[pid].file = file;
+  process_image[pid].elf = elf;
+  process_image[pid].fileid = vfs_get_fileid(file, &process_image[pid].fs);
+  process_image[pid].heap_end = process_heap_start(&elf);
 
   /* Initialize the user context. (Status register is handled by
      thread_goto_userland) */
@@ -273,6 +690,187 @@ process_id_t process_spawn(const char* executable)
 }
 
 
+/* Runs a process created by process_fork in the new thread. */
+static void process_fork_start(process_id_t pid)
+{
+  thread_table_t *my_entry;
+  context_t user_context;
+  interrupt_status_t intr_status;
+
+  my_entry = thread_get_current_thread_entry();
+  my_entry->process_id = pid;
+  user_context = process_fork_start_state[pid].context;
+
+  intr_status = _interrupt_disable();
+  my_entry->pagetable = process_image[pid].pagetable;
+  tlb_switch(my_entry->pagetable);
+  _interrupt_set_state(intr_status);
+
+  thread_goto_userland(&user_context);
+
+  KERNEL_PANIC("thread_goto_userland failed.");
+}
+
+/**
+ * Moves the end of the heap of the current process. The heap starts on
+ * the page after the segments of the executable. Its pages are mapped
+ * zero filled when first touched, like the BSS, and the pages wholly
+ * above a lowered end are unmapped and freed. A large page cut by the
+ * new end is split, and only its pages above the end are freed.
+ *
+ * @param heap_end The new end of the heap, or 0 to query it
+ *
+ * @return The end of the heap, or 0 if heap_end is below the start of
+ * the heap or runs into the stack.
+ */
+uint32_t process_memlimit(uint32_t heap_end)
+{
+  process_id_t pid = process_get_current_process();
+  pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
+  uint32_t old_top, new_top;
+
+  if (heap_end == 0)
+    return process_image[pid].heap_end;
+
+  if (heap_end < process_heap_start(&process_image[pid].elf)
+      || heap_end > USERLAND_STACK_BOTTOM)
+    return 0;
+
+  old_top = (process_image[pid].heap_end + PAGE_SIZE - 1) & PAGE_SIZE_MASK;
+  new_top = (heap_end + PAGE_SIZE - 1) & PAGE_SIZE_MASK;
+
+  /* Pages above the end can not be faulted in again once it is set */
+  process_image[pid].heap_end = heap_end;
+  if (new_top < old_top)
+    vm_unmap_range(pagetable, new_top, (old_top - new_top) / PAGE_SIZE);
+
+  return heap_end;
+}
+
+/**
+ * Creates a child of the current process, running in a copy of its
+ * address space. The pages are shared copy-on-write, so only the page
+ * table is copied here. The child starts by calling func(arg) on its
+ * copy of the stack, with the other registers as they were at the
+ * system call, and must end with an exit system call.
+ *
+ * @param func Userland function to start the child in
+ * @param arg Argument passed to func
+ *
+ * @return PID of the child, or -1 if the process or thread table is
+ * full, the executable can not be opened or there is no memory for
+ * the page table.
+ */
+int process_fork(void (*func)(uint32_t), uint32_t arg)
+{
+  thread_table_t *my_entry = thread_get_current_thread_entry();
+  process_id_t my_pid = process_get_current_process();
+  process_id_t pid;
+  context_t *context;
+  pagetable_t *pagetable;
+  interrupt_status_t intr_status;
+  TID_t thread;
+
+  pid = alloc_process_id(PROCESS_RUNNING);
+  if (pid < 0) { /* Process table full */
+    return -1;
+  }
+  stringcopy(process_table[pid].executable, process_table[my_pid].executable,
+             PROCESS_NAME_MAX);
+  process_table[pid].retval = 0;
+  process_table[pid].first_zombie = -1;
+  process_table[pid].prev_zombie = -1;
+  process_table[pid].next_zombie = -1;
+  process_table[pid].parent = my_pid;
+  process_table[pid].children = 0;
+
+  intr_status = _interrupt_disable();
+  spinlock_acquire(&process_table_slock);
+  process_table[my_pid].children++;
+  spinlock_release(&process_table_slock);
+  _interrupt_set_state(intr_status);
+
+  /* The child has its own handle to the executable for loading the
+     pages which are not mapped yet */
+  process_image[pid].file = vfs_open(process_table[pid].executable);
+  if (process_image[pid].file < 0) {
+    /* Open file table full or the executable was removed */
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&process_table_slock);
+    process_table[my_pid].children--;
+    process_reset(pid);
+    spinlock_release(&process_table_slock);
+    _interrupt_set_state(intr_status);
+    return -1;
+  }
+  process_image[pid].elf = process_image[my_pid].elf;
+  process_image[pid].fs = process_image[my_pid].fs;
+  process_image[pid].fileid = process_image[my_pid].fileid;
+  process_image[pid].heap_end = process_image[my_pid].heap_end;
+  process_pins[pid].count = 0;
+
+  context = &process_fork_start_state[pid].context;
+  *context = *my_entry->user_context;
+  context->status = 0;
+  context->pc = (uint32_t)func;
+  context->cpu_regs[MIPS_REGISTER_A0] = arg;
+  context->cpu_regs[MIPS_REGISTER_RA] = 0;
+
+  pagetable = vm_create_pagetable();
+  if (pagetable == NULL || !vm_copy_pagetable(my_entry->pagetable, pagetable))
+    thread = -1;
+  else
+    thread = thread_create((void (*)(uint32_t))(&process_fork_start),
+                           (uint32_t)pid);
+  if (thread < 0) { /* Out of memory or thread table full, undo the child */
+    if (pagetable != NULL)
+      vm_destroy_pagetable(pagetable);
+    vfs_close(process_image[pid].file);
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&process_table_slock);
+    process_table[my_pid].children--;
+    process_reset(pid);
+    spinlock_release(&process_table_slock);
+    _interrupt_set_state(intr_status);
+    return -1;
+  }
+
+  process_image[pid].pagetable = pagetable;
+
+  thread_run(thread);
+  return pid;
+}
+
+/**
+ * Returns a memory event counter of a running process, counted in its
+ * page table (see vm_stat_inc).
+ *
+ * @param pid The process
+ * @param counter One of VM_STAT_*
+ *
+ * @return The counter, or -1 if there is no such process.
+ */
+int process_vm_stat(process_id_t pid, int counter)
+{
+  interrupt_status_t intr_status;
+  int value = -1;
+
+  if (pid < 0 || pid >= PROCESS_MAX_PROCESSES)
+    return -1;
+
+  /* The page table is destroyed only after process_finish has
+     cleared it under the lock */
+  intr_status = _interrupt_disable();
+  spinlock_acquire(&process_table_slock);
+  if (process_table[pid].state == PROCESS_RUNNING
+      && process_image[pid].pagetable != NULL)
+    value = process_image[pid].pagetable->stats.count[counter];
+  spinlock_release(&process_table_slock);
+  _interrupt_set_state(intr_status);
+
+  return value;
+}
+
 process_id_t process_get_current_process(void)
 {
   return thread_get_current_thread_entry()->process_id;
@@ -405,24 +1003,59 @@ void process_finish(int retval)
   interrupt_status_t intr_status;
   thread_table_t *thread = thread_get_current_thread_entry();
   process_id_t pid = thread->process_id;
+  pagetable_t *pagetable;
 
   if (retval < 0) {
     /* Not permitted! */
     retval = 0;
   }
 
+  /* The process may finish in the middle of a system call */
+  process_unpin();
+
   intr_status = _interrupt_disable();
   spinlock_acquire(&process_table_slock);
+  thread->pagetable = NULL;
+  pagetable = process_image[pid].pagetable;
+  process_image[pid].pagetable = NULL;
+  spinlock_release(&process_table_slock);
+  _interrupt_set_state(intr_status);
 
-  vm_destroy_pagetable(thread->pagetable);
+  /* These may block, so close the executable and free the memory
+     before taking the lock. A process which ran out of memory while
+     starting may have neither. */
+  if (process_image[pid].file >= 0)
+    vfs_close(process_image[pid].file);
+  if (pagetable != NULL)
+    vm_destroy_pagetable(pagetable);
 
-  finish_given_process(pid, retval);
+  intr_status = _interrupt_disable();
+  spinlock_acquire(&process_table_slock);
 
-  thread->pagetable = NULL;
+  finish_given_process(pid, retval);
 
   spinlock_release(&process_table_slock);
   _interrupt_set_state(intr_status);
   thread_finish();
 }
 
+/**
+ * Terminate the current process because it did something it is not
+ * allowed to do, such as access unmapped memory. The process exits
+ * with return value PROCESS_RETVAL_KILLED.
+ *
+ * @param reason Description of the invalid operation, printed on
+ * the console.
+ *
+ * @param addr The address the operation accessed, printed with the
+ * reason.
+ */
+void process_kill(const char *reason, uint32_t addr)
+{
+  kprintf("Process %d killed: %s (address 0x%8.8x)\n",
+          process_get_current_process(), reason, addr);
+
+  process_finish(PROCESS_RETVAL_KILLED);
+}
+
 /** @} */
@@ -77,10 +77,38 @@ process_table_t *process_get_current_process_entry(void);
 /* Stop the current process and the kernel thread in which it runs. */
 void process_finish(int retval);
 
+/* Return value of a process killed by the kernel. */
+#define PROCESS_RETVAL_KILLED 255
+
+/* Stop the current process because of an invalid operation. */
+void process_kill(const char *reason, uint32_t addr);
+
+/* Map the page of the current process faulted on in user mode,
+   returns 1 if done and 0 if the address is invalid. */
+int process_page_fault(void);
+
+/* Map the user buffer, or string, given to a system call, returns 1
+   if done and 0 if the buffer is (partly) invalid. */
+int process_prefault(uint32_t addr, uint32_t len, int write);
+int process_prefault_string(uint32_t addr, uint32_t maxlen);
+
+/* Let the buffers of the finished system call be swapped out again */
+void process_unpin(void);
+
+/* Set the end of the heap of the current process (0 queries it),
+   returns the end or 0 if it is invalid. */
+uint32_t process_memlimit(uint32_t heap_end);
+
+/* Memory event counter (VM_STAT_* of vm/pagetable.h) of a running
+   process, -1 if there is no such process. */
+int process_vm_stat(process_id_t pid, int counter);
+
 /* Wait for the given process to terminate, returning its return
    value, and marking the process table entry as free. */
 int process_join(process_id_t pid);
 
+/* Create a copy-on-write copy of the current process, which starts
+   by calling func(arg). Returns the PID of the copy. */
 int process_fork(void (*func)(uint32_t), uint32_t arg);
 
 void process_init(void);
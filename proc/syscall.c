@@ -43,10 +43,17 @@
 #include "drivers/device.h"
 #include "drivers/gcd.h"
 #include "fs/vfs.h"
+#include "fs/bcache.h"
 #include "kernel/thread.h"
+#include "drivers/metadev.h"
+#include "kernel/scheduler.h"
+#include "vm/vm.h"
+#include "vm/pagepool.h"
 
 int syscall_write(uint32_t fd, char *s, int len)
 {
+  if(len < 0 || !process_prefault((uint32_t)s, len, 0))
+    return VFS_ERROR;
   // if fd > 2 then it is a file and not console, call vfs write, with fd - 3
   if(fd > 2){
     return vfs_write(fd - 3 , s, len); 
@@ -67,6 +74,8 @@ int syscall_write(uint32_t fd, char *s, int len)
 
 int syscall_read(uint32_t fd, char *s, int len)
 {
+  if(len < 0 || !process_prefault((uint32_t)s, len, 1))
+    return VFS_ERROR;
   // if fd > 2 then it is a file and not console, call vfs read, with fd-3
   if(fd > 2){
     return vfs_read(fd - 3, s, len); 
@@ -89,7 +98,12 @@ int syscall_open(char* pathname){
   // vfs return file handles from 0 and up, we add 3
   // because 0, 1 and 2 is reserved for stdin, stdout and stderr
 
-  int ret = vfs_open(pathname);
+  int ret;
+
+  if(!process_prefault_string((uint32_t)pathname, VFS_PATH_LENGTH))
+    return VFS_ERROR;
+
+  ret = vfs_open(pathname);
   if( ret < 0){// if ret <0, there is error
     return ret;
   }
@@ -101,9 +115,13 @@ int syscall_close(int filehandle){
   return vfs_close(filehandle - 3);
 }
 int syscall_create(char* pathname, int size){
+  if(!process_prefault_string((uint32_t)pathname, VFS_PATH_LENGTH))
+    return VFS_ERROR;
   return vfs_create(pathname, size);
 }
 int syscall_delete(char* pathname){
+  if(!process_prefault_string((uint32_t)pathname, VFS_PATH_LENGTH))
+    return VFS_ERROR;
   return vfs_remove(pathname);
 }
 
@@ -112,13 +130,120 @@ int syscall_seek(int filehande, int offset){
 }
 
 int syscall_filecount(char* name){
+  if(name != NULL
+     && !process_prefault_string((uint32_t)name, VFS_PATH_LENGTH))
+    return VFS_ERROR;
   return vfs_filecount(name);
 }
 
 int syscall_file(char* name, int index, char* buffer){
+  if(name != NULL
+     && !process_prefault_string((uint32_t)name, VFS_PATH_LENGTH))
+    return VFS_ERROR;
+  if(!process_prefault((uint32_t)buffer, VFS_NAME_LENGTH, 1))
+    return VFS_ERROR;
   return vfs_file(name, index, buffer);
 }
 
+int syscall_exec(char* executable){
+  if(!process_prefault_string((uint32_t)executable, PROCESS_NAME_MAX))
+    return -1;
+  return process_spawn(executable);
+}
+
+/* Maps a STAT_VM_* counter to the VM_STAT_* counter of the kernel,
+ * -1 if there is no such counter. */
+static int syscall_vm_counter(int counter){
+  switch(counter){
+  case STAT_VM_PAGE_FAULTS:
+    return VM_STAT_PAGE_FAULTS;
+  case STAT_VM_PAGE_INS:
+    return VM_STAT_PAGE_INS;
+  case STAT_VM_PAGE_OUTS:
+    return VM_STAT_PAGE_OUTS;
+  case STAT_VM_TLB_REFILLS:
+    return VM_STAT_TLB_REFILLS;
+  case STAT_VM_TLB_MODIFIED:
+    return VM_STAT_TLB_MODIFIED;
+  case STAT_VM_ZERO_FILLS:
+    return VM_STAT_ZERO_FILLS;
+  case STAT_VM_COW_COPIES:
+    return VM_STAT_COW_COPIES;
+  case STAT_VM_ASID_ROLLOVERS:
+    return VM_STAT_ASID_ROLLOVERS;
+  }
+  return -1;
+}
+
+/* Returns a counter selected by the STAT_* constants of
+ * proc/syscall.h, or -1 if there is no such counter. */
+int syscall_stat(int class, int index, int counter){
+  const scheduler_stats_t *cpu_stats;
+  bcache_stats_t bcache_stats;
+  int vm_counter;
+
+  switch(class){
+  case STAT_SYSTEM:
+    if(counter == STAT_SYSTEM_CPUS)
+      return cpustatus_count();
+    return -1;
+  case STAT_CPU:
+    if(index >= cpustatus_count())
+      return -1;
+    cpu_stats = scheduler_get_stats(index);
+    if(cpu_stats == NULL)
+      return -1;
+    switch(counter){
+    case STAT_CPU_TIMER_INTERRUPTS:
+      return cpu_stats->timer_interrupts;
+    case STAT_CPU_SWITCHES:
+      return cpu_stats->switches;
+    case STAT_CPU_TICKLESS_IDLE:
+      return cpu_stats->tickless_idle;
+    case STAT_CPU_STRETCHED_SLICES:
+      return cpu_stats->stretched_slices;
+    case STAT_CPU_IDLE_KICKS:
+      return cpu_stats->idle_kicks;
+    case STAT_CPU_MIGRATIONS:
+      return cpu_stats->migrations;
+    }
+    return -1;
+  case STAT_VM:
+    if(counter == STAT_VM_FREE_PAGES)
+      return pagepool_get_free_pages();
+    vm_counter = syscall_vm_counter(counter);
+    if(vm_counter < 0)
+      return -1;
+    return vm_get_stat(-1, vm_counter);
+  case STAT_VM_CPU:
+    vm_counter = syscall_vm_counter(counter);
+    if(vm_counter < 0 || index < 0 || index >= cpustatus_count())
+      return -1;
+    return vm_get_stat(index, vm_counter);
+  case STAT_VM_PROCESS:
+    vm_counter = syscall_vm_counter(counter);
+    if(vm_counter < 0)
+      return -1;
+    if(index < 0)
+      index = process_get_current_process();
+    return process_vm_stat(index, vm_counter);
+  case STAT_BCACHE:
+    bcache_get_stats(&bcache_stats);
+    switch(counter){
+    case STAT_BCACHE_LOOKUPS:
+      return bcache_stats.lookups;
+    case STAT_BCACHE_HITS:
+      return bcache_stats.hits;
+    case STAT_BCACHE_DISK_READS:
+      return bcache_stats.disk_reads;
+    case STAT_BCACHE_DISK_WRITES:
+      return bcache_stats.disk_writes;
+    }
+    return -1;
+  }
+  return -1;
+}
+
 /**
  * Handle system calls. Interrupts are enabled when this function is
  * called.
@@ -148,7 +273,7 @@ void syscall_handle(context_t *user_context)
       halt_kernel();
       break;
     case SYSCALL_EXEC:
-      V0 = process_spawn((char *)A1);
+      V0 = syscall_exec((char *)A1);
       break;
     case SYSCALL_EXIT:
       process_finish(A1);
@@ -183,10 +308,35 @@ void syscall_handle(context_t *user_context)
     case SYSCALL_FILE:
       V0 = syscall_file((char*)A1, A2, (char*) A3);
       break;
+    case SYSCALL_GETTIME:
+      V0 = rtc_get_msec();
+      break;
+    case SYSCALL_SETPRIORITY:
+      V0 = scheduler_set_priority(thread_get_current_thread(), A1);
+      break;
+    case SYSCALL_STAT:
+      V0 = syscall_stat(A1, A2, A3);
+      break;
+    case SYSCALL_SETAFFINITY:
+      V0 = scheduler_set_affinity(thread_get_current_thread(), A1);
+      break;
+    case SYSCALL_FORK:
+      V0 = process_fork((void (*)(uint32_t))A1, A2);
+      break;
+    case SYSCALL_MEMLIMIT:
+      V0 = process_memlimit(A1);
+      break;
+    case SYSCALL_SLEEP:
+      thread_sleep_ms(A1);
+      V0 = 0;
+      break;
     default:
       KERNEL_PANIC("Unhandled system call\n");
     }
 
+  /* The buffers of the call may be swapped out again */
+  process_unpin();
+
   /* Move to next instruction after system call */
   user_context->pc += 4;
 
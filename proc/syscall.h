@@ -60,6 +60,54 @@
 #define SYSCALL_SEM_PROCURE 0x301
 #define SYSCALL_SEM_VACATE  0x302
 
+#define SYSCALL_GETTIME 0x401
+#define SYSCALL_SETPRIORITY 0x402
+#define SYSCALL_STAT 0x403
+#define SYSCALL_SETAFFINITY 0x404
+#define SYSCALL_SLEEP 0x405
+
+/* Statistics classes and counters of SYSCALL_STAT. The class selects
+ * the kind of object measured and the index selects the object
+ * (e.g. the CPU number).
+ */
+#define STAT_SYSTEM 0
+#define STAT_SYSTEM_CPUS 0
+
+#define STAT_CPU 1
+#define STAT_CPU_TIMER_INTERRUPTS 0
+#define STAT_CPU_SWITCHES 1
+#define STAT_CPU_TICKLESS_IDLE 2
+#define STAT_CPU_STRETCHED_SLICES 3
+#define STAT_CPU_IDLE_KICKS 4
+#define STAT_CPU_MIGRATIONS 5
+
+/* Memory counters of the whole system (STAT_VM), of the CPU given as
+ * index (STAT_VM_CPU) or of the running process given as index, -1
+ * for the calling process (STAT_VM_PROCESS). STAT_VM_FREE_PAGES is
+ * only available system wide.
+ */
+#define STAT_VM 2
+#define STAT_VM_CPU 3
+#define STAT_VM_PROCESS 4
+#define STAT_VM_PAGE_FAULTS 0
+#define STAT_VM_PAGE_INS 1
+#define STAT_VM_PAGE_OUTS 2
+#define STAT_VM_FREE_PAGES 3
+#define STAT_VM_TLB_REFILLS 4
+#define STAT_VM_TLB_MODIFIED 5
+#define STAT_VM_ZERO_FILLS 6
+#define STAT_VM_COW_COPIES 7
+#define STAT_VM_ASID_ROLLOVERS 8
+
+/* Block cache counters (index is ignored). The hit ratio is
+ * STAT_BCACHE_HITS / STAT_BCACHE_LOOKUPS.
+ */
+#define STAT_BCACHE 5
+#define STAT_BCACHE_LOOKUPS 0
+#define STAT_BCACHE_HITS 1
+#define STAT_BCACHE_DISK_READS 2
+#define STAT_BCACHE_DISK_WRITES 3
+
 /* When userland program reads or writes these already open files it
  * actually accesses the console.
  */
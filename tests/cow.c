@@ -0,0 +1,74 @@
+/*
+ * Test copy-on-write fork (syscall_fork).
+ *
+ * Fills a buffer, forks children which check and overwrite their
+ * copy of it, and checks that the parent's copy is unchanged.
+ */
+
+#include "tests/lib.h"
+
+#define CHILDREN 4
+
+/* Spans several pages */
+#define WORDS 4096
+
+static int data[WORDS];
+
+static void child(int n)
+{
+  int i;
+
+  for (i = 0; i < WORDS; i++) {
+    if (data[i] != i) {
+      printf("child %d: bad value %d at %d before write\n", n, data[i], i);
+      syscall_exit(1);
+    }
+  }
+
+  for (i = 0; i < WORDS; i++)
+    data[i] = -n;
+
+  for (i = 0; i < WORDS; i++) {
+    if (data[i] != -n) {
+      printf("child %d: bad value %d at %d after write\n", n, data[i], i);
+      syscall_exit(1);
+    }
+  }
+}
+
+int main(void)
+{
+  int pids[CHILDREN];
+  uint32_t start;
+  int i, failed = 0;
+
+  for (i = 0; i < WORDS; i++)
+    data[i] = i;
+
+  start = syscall_gettime();
+  for (i = 0; i < CHILDREN; i++) {
+    pids[i] = syscall_fork(&child, i + 1);
+    if (pids[i] < 0) {
+      printf("fork %d failed\n", i);
+      return 1;
+    }
+  }
+  printf("%d forks took %d ms\n", CHILDREN, syscall_gettime() - start);
+
+  for (i = 0; i < CHILDREN; i++) {
+    if (syscall_join(pids[i]) != 0) {
+      printf("child %d failed\n", i + 1);
+      failed = 1;
+    }
+  }
+
+  for (i = 0; i < WORDS; i++) {
+    if (data[i] != i) {
+      printf("parent: bad value %d at %d\n", data[i], i);
+      return 1;
+    }
+  }
+
+  printf(failed ? "cow test failed\n" : "cow test passed\n");
+  return failed;
+}
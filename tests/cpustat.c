@@ -0,0 +1,46 @@
+/*
+ * Print the scheduler statistics of each CPU.
+ *
+ * Migrations count the threads a CPU started which last ran on
+ * another CPU.
+ *
+ * The per second rates are averages since system startup. Compare
+ * the timer interrupt rates of kernels built with and without
+ * CONFIG_SCHEDULER_TICKLESS.
+ */
+
+#include "proc/syscall.h"
+#include "tests/lib.h"
+
+static int per_second(int count, uint32_t msec)
+{
+  if (msec == 0)
+    return 0;
+  return (int)((uint32_t)count * 1000 / msec);
+}
+
+int main(void)
+{
+  uint32_t now;
+  int cpus, cpu, timer, migrations;
+
+  now = syscall_gettime();
+  cpus = syscall_stat(STAT_SYSTEM, 0, STAT_SYSTEM_CPUS);
+
+  printf("uptime %d ms\n", now);
+  printf("cpu  timer irqs  irqs/s  switches  idle  stretched  kicks"
+         "  migrations  migr/s\n");
+  for (cpu = 0; cpu < cpus; cpu++) {
+    timer = syscall_stat(STAT_CPU, cpu, STAT_CPU_TIMER_INTERRUPTS);
+    migrations = syscall_stat(STAT_CPU, cpu, STAT_CPU_MIGRATIONS);
+    printf("%3d  %10d  %6d  %8d  %4d  %9d  %5d  %10d  %6d\n", cpu,
+           timer, per_second(timer, now),
+           syscall_stat(STAT_CPU, cpu, STAT_CPU_SWITCHES),
+           syscall_stat(STAT_CPU, cpu, STAT_CPU_TICKLESS_IDLE),
+           syscall_stat(STAT_CPU, cpu, STAT_CPU_STRETCHED_SLICES),
+           syscall_stat(STAT_CPU, cpu, STAT_CPU_IDLE_KICKS),
+           migrations, per_second(migrations, now));
+  }
+
+  return 0;
+}
@@ -0,0 +1,68 @@
+/*
+ * Test the growing heap (syscall_memlimit).
+ *
+ * Allocates blocks until the heap spans many pages, checks their
+ * contents, frees them and checks that the heap shrinks again.
+ */
+
+#include "tests/lib.h"
+
+#define BLOCKS 64
+#define BLOCK_SIZE 1000
+
+static char *blocks[BLOCKS];
+
+int main(void)
+{
+  char *start, *end, *grown;
+  int i, j;
+
+  heap_init();
+  start = syscall_memlimit(NULL);
+
+  for (i = 0; i < BLOCKS; i++) {
+    blocks[i] = malloc(BLOCK_SIZE);
+    if (blocks[i] == NULL) {
+      printf("malloc failed at block %d\n", i);
+      syscall_exit(1);
+    }
+    for (j = 0; j < BLOCK_SIZE; j++)
+      blocks[i][j] = (char)(i + j);
+  }
+
+  grown = syscall_memlimit(NULL);
+  printf("heap grew from 0x%x to 0x%x (%d bytes)\n",
+         (uint32_t)start, (uint32_t)grown, grown - start);
+
+  for (i = 0; i < BLOCKS; i++) {
+    for (j = 0; j < BLOCK_SIZE; j++) {
+      if (blocks[i][j] != (char)(i + j)) {
+        printf("bad value in block %d at %d\n", i, j);
+        syscall_exit(1);
+      }
+    }
+  }
+
+  for (i = 0; i < BLOCKS; i++)
+    free(blocks[i]);
+
+  end = syscall_memlimit(NULL);
+  printf("heap shrank to 0x%x (%d bytes)\n", (uint32_t)end, end - start);
+
+  /* Everything was freed, so only the page holding the free block
+     header may be left */
+  if (end >= grown || end - start > 4096) {
+    printf("heap did not shrink\n");
+    syscall_exit(1);
+  }
+
+  /* Below the start of the heap */
+  if (syscall_memlimit(start - 4096) != NULL) {
+    printf("memlimit below the heap succeeded\n");
+    syscall_exit(1);
+  }
+
+  printf("heap test ok\n");
+  syscall_exit(0);
+  return 0;
+}
@@ -94,14 +94,31 @@ int syscall_join(pid_t pid)
 }
 
 
-/* Create a new thread running in the same address space as the
- * caller. The thread is started at function 'func', and the thread
- * will end when 'func' returns. 'arg' is passed as an argument to
- * 'func'. Returns 0 on success or a negative value on error.
+/* The function and argument of syscall_fork. The child sees them in
+ * its copy of the caller's memory. */
+static void (*fork_func)(int);
+static int fork_arg;
+
+/* Start of a child created by syscall_fork. */
+static void fork_start(int unused)
+{
+  unused = unused;
+  fork_func(fork_arg);
+  syscall_exit(0);
+}
+
+/* Create a new process running in a copy of the address space of the
+ * caller (pages are shared copy-on-write). The process is started at
+ * function 'func', and the process will end when 'func' returns.
+ * 'arg' is passed as an argument to 'func'. Returns the process ID
+ * of the new process (which can be joined) or a negative value on
+ * error.
  */
 int syscall_fork(void (*func)(int), int arg)
 {
-  return (int)_syscall(SYSCALL_FORK, (uint32_t)func, (uint32_t)arg, 0);
+  fork_func = func;
+  fork_arg = arg;
+  return (int)_syscall(SYSCALL_FORK, (uint32_t)&fork_start, 0, 0);
 }
 
 
@@ -232,6 +249,46 @@ int syscall_file(const char* name, int index, char* buffer){
   return (int) _syscall(SYSCALL_FILE,(uint32_t) name,(uint32_t) index, (uint32_t) buffer);
 }
 
+/* Return the number of milliseconds elapsed since system startup. */
+uint32_t syscall_gettime(void)
+{
+  return _syscall(SYSCALL_GETTIME, 0, 0, 0);
+}
+
+/* Set the scheduling priority of the calling process to 'priority',
+ * 0 being the highest. Returns the previous priority or a negative
+ * value if 'priority' is out of range.
+ */
+int syscall_setpriority(int priority)
+{
+  return (int)_syscall(SYSCALL_SETPRIORITY, (uint32_t)priority, 0, 0);
+}
+
+/* Read the kernel statistics counter 'counter' of object 'index' in
+ * statistics class 'class' (see STAT_* in proc/syscall.h). Returns
+ * the counter value or -1 if there is no such counter.
+ */
+int syscall_stat(int class, int index, int counter)
+{
+  return (int)_syscall(SYSCALL_STAT, (uint32_t)class, (uint32_t)index,
+                       (uint32_t)counter);
+}
+
+/* Restrict the calling process to the CPUs whose bits (1 << CPU
+ * number) are set in 'mask'. Returns the previous mask, or 0 if
+ * 'mask' does not include any CPU of the system.
+ */
+uint32_t syscall_setaffinity(uint32_t mask)
+{
+  return _syscall(SYSCALL_SETAFFINITY, mask, 0, 0);
+}
+
+/* Sleep for at least 'msec' milliseconds. Returns 0. */
+int syscall_sleep(uint32_t msec)
+{
+  return (int)_syscall(SYSCALL_SLEEP, msec, 0, 0);
+}
+
 /* The following functions are not system calls, but convenient
    library functions inspired by POSIX and the C standard library. */
 
@@ -742,37 +799,116 @@ typedef struct free_block {
 
 static const size_t MIN_ALLOC_SIZE = sizeof(free_block_t);
 
+/* The heap is mapped by the kernel in pages */
+#define HEAP_PAGE_SIZE 4096
+
 free_block_t *free_list;
 
-byte heap[HEAP_SIZE];
+/* End of the heap, as set with syscall_memlimit */
+static byte *heap_end;
 
 /* Initialise the heap - malloc et al won't work unless this is called
-   first. */
+   first. The heap starts empty, after the data segment of the
+   program, and grows as memory is allocated. */
 void heap_init()
 {
-  free_list = (free_block_t*) heap;
-  free_list->size = HEAP_SIZE;
-  free_list->next = NULL;
+  free_list = NULL;
+  heap_end = syscall_memlimit(NULL);
 }
 
+/* Insert the given block into the free list, merging it with its
+   neighbours. Returns the (possibly merged) free block. */
+static free_block_t *heap_insert(free_block_t *block)
+{
+  free_block_t *cur_block;
+  free_block_t *prev_block;
+
+  /* Iterate through the free list, which is sorted by
+     increasing address, and insert the newly freed block at the
+     proper position. */
+  for (cur_block = free_list, prev_block = NULL; 
+       ;
+       prev_block = cur_block, cur_block = cur_block->next) {
+    if (cur_block > block || cur_block == NULL) {
+      /* Insert block here. */
+      if (prev_block == NULL) {
+        free_list = block;
+      } else {
+        prev_block->next = block;
+      }
+      block->next = cur_block;
+
+      if (prev_block != NULL &&
+          (size_t)((byte*)block - (byte*)prev_block) == prev_block->size) {
+        /* Merge with previous. */
+        prev_block->size += block->size;
+        prev_block->next = cur_block;
+        block = prev_block;
+      }
 
-/* Return a block of at least size bytes, or NULL if no such block 
-   can be found.  */
-void *malloc(size_t size) {
+      if (cur_block != NULL &&
+          (size_t)((byte*)cur_block - (byte*)block) == block->size) {
+        /* Merge with next. */
+        block->size += cur_block->size;
+        block->next = cur_block->next;
+      }
+      return block;
+    }
+  }
+}
+
+/* Grow the heap by at least size bytes (whole pages) and add the new
+   memory to the free list. Returns 0 if the kernel refuses. */
+static int heap_grow(size_t size)
+{
+  byte *start, *end;
   free_block_t *block;
-  free_block_t **prev_p; /* Previous link so we can remove an element */
-  if (size == 0) {
-    return NULL;
+
+  if (heap_end == NULL) { /* heap_init was not called */
+    heap_end = syscall_memlimit(NULL);
   }
+  start = (byte*)(((uint32_t)heap_end + 3) & ~3);
+  size = MAX(size, HEAP_GROW_SIZE);
+  end = (byte*)(((uint32_t)start + size + HEAP_PAGE_SIZE - 1)
+                & ~(HEAP_PAGE_SIZE - 1));
+  if (syscall_memlimit(end) != end) {
+    return 0;
+  }
+  heap_end = end;
 
-  /* Ensure block is big enough for bookkeeping. */
-  size=MAX(MIN_ALLOC_SIZE,size);
-  /* Word-align */
-  if (size % 4 != 0) {
-    size &= ~3;
-    size += 4;
+  block = (free_block_t*)start;
+  block->size = end - start;
+  heap_insert(block);
+  return 1;
+}
+
+/* Return whole pages at the end of the given free block to the
+   kernel, if the block is at the end of the heap and large enough. */
+static void heap_trim(free_block_t *block)
+{
+  byte *end;
+
+  if (((byte*)block)+block->size != heap_end) {
+    return;
   }
 
+  end = (byte*)(((uint32_t)block + MIN_ALLOC_SIZE + HEAP_PAGE_SIZE - 1)
+                & ~(HEAP_PAGE_SIZE - 1));
+  if (heap_end - end < HEAP_GROW_SIZE) {
+    return;
+  }
+  if (syscall_memlimit(end) == end) {
+    block->size = end - (byte*)block;
+    heap_end = end;
+  }
+}
+
+/* Return a block of at least size bytes (already aligned), or NULL if
+   the free list has no such block. */
+static void *heap_alloc(size_t size) {
+  free_block_t *block;
+  free_block_t **prev_p; /* Previous link so we can remove an element */
+
   /* Iterate through list of free blocks, using the first that is
      big enough for the request. */
   for (block = free_list, prev_p = &free_list;
@@ -799,46 +935,34 @@ void *malloc(size_t size) {
   return NULL;
 }
 
+/* Return a block of at least size bytes, or NULL if no such block 
+   can be found.  */
+void *malloc(size_t size) {
+  void *ptr;
+  if (size == 0) {
+    return NULL;
+  }
+
+  /* Ensure block is big enough for bookkeeping. */
+  size=MAX(MIN_ALLOC_SIZE,size);
+  /* Word-align */
+  if (size % 4 != 0) {
+    size &= ~3;
+    size += 4;
+  }
+
+  ptr = heap_alloc(size);
+  if (ptr == NULL && heap_grow(size+sizeof(size_t))) {
+    ptr = heap_alloc(size);
+  }
+  return ptr;
+}
+
 /* Return the block pointed to by ptr to the free pool. */
 void free(void *ptr)
 {
   if (ptr != NULL) { /* Freeing NULL is a no-op */
-    free_block_t *block = (free_block_t*)((byte*)ptr-sizeof(size_t));
-    free_block_t *cur_block;
-    free_block_t *prev_block;
-
-    /* Iterate through the free list, which is sorted by
-       increasing address, and insert the newly freed block at the
-       proper position. */
-    for (cur_block = free_list, prev_block = NULL; 
-         ;
-         prev_block = cur_block, cur_block = cur_block->next) {
-      if (cur_block > block || cur_block == NULL) {
-        /* Insert block here. */
-        if (prev_block == NULL) {
-          free_list = block;
-        } else {
-          prev_block->next = block;
-        }
-        block->next = cur_block;
-
-        if (prev_block != NULL &&
-            (size_t)((byte*)block - (byte*)prev_block) == prev_block->size) {
-          /* Merge with previous. */
-          prev_block->size += block->size;
-          prev_block->next = cur_block;
-          block = prev_block;
-        }
-
-        if (cur_block != NULL &&
-            (size_t)((byte*)cur_block - (byte*)block) == block->size) {
-          /* Merge with next. */
-          block->size += cur_block->size;
-          block->next = cur_block->next;
-        }
-        return;
-      }
-    }
+    heap_trim(heap_insert((free_block_t*)((byte*)ptr-sizeof(size_t))));
   }
 }
 
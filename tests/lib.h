@@ -91,6 +91,11 @@ int syscall_create(const char *filename, int size);
 int syscall_delete(const char *filename);
 int syscall_filecount(const char* name);
 int syscall_file(const char* name, int index, char* buffer);
+uint32_t syscall_gettime(void);
+int syscall_setpriority(int priority);
+int syscall_stat(int class, int index, int counter);
+uint32_t syscall_setaffinity(uint32_t mask);
+int syscall_sleep(uint32_t msec);
 
 int syscall_fork(void (*func)(int), int arg);
 void *syscall_memlimit(void *heap_end);
@@ -129,7 +134,9 @@ int snprintf(char *, int, const char *, ...);
 #endif
 
 #ifdef PROVIDE_HEAP_ALLOCATOR
-#define HEAP_SIZE 256 /* 256 byte heap - puny! */
+/* The heap grows through syscall_memlimit at least this much at a
+   time, and shrinks when this much is free at its end. */
+#define HEAP_GROW_SIZE 4096
 void heap_init(); /* Call this once before any other heap functions. */
 void *calloc(size_t nmemb, size_t size);
 void *malloc(size_t size);
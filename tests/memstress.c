@@ -0,0 +1,56 @@
+/*
+ * Memory pressure benchmark.
+ *
+ * Writes over working sets of growing size, from well below to above
+ * the physical memory of the machine (160 pages in the default
+ * yams.conf), and reports the time, page faults and swap traffic of
+ * each round. Boot with the swap disk of yams.conf enabled (swap=1),
+ * otherwise the program is killed once memory runs out.
+ */
+
+#include "proc/syscall.h"
+#include "tests/lib.h"
+
+#define PAGE_SIZE 4096
+#define MAX_PAGES 192
+#define STEP 32
+#define PASSES 4
+
+static char area[MAX_PAGES * PAGE_SIZE];
+
+int main(void)
+{
+  int pages, pass, i, faults, ins, outs, errors;
+  uint32_t start, elapsed;
+
+  printf("pages  time(ms)  pages/s  faults  page-ins  page-outs\n");
+  for (pages = STEP; pages <= MAX_PAGES; pages += STEP) {
+    faults = syscall_stat(STAT_VM, 0, STAT_VM_PAGE_FAULTS);
+    ins = syscall_stat(STAT_VM, 0, STAT_VM_PAGE_INS);
+    outs = syscall_stat(STAT_VM, 0, STAT_VM_PAGE_OUTS);
+    errors = 0;
+
+    start = syscall_gettime();
+    for (pass = 0; pass < PASSES; pass++) {
+      for (i = 0; i < pages; i++) {
+        if (pass > 0 && area[i * PAGE_SIZE] != (char)(i + pass - 1))
+          errors++;
+        area[i * PAGE_SIZE] = (char)(i + pass);
+      }
+    }
+    elapsed = syscall_gettime() - start;
+    if (elapsed == 0)
+      elapsed = 1;
+
+    printf("%5d  %8d  %7d  %6d  %8d  %9d%s\n", pages, elapsed,
+           pages * PASSES * 1000 / elapsed,
+           syscall_stat(STAT_VM, 0, STAT_VM_PAGE_FAULTS) - faults,
+           syscall_stat(STAT_VM, 0, STAT_VM_PAGE_INS) - ins,
+           syscall_stat(STAT_VM, 0, STAT_VM_PAGE_OUTS) - outs,
+           errors ? "  (data lost!)" : "");
+  }
+
+  printf("free pages: %d\n", syscall_stat(STAT_VM, 0, STAT_VM_FREE_PAGES));
+  syscall_halt();
+  return 0;
+}
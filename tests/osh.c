@@ -2,6 +2,7 @@
  * OSM shell.
  */
 
+#include "proc/syscall.h"
 #include "tests/lib.h"
 
 #define BUFFER_SIZE 100
@@ -25,6 +26,7 @@ int cmd_rm(int, char**);
 int cmd_cp(int, char**);
 int cmd_cmp(int, char**);
 int cmd_ls(int, char**);
+int cmd_vmstat(int, char**);
 
 cmd_t commands[] =
   { {"echo", cmd_echo, "print the arguments to the screen"},
@@ -35,7 +37,8 @@ cmd_t commands[] =
     {"rm", cmd_rm, "delete file given as argument"},
     {"cp", cmd_cp, "copy contents from file in arg1 to file in arg2"},
     {"cmp", cmd_cmp, "compare contents of arg1 and 2, return 0 if equal"},
-    {"ls", cmd_ls, "list all files on volume given in arg1"}
+    {"ls", cmd_ls, "list all files on volume given in arg1"},
+    {"vmstat", cmd_vmstat, "print memory counters, or the ones of running arg1"}
     
   };
 
@@ -329,3 +332,63 @@ int cmd_ls(int argc, char** argv) {
   }
   return 0;
 }
+
+/* Memory counters printed by vmstat, in column order */
+#define VM_COUNTERS 7
+static const int vm_counters[VM_COUNTERS] =
+  { STAT_VM_PAGE_FAULTS, STAT_VM_ZERO_FILLS, STAT_VM_COW_COPIES,
+    STAT_VM_TLB_REFILLS, STAT_VM_TLB_MODIFIED, STAT_VM_PAGE_INS,
+    STAT_VM_PAGE_OUTS };
+
+void print_vm_header(void) {
+  printf("         faults  zero-fill    cow   refills  modified"
+         "  page-ins  page-outs\n");
+}
+
+void print_vm_row(const char *name, int *count) {
+  printf("%6s %8d %10d %6d %9d %9d %9d %10d\n", name, count[0],
+         count[1], count[2], count[3], count[4], count[5], count[6]);
+}
+
+void read_vm_counters(int class, int index, int *count) {
+  int i;
+  for (i = 0; i < VM_COUNTERS; i++) {
+    count[i] = syscall_stat(class, index, vm_counters[i]);
+  }
+}
+
+int cmd_vmstat(int argc, char** argv) {
+  int before[VM_COUNTERS], after[VM_COUNTERS];
+  int cpus, cpu, i, ret;
+  char name[8];
+
+  if (argc >= 2) {
+    /* The program runs in its own process, so measure the whole
+       system around it */
+    read_vm_counters(STAT_VM, 0, before);
+    ret = run_program(argv[1]);
+    read_vm_counters(STAT_VM, 0, after);
+    for (i = 0; i < VM_COUNTERS; i++) {
+      after[i] -= before[i];
+    }
+    print_vm_header();
+    print_vm_row(argv[1], after);
+    return ret;
+  }
+
+  print_vm_header();
+  cpus = syscall_stat(STAT_SYSTEM, 0, STAT_SYSTEM_CPUS);
+  for (cpu = 0; cpu < cpus; cpu++) {
+    snprintf(name, sizeof(name), "cpu%d", cpu);
+    read_vm_counters(STAT_VM_CPU, cpu, after);
+    print_vm_row(name, after);
+  }
+  read_vm_counters(STAT_VM, 0, after);
+  print_vm_row("total", after);
+  read_vm_counters(STAT_VM_PROCESS, -1, after);
+  print_vm_row("osh", after);
+  printf("free pages: %d, ASID rollovers: %d\n",
+         syscall_stat(STAT_VM, 0, STAT_VM_FREE_PAGES),
+         syscall_stat(STAT_VM, 0, STAT_VM_ASID_ROLLOVERS));
+  return 0;
+}
@@ -0,0 +1,50 @@
+/*
+ * VFS read throughput benchmark.
+ *
+ * Runs 1 to MAX_WORKERS copies of the program reader at the same
+ * time, each reading the same file over and over through its own
+ * open file, and reports how long each round takes and how many of
+ * its disk blocks were found in the block cache. Boot YAMS with 4
+ * CPUs to see how concurrent readers scale.
+ */
+
+#include "proc/syscall.h"
+#include "tests/lib.h"
+
+#define VOLUME "[arkimedes]"
+#define MAX_WORKERS 4
+
+int main(void)
+{
+  pid_t workers[MAX_WORKERS];
+  uint32_t start, elapsed;
+  int n, i, failed, lookups, hits;
+
+  printf("readers  time(ms)  jobs/min  cache hits\n");
+  for (n = 1; n <= MAX_WORKERS; n++) {
+    failed = 0;
+    lookups = syscall_stat(STAT_BCACHE, 0, STAT_BCACHE_LOOKUPS);
+    hits = syscall_stat(STAT_BCACHE, 0, STAT_BCACHE_HITS);
+    start = syscall_gettime();
+    for (i = 0; i < n; i++) {
+      workers[i] = syscall_exec(VOLUME "reader");
+      if (workers[i] < 0) {
+        printf("readbench: could not start reader %d\n", i);
+        syscall_halt();
+      }
+    }
+    for (i = 0; i < n; i++)
+      failed |= syscall_join(workers[i]);
+    elapsed = syscall_gettime() - start;
+    if (elapsed == 0)
+      elapsed = 1;
+    lookups = syscall_stat(STAT_BCACHE, 0, STAT_BCACHE_LOOKUPS) - lookups;
+    hits = syscall_stat(STAT_BCACHE, 0, STAT_BCACHE_HITS) - hits;
+    printf("%7d  %8d  %8d  %9d%%%s\n", n, elapsed, n * 60000 / elapsed,
+           lookups > 0 ? hits * 100 / lookups : 0,
+           failed ? "  (a reader failed)" : "");
+  }
+
+  syscall_halt();
+  return 0;
+}
@@ -0,0 +1,32 @@
+/*
+ * File reading worker for the VFS read benchmark (readbench).
+ *
+ * Opens a file and reads it in small pieces from the beginning
+ * ROUNDS times, then exits.
+ */
+
+#include "tests/lib.h"
+
+#define FILENAME "[arkimedes]hw"
+#define ROUNDS 50
+#define CHUNK 64
+
+int main(void)
+{
+  char buffer[CHUNK];
+  int file, round, total, n;
+
+  file = syscall_open(FILENAME);
+  if (file < 0)
+    return 1;
+
+  total = 0;
+  for (round = 0; round < ROUNDS; round++) {
+    syscall_seek(file, 0);
+    while ((n = syscall_read(file, buffer, CHUNK)) > 0)
+      total += n;
+  }
+
+  syscall_close(file);
+  return total > 0 ? 0 : 1;
+}
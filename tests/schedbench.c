@@ -0,0 +1,41 @@
+/*
+ * Scheduler throughput benchmark.
+ *
+ * Runs 1 to MAX_WORKERS copies of the CPU-bound program spin at the
+ * same time and reports how long each round takes. Boot YAMS with 1
+ * to 4 CPUs (the cpus setting in yams.conf) and compare the jobs per
+ * minute columns to see how scheduling throughput scales.
+ */
+
+#include "tests/lib.h"
+
+#define VOLUME "[arkimedes]"
+#define MAX_WORKERS 4
+
+int main(void)
+{
+  pid_t workers[MAX_WORKERS];
+  uint32_t start, elapsed;
+  int n, i;
+
+  printf("workers  time(ms)  jobs/min\n");
+  for (n = 1; n <= MAX_WORKERS; n++) {
+    start = syscall_gettime();
+    for (i = 0; i < n; i++) {
+      workers[i] = syscall_exec(VOLUME "spin");
+      if (workers[i] < 0) {
+        printf("schedbench: could not start worker %d\n", i);
+        syscall_halt();
+      }
+    }
+    for (i = 0; i < n; i++)
+      syscall_join(workers[i]);
+    elapsed = syscall_gettime() - start;
+    if (elapsed == 0)
+      elapsed = 1;
+    printf("%7d  %8d  %8d\n", n, elapsed, n * 60000 / elapsed);
+  }
+
+  syscall_halt();
+  return 0;
+}
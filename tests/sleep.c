@@ -0,0 +1,27 @@
+/*
+ * Measure the accuracy of timed sleeps (syscall_sleep).
+ *
+ * Sleeps for a range of durations and prints how long each sleep
+ * actually took according to syscall_gettime.
+ */
+
+#include "tests/lib.h"
+
+static const uint32_t durations[] = { 1, 5, 10, 50, 100, 500, 1000 };
+
+int main(void)
+{
+  uint32_t start, elapsed;
+  unsigned int i;
+
+  printf("requested  measured  late\n");
+  for (i = 0; i < sizeof(durations) / sizeof(durations[0]); i++) {
+    start = syscall_gettime();
+    syscall_sleep(durations[i]);
+    elapsed = syscall_gettime() - start;
+    printf("%9d  %8d  %4d\n", durations[i], elapsed,
+           (int)(elapsed - durations[i]));
+  }
+
+  return 0;
+}
@@ -0,0 +1,22 @@
+/*
+ * CPU-bound worker for the scheduler benchmark (schedbench).
+ *
+ * Burns a fixed amount of CPU time without making any system calls
+ * and exits.
+ */
+
+#include "tests/lib.h"
+
+#define ROUNDS 200000
+
+int main(void)
+{
+  volatile uint32_t x = 1;
+  int i;
+
+  for (i = 0; i < ROUNDS; i++)
+    x = x * 1103515245 + 12345;
+
+  syscall_exit(x & 0x7f);
+  return 0;
+}
@@ -0,0 +1,47 @@
+/*
+ * TLB reach benchmark.
+ *
+ * Streams over an array which is larger than the TLB can map with 4k
+ * pages and reports the time and the TLB refills of each pass. Run it
+ * once with the "largepages" boot argument and once without to see
+ * the effect of large pages.
+ */
+
+#include "proc/syscall.h"
+#include "tests/lib.h"
+
+#define PAGE_SIZE 4096
+#define PAGES 64
+#define STRIDE 64
+#define PASSES 4
+
+static char area[PAGES * PAGE_SIZE];
+
+int main(void)
+{
+  int pass, i, refills, sum;
+  uint32_t start, elapsed;
+
+  /* The first pass faults the pages in */
+  sum = 0;
+  printf("pass  time(ms)  TLB refills\n");
+  for (pass = 0; pass <= PASSES; pass++) {
+    refills = syscall_stat(STAT_VM, 0, STAT_VM_TLB_REFILLS);
+
+    start = syscall_gettime();
+    for (i = 0; i < PAGES * PAGE_SIZE; i += STRIDE) {
+      sum += area[i];
+      area[i] = (char)(i + pass);
+    }
+    elapsed = syscall_gettime() - start;
+
+    printf("%4d  %8d  %11d%s\n", pass, elapsed,
+           syscall_stat(STAT_VM, 0, STAT_VM_TLB_REFILLS) - refills,
+           pass == 0 ? "  (page faults)" : "");
+  }
+
+  printf("page faults: %d (sum %d)\n",
+         syscall_stat(STAT_VM, 0, STAT_VM_PAGE_FAULTS), sum);
+  syscall_halt();
+  return 0;
+}
@@ -3,7 +3,7 @@
 # Set the module name
 MODULE := vm
 
-FILES := vm.c pagepool.c _tlb.S tlb.c
+FILES := vm.c pagepool.c _tlb.S tlb.c pagecache.c swap.c
 
 SRC += $(patsubst %, $(MODULE)/%, $(FILES))
 
@@ -0,0 +1,289 @@
+/*
+ * Page cache for shared executable pages
+ *
+ * Copyright (C) 2003 Juha Aatrokoski, Timo Lilja,
+ *   Leena Salmela, Teemu Takanen, Aleksi Virtanen.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "vm/pagecache.h"
+#include "vm/pagepool.h"
+#include "kernel/kmalloc.h"
+#include "kernel/spinlock.h"
+#include "kernel/interrupt.h"
+#include "kernel/assert.h"
+#include "kernel/config.h"
+#include "drivers/yams.h"
+
+/** @name Page cache
+ *
+ * The page cache holds read-only pages of executables, so that every
+ * process running the same executable maps the same physical pages
+ * for its code instead of reading them from disk again. A cached
+ * page is identified by the filesystem, the file id and the offset
+ * of the page in the file.
+ *
+ * The cache does not hold references of its own: a page stays in the
+ * cache as long as some page table maps it. Page tables map cached
+ * pages with the PTE_SHARED soft bit and release them with
+ * pagecache_put, which removes the page from the cache when the last
+ * mapping goes away.
+ *
+ * @{
+ */
+
+/* Number of hash buckets, a power of two */
+#define PAGECACHE_BUCKETS 64
+
+#define PAGECACHE_HASH(fs, fileid, offset) \
+    ((((uint32_t)(fs) >> 4) ^ (uint32_t)(fileid) ^ ((offset) >> 12)) \
+     & (PAGECACHE_BUCKETS - 1))
+
+typedef struct {
+    /* Key: filesystem, file id and page aligned offset in the file */
+    void *fs;
+    int fileid;
+    uint32_t offset;
+    /* The cached page, 0 if this entry is free */
+    uint32_t phys_page;
+    /* Next entry in the hash chain or free list (-1 = end) */
+    int next;
+} pagecache_entry_t;
+
+static pagecache_entry_t pagecache_entries[CONFIG_PAGECACHE_PAGES];
+
+/* Hash chains of used entries */
+static int pagecache_buckets[PAGECACHE_BUCKETS];
+
+/* Free entries */
+static int pagecache_free;
+
+/* Entry of each physical page, -1 if the page is not cached */
+static int16_t *pagecache_owner;
+
+/* Protects all of the above */
+static spinlock_t pagecache_slock;
+
+/**
+ * Initializes the page cache. Must be called before kmalloc is
+ * disabled.
+ */
+void pagecache_init(void)
+{
+    int i, pages;
+
+    for (i = 0; i < PAGECACHE_BUCKETS; i++)
+	pagecache_buckets[i] = -1;
+
+    for (i = 0; i < CONFIG_PAGECACHE_PAGES; i++) {
+	pagecache_entries[i].phys_page = 0;
+	pagecache_entries[i].next = i + 1;
+    }
+    pagecache_entries[CONFIG_PAGECACHE_PAGES - 1].next = -1;
+    pagecache_free = 0;
+
+    pages = kmalloc_get_numpages();
+    pagecache_owner = (int16_t *)kmalloc(pages * sizeof(int16_t));
+    KERNEL_ASSERT(pagecache_owner != NULL);
+    for (i = 0; i < pages; i++)
+	pagecache_owner[i] = -1;
+
+    spinlock_reset(&pagecache_slock);
+}
+
+/* Finds the entry for the given key. The lock must be held. */
+static int pagecache_find(void *fs, int fileid, uint32_t offset)
+{
+    int i;
+
+    i = pagecache_buckets[PAGECACHE_HASH(fs, fileid, offset)];
+    while (i >= 0) {
+	if (pagecache_entries[i].fs == fs
+	    && pagecache_entries[i].fileid == fileid
+	    && pagecache_entries[i].offset == offset)
+	    return i;
+	i = pagecache_entries[i].next;
+    }
+
+    return -1;
+}
+
+/* Unlinks the given entry from its hash chain and frees it. The lock
+ * must be held.
+ */
+static void pagecache_remove(int entry)
+{
+    pagecache_entry_t *e = &pagecache_entries[entry];
+    int *link;
+
+    link = &pagecache_buckets[PAGECACHE_HASH(e->fs, e->fileid, e->offset)];
+    while (*link != entry)
+	link = &pagecache_entries[*link].next;
+    *link = e->next;
+
+    pagecache_owner[e->phys_page / PAGE_SIZE] = -1;
+    e->phys_page = 0;
+    e->next = pagecache_free;
+    pagecache_free = entry;
+}
+
+/**
+ * Looks up a cached page and takes a reference to it.
+ *
+ * @param fs Filesystem of the file
+ * @param fileid Filesystem specific id of the file
+ * @param offset Page aligned offset in the file
+ *
+ * @return The physical page, or 0 if the page is not cached.
+ */
+uint32_t pagecache_get(void *fs, int fileid, uint32_t offset)
+{
+    interrupt_status_t intr_status;
+    uint32_t phys_page = 0;
+    int i;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&pagecache_slock);
+
+    i = pagecache_find(fs, fileid, offset);
+    if (i >= 0) {
+	phys_page = pagecache_entries[i].phys_page;
+	pagepool_ref_phys_page(phys_page);
+    }
+
+    spinlock_release(&pagecache_slock);
+    _interrupt_set_state(intr_status);
+
+    return phys_page;
+}
+
+/**
+ * Adds a page read from a file to the cache. If another thread has
+ * cached the same page meanwhile, the reference to the given page is
+ * dropped and the cached page is returned (referenced) instead. If
+ * the cache is full, the page is not cached.
+ *
+ * @param fs Filesystem of the file
+ * @param fileid Filesystem specific id of the file
+ * @param offset Page aligned offset in the file
+ * @param phys_page The page, holding one reference
+ *
+ * @return The page to map, holding one reference for the caller.
+ */
+uint32_t pagecache_insert(void *fs, int fileid, uint32_t offset,
+			  uint32_t phys_page)
+{
+    interrupt_status_t intr_status;
+    uint32_t cached = 0;
+    int i, hash;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&pagecache_slock);
+
+    i = pagecache_find(fs, fileid, offset);
+    if (i >= 0) {
+	cached = pagecache_entries[i].phys_page;
+	pagepool_ref_phys_page(cached);
+    } else if (pagecache_free >= 0) {
+	i = pagecache_free;
+	pagecache_free = pagecache_entries[i].next;
+
+	hash = PAGECACHE_HASH(fs, fileid, offset);
+	pagecache_entries[i].fs = fs;
+	pagecache_entries[i].fileid = fileid;
+	pagecache_entries[i].offset = offset;
+	pagecache_entries[i].phys_page = phys_page;
+	pagecache_entries[i].next = pagecache_buckets[hash];
+	pagecache_buckets[hash] = i;
+	pagecache_owner[phys_page / PAGE_SIZE] = i;
+    }
+
+    spinlock_release(&pagecache_slock);
+    _interrupt_set_state(intr_status);
+
+    if (cached != 0) {
+	pagepool_free_phys_page(phys_page);
+	return cached;
+    }
+
+    return phys_page;
+}
+
+/**
+ * Drops a reference to a page mapped from the cache. The page leaves
+ * the cache and is freed with the last reference.
+ *
+ * @param phys_page The page
+ */
+void pagecache_put(uint32_t phys_page)
+{
+    interrupt_status_t intr_status;
+    int i;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&pagecache_slock);
+
+    i = pagecache_owner[phys_page / PAGE_SIZE];
+    if (i >= 0 && pagepool_get_refcount(phys_page) == 1)
+	pagecache_remove(i);
+
+    /* Under the lock, so that nobody gets the page meanwhile */
+    pagepool_free_phys_page(phys_page);
+
+    spinlock_release(&pagecache_slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Removes all pages of a file from the cache, e.g. because the file
+ * was written to. Processes which map the pages keep them until they
+ * exit.
+ *
+ * @param fs Filesystem of the file
+ * @param fileid Filesystem specific id of the file
+ */
+void pagecache_invalidate(void *fs, int fileid)
+{
+    interrupt_status_t intr_status;
+    int i;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&pagecache_slock);
+
+    for (i = 0; i < CONFIG_PAGECACHE_PAGES; i++) {
+	if (pagecache_entries[i].phys_page != 0
+	    && pagecache_entries[i].fs == fs
+	    && pagecache_entries[i].fileid == fileid)
+	    pagecache_remove(i);
+    }
+
+    spinlock_release(&pagecache_slock);
+    _interrupt_set_state(intr_status);
+}
+
+/** @} */
@@ -35,27 +35,80 @@
  */
 
 #include "vm/pagepool.h"
-#include "lib/bitmap.h"
 #include "kernel/kmalloc.h"
 #include "kernel/spinlock.h"
 #include "kernel/interrupt.h"
 #include "kernel/assert.h"
+#include "kernel/config.h"
 
 /** @name Page pool
  *
  * Functions and data structures for handling physical page reservation.
  *
+ * Free pages are managed with a buddy allocator. A free block of
+ * order k is 2^k physically contiguous pages, aligned to its size.
+ * There is a free list of blocks for each order. An allocation takes
+ * a block from the smallest order which has one and splits it in
+ * halves until it has the requested size; freeing merges the block
+ * with its buddy (the other half of the block of the next order) as
+ * long as the buddy is free. Both take O(PAGEPOOL_MAX_ORDER) steps.
+ *
+ * Blocks of up to PAGEPOOL_CPU_MAX_ORDER go through a magazine of
+ * free blocks of their order on each CPU, which is refilled from and
+ * drained to the buddy lists PAGEPOOL_BATCH blocks at a time. Besides
+ * single pages this covers the network frames (see
+ * network_get_frame_order). The magazines of a CPU have locks of
+ * their own, so most allocations do not touch the global pool lock.
+ * When the pool runs dry, the blocks in the magazines of all CPUs are
+ * returned to it before giving up.
+ *
+ * Reference counts are updated atomically, without locks.
+ *
  * @{
  */
 
-/* Bitmap field of physical pages. Length is number of physical pages
-   rounded up to a word boundary */
-static bitmap_t *pagepool_free_pages;
+/* Blocks moved between a magazine and the buddy lists at a time */
+#define PAGEPOOL_BATCH ((CONFIG_PAGEPOOL_CPU_PAGES + 1) / 2)
+
+/* Largest order of the blocks cached by the CPUs */
+#define PAGEPOOL_CPU_MAX_ORDER 1
+
+/* Free blocks of one order cached by one CPU */
+typedef struct {
+    /* Protects this magazine, taken before pagepool_slock */
+    spinlock_t slock;
+    /* Number of blocks in the magazine */
+    int count;
+    /* First page numbers of the cached blocks */
+    int pages[CONFIG_PAGEPOOL_CPU_PAGES > 0 ? CONFIG_PAGEPOOL_CPU_PAGES : 1];
+    /* Allocations and frees served without the global lock */
+    uint32_t hits;
+} pagepool_magazine_t;
+
+static pagepool_magazine_t
+pagepool_magazines[CONFIG_MAX_CPUS][PAGEPOOL_CPU_MAX_ORDER + 1];
+
+/* Number of mappings of each physical page, a reserved page is freed
+   when its count drops to zero. All pages of a multi-page block have
+   a count of one while the block is reserved. */
+static int *pagepool_refcount;
+
+/* Order of the free block starting at each page, -1 if no free block
+   starts at the page */
+static int8_t *pagepool_free_order;
+
+/* Links of the free lists, indexed by the first page of a free block
+   (-1 = end of list) */
+static int *pagepool_next;
+static int *pagepool_prev;
+
+/* First free block of each order, -1 if none */
+static int pagepool_free_list[PAGEPOOL_MAX_ORDER + 1];
 
 /* Number of physical pages */
 static int pagepool_num_pages;
 
-/* Number of free physical pages */
+/* Number of free physical pages in the buddy lists */
 static int pagepool_num_free_pages;
 
 /* Number of last staticly reserved page. This is needed to ensure
@@ -63,35 +116,236 @@ static int pagepool_num_free_pages;
    purpose).  */
 static int pagepool_static_end;
 
-/* Spinlock to handle synchronous access to pagepool_free_pages */
+/* Spinlock to handle synchronous access to the free lists */
 static spinlock_t pagepool_slock;
 
+/* Number of times pagepool_slock has been acquired */
+static uint32_t pagepool_lock_count;
+
+/* Acquires the global pool lock. Interrupts must be disabled. */
+static void pagepool_lock(void)
+{
+    spinlock_acquire(&pagepool_slock);
+    pagepool_lock_count++;
+}
+
+/* Adds the free block starting at page i to the free list of the
+ * given order. */
+static void pagepool_push(int i, int order)
+{
+    pagepool_free_order[i] = order;
+    pagepool_prev[i] = -1;
+    pagepool_next[i] = pagepool_free_list[order];
+    if (pagepool_next[i] >= 0)
+	pagepool_prev[pagepool_next[i]] = i;
+    pagepool_free_list[order] = i;
+}
+
+/* Removes the free block starting at page i from its free list. */
+static void pagepool_unlink(int i)
+{
+    if (pagepool_prev[i] >= 0)
+	pagepool_next[pagepool_prev[i]] = pagepool_next[i];
+    else
+	pagepool_free_list[(int)pagepool_free_order[i]] = pagepool_next[i];
+
+    if (pagepool_next[i] >= 0)
+	pagepool_prev[pagepool_next[i]] = pagepool_prev[i];
+
+    pagepool_free_order[i] = -1;
+}
+
+/* Takes a free block of the given order from the buddy lists.
+ * Returns its first page, or -1 if there is none. The lock must be
+ * held. */
+static int pagepool_take(int order)
+{
+    int i, k;
+
+    for (k = order; k <= PAGEPOOL_MAX_ORDER; k++) {
+	if (pagepool_free_list[k] >= 0)
+	    break;
+    }
+    if (k > PAGEPOOL_MAX_ORDER)
+	return -1;
+
+    i = pagepool_free_list[k];
+    pagepool_unlink(i);
+
+    /* Split the block, the upper halves stay free */
+    while (k > order) {
+	k--;
+	pagepool_push(i + (1 << k), k);
+    }
+
+    pagepool_num_free_pages -= 1 << order;
+    return i;
+}
+
+/* Returns the block of the given order starting at page i to the
+ * buddy lists, merging it with its free buddies. The lock must be
+ * held. */
+static void pagepool_give(int i, int order)
+{
+    int buddy;
+
+    pagepool_num_free_pages += 1 << order;
+
+    while (order < PAGEPOOL_MAX_ORDER) {
+	buddy = i ^ (1 << order);
+	if (buddy >= pagepool_num_pages
+	    || pagepool_free_order[buddy] != order)
+	    break;
+
+	pagepool_unlink(buddy);
+	i &= ~(1 << order);
+	order++;
+    }
+
+    pagepool_push(i, order);
+}
+
+/* Returns the blocks cached by all CPUs to the buddy lists. Called
+ * when the buddy lists run dry. Interrupts must be disabled and no
+ * pagepool lock may be held. */
+static void pagepool_drain_all(void)
+{
+    pagepool_magazine_t *mag;
+    int cpu, order;
+
+    for (cpu = 0; cpu < CONFIG_MAX_CPUS; cpu++) {
+	for (order = 0; order <= PAGEPOOL_CPU_MAX_ORDER; order++) {
+	    mag = &pagepool_magazines[cpu][order];
+	    spinlock_acquire(&mag->slock);
+	    if (mag->count > 0) {
+		pagepool_lock();
+		while (mag->count > 0)
+		    pagepool_give(mag->pages[--mag->count], order);
+		spinlock_release(&pagepool_slock);
+	    }
+	    spinlock_release(&mag->slock);
+	}
+    }
+}
+
+/* Takes a free block of the given order from the magazine of this
+ * CPU, refilling the magazine from the buddy lists if it is empty.
+ * Returns the first page of the block, -1 if the order is not cached
+ * or the buddy lists are empty. Interrupts must be disabled. */
+static int pagepool_magazine_get(int order)
+{
+    pagepool_magazine_t *mag;
+    int i;
+
+    if (CONFIG_PAGEPOOL_CPU_PAGES == 0 || order > PAGEPOOL_CPU_MAX_ORDER)
+	return -1;
+
+    mag = &pagepool_magazines[_interrupt_getcpu()][order];
+    spinlock_acquire(&mag->slock);
+
+    if (mag->count > 0) {
+	mag->hits++;
+    } else {
+	pagepool_lock();
+	while (mag->count < PAGEPOOL_BATCH) {
+	    i = pagepool_take(order);
+	    if (i < 0)
+		break;
+	    mag->pages[mag->count++] = i;
+	}
+	spinlock_release(&pagepool_slock);
+    }
+
+    i = (mag->count > 0) ? mag->pages[--mag->count] : -1;
+
+    spinlock_release(&mag->slock);
+
+    return i;
+}
+
+/* Puts a free block of the given order into the magazine of this
+ * CPU, draining the magazine to the buddy lists if it is full.
+ * Returns 0 if the order is not cached. Interrupts must be
+ * disabled. */
+static int pagepool_magazine_put(int i, int order)
+{
+    pagepool_magazine_t *mag;
+
+    if (CONFIG_PAGEPOOL_CPU_PAGES == 0 || order > PAGEPOOL_CPU_MAX_ORDER)
+	return 0;
+
+    mag = &pagepool_magazines[_interrupt_getcpu()][order];
+    spinlock_acquire(&mag->slock);
+
+    if (mag->count < CONFIG_PAGEPOOL_CPU_PAGES) {
+	mag->hits++;
+    } else {
+	pagepool_lock();
+	while (mag->count > CONFIG_PAGEPOOL_CPU_PAGES - PAGEPOOL_BATCH)
+	    pagepool_give(mag->pages[--mag->count], order);
+	spinlock_release(&pagepool_slock);
+    }
+
+    mag->pages[mag->count++] = i;
+
+    spinlock_release(&mag->slock);
+
+    return 1;
+}
+
 /**
  * Pagepool initialization. Finds out number of physical pages and
- * number of staticly reserved physical pages. Marks reserved pages
- * reserved in pagepool_free_pages.
+ * number of staticly reserved physical pages, and puts the rest of
+ * the pages on the free lists.
  */
 void pagepool_init(void)
 {
     int num_res_pages;
-    int i;
+    int i, order, cpu;
 
     pagepool_num_pages = kmalloc_get_numpages();
 
-    pagepool_free_pages = 
-        (uint32_t *)kmalloc(bitmap_sizeof(pagepool_num_pages));
-    bitmap_init(pagepool_free_pages, pagepool_num_pages);
+    pagepool_refcount = (int *)kmalloc(pagepool_num_pages * sizeof(int));
+    memoryset(pagepool_refcount, 0, pagepool_num_pages * sizeof(int));
+
+    pagepool_free_order = (int8_t *)kmalloc(pagepool_num_pages);
+    memoryset(pagepool_free_order, -1, pagepool_num_pages);
+
+    pagepool_next = (int *)kmalloc(pagepool_num_pages * sizeof(int));
+    pagepool_prev = (int *)kmalloc(pagepool_num_pages * sizeof(int));
+
+    for (order = 0; order <= PAGEPOOL_MAX_ORDER; order++)
+	pagepool_free_list[order] = -1;
+
+    for (cpu = 0; cpu < CONFIG_MAX_CPUS; cpu++) {
+	for (order = 0; order <= PAGEPOOL_CPU_MAX_ORDER; order++) {
+	    spinlock_reset(&pagepool_magazines[cpu][order].slock);
+	    pagepool_magazines[cpu][order].count = 0;
+	    pagepool_magazines[cpu][order].hits = 0;
+	}
+    }
 
     /* Note that number of reserved pages must be get after we have 
-       (staticly) reserved memory for bitmap. */
+       (staticly) reserved memory for the tables. */
     num_res_pages = kmalloc_get_reserved_pages();
-    pagepool_num_free_pages = pagepool_num_pages - num_res_pages;
+    pagepool_num_free_pages = 0;
     pagepool_static_end = num_res_pages;
 
-    for (i = 0; i < num_res_pages; i++)
-        bitmap_set(pagepool_free_pages, i, 1);
+    /* Cover the free pages with the largest aligned blocks */
+    i = num_res_pages;
+    while (i < pagepool_num_pages) {
+	order = 0;
+	while (order < PAGEPOOL_MAX_ORDER
+	       && (i & ((2 << order) - 1)) == 0
+	       && i + (2 << order) <= pagepool_num_pages)
+	    order++;
+
+	pagepool_give(i, order);
+	i += 1 << order;
+    }
 
     spinlock_reset(&pagepool_slock);
+    pagepool_lock_count = 0;
 
     kprintf("Pagepool: Found %d pages of size %d\n", pagepool_num_pages,
             PAGE_SIZE);
@@ -101,38 +355,186 @@ void pagepool_init(void)
 }
 
 /**
- * Finds first free physical page and marks it reserved.  
+ * Reserves 2^order physically contiguous pages. The block is aligned
+ * to its size, and each of its pages has one reference. Small blocks
+ * are taken from the magazine of the current CPU.
+ *
+ * @param order Base 2 logarithm of the number of pages, at most
+ * PAGEPOOL_MAX_ORDER.
  *
- * @return Address of first free physical page, zero if no free pages
- * are available.
+ * @return Physical address of the first page, zero if there is no
+ * free block large enough.
  */
-uint32_t pagepool_get_phys_page(void)
+uint32_t pagepool_get_phys_pages(int order)
 {
     interrupt_status_t intr_status;
-    int i;
+    int i, k;
+
+    KERNEL_ASSERT(order >= 0 && order <= PAGEPOOL_MAX_ORDER);
 
     intr_status = _interrupt_disable();
-    spinlock_acquire(&pagepool_slock);
-    
-    if (pagepool_num_free_pages > 0) {
-	i = bitmap_findnset(pagepool_free_pages,pagepool_num_pages);
-	pagepool_num_free_pages--;
-
-        /* There should have been a free page. Check that the pagepool
-           internal variables are in synch. */
-	KERNEL_ASSERT(i >= 0 && pagepool_num_free_pages >= 0);
-    } else {
-        i = 0;
+
+    i = pagepool_magazine_get(order);
+
+    if (i < 0) {
+	pagepool_lock();
+	i = pagepool_take(order);
+	spinlock_release(&pagepool_slock);
+    }
+
+    if (i < 0) {
+	/* The missing pages may be cached by the CPUs */
+	pagepool_drain_all();
+	pagepool_lock();
+	i = pagepool_take(order);
+	spinlock_release(&pagepool_slock);
     }
 
-    spinlock_release(&pagepool_slock);
     _interrupt_set_state(intr_status);
+
+    if (i < 0)
+	return 0;
+
+    for (k = 0; k < (1 << order); k++) {
+	KERNEL_ASSERT(pagepool_refcount[i + k] == 0);
+	pagepool_refcount[i + k] = 1;
+    }
+
     return i*PAGE_SIZE;
 }
 
 /**
- * Frees given page. Given page should be reserved, but not staticly
- * reserved.
+ * Frees a block reserved with pagepool_get_phys_pages. The pages must
+ * not have other references.
+ *
+ * @param phys_addr Physical address of the first page of the block.
+ *
+ * @param order The order given to pagepool_get_phys_pages.
+ */
+void pagepool_free_phys_pages(uint32_t phys_addr, int order)
+{
+    interrupt_status_t intr_status;
+    int i, k;
+
+    i = phys_addr / PAGE_SIZE;
+
+    KERNEL_ASSERT(order >= 0 && order <= PAGEPOOL_MAX_ORDER);
+    KERNEL_ASSERT((i & ((1 << order) - 1)) == 0);
+    KERNEL_ASSERT(i >= pagepool_static_end
+		  && i + (1 << order) <= pagepool_num_pages);
+
+    for (k = 0; k < (1 << order); k++) {
+	KERNEL_ASSERT(pagepool_refcount[i + k] == 1);
+	pagepool_refcount[i + k] = 0;
+    }
+
+    intr_status = _interrupt_disable();
+
+    if (!pagepool_magazine_put(i, order)) {
+	pagepool_lock();
+	pagepool_give(i, order);
+	spinlock_release(&pagepool_slock);
+    }
+
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Reserves one free physical page. The page has one reference. The
+ * page is taken from the magazine of the current CPU, which is
+ * refilled from the pool when it is empty.
+ *
+ * @return Address of the page, zero if no free pages are available.
+ */
+uint32_t pagepool_get_phys_page(void)
+{
+    return pagepool_get_phys_pages(0);
+}
+
+/* Adds delta to the reference count of page i, returns the new
+ * count. */
+static int pagepool_refcount_add(int i, int delta)
+{
+    int old;
+
+    do {
+	old = pagepool_refcount[i];
+	KERNEL_ASSERT(old > 0);
+    } while (_atomic_cas(&pagepool_refcount[i], old, old + delta) != old);
+
+    return old + delta;
+}
+
+/**
+ * Adds a reference to the given reserved page, e.g. when the page is
+ * shared by another mapping.
+ *
+ * @param phys_addr Page to reference.
+ */
+void pagepool_ref_phys_page(uint32_t phys_addr)
+{
+    int i;
+
+    i = phys_addr / PAGE_SIZE;
+    KERNEL_ASSERT(i >= pagepool_static_end && i < pagepool_num_pages);
+
+    pagepool_refcount_add(i, 1);
+}
+
+/**
+ * Returns the number of references to the given page.
+ *
+ * @param phys_addr The page.
+ *
+ * @return Number of references, 0 for free and staticly reserved
+ * pages.
+ */
+int pagepool_get_refcount(uint32_t phys_addr)
+{
+    return pagepool_refcount[phys_addr / PAGE_SIZE];
+}
+
+/**
+ * Returns the number of free physical pages, including the pages
+ * cached by the CPUs.
+ *
+ * @return Number of free pages.
+ */
+int pagepool_get_free_pages(void)
+{
+    int cpu, order, free;
+
+    free = pagepool_num_free_pages;
+    for (cpu = 0; cpu < CONFIG_MAX_CPUS; cpu++) {
+	for (order = 0; order <= PAGEPOOL_CPU_MAX_ORDER; order++)
+	    free += pagepool_magazines[cpu][order].count << order;
+    }
+
+    return free;
+}
+
+/**
+ * Fills in the lock statistics of the page pool.
+ *
+ * @param stats Structure to fill
+ */
+void pagepool_get_stats(pagepool_stats_t *stats)
+{
+    int cpu, order;
+
+    stats->lock_acquisitions = pagepool_lock_count;
+    stats->magazine_hits = 0;
+    for (cpu = 0; cpu < CONFIG_MAX_CPUS; cpu++) {
+	for (order = 0; order <= PAGEPOOL_CPU_MAX_ORDER; order++)
+	    stats->magazine_hits += pagepool_magazines[cpu][order].hits;
+    }
+}
+
+/**
+ * Drops a reference to the given page, and frees the page when it was
+ * the last one. Freed pages go to the magazine of the current CPU,
+ * which is drained to the pool when it is full. Given page should be
+ * reserved, but not staticly reserved.
  *
  * @param phys_addr Page to be freed.
  */
@@ -144,22 +546,22 @@ void pagepool_free_phys_page(uint32_t phys_addr)
     i = phys_addr / PAGE_SIZE;
 
     /* A page allocated by kmalloc should not be freed. */
-    KERNEL_ASSERT(i >= pagepool_static_end);
+    KERNEL_ASSERT(i >= pagepool_static_end && i < pagepool_num_pages);
+
+    if (pagepool_refcount_add(i, -1) > 0)
+	return;
 
     intr_status = _interrupt_disable();
-    spinlock_acquire(&pagepool_slock);
-    
-    /* Check that the page was reserved. */
-    KERNEL_ASSERT(bitmap_get(pagepool_free_pages, i) == 1);
 
-    bitmap_set(pagepool_free_pages, i, 0);
-    pagepool_num_free_pages++;
+    if (!pagepool_magazine_put(i, 0)) {
+	pagepool_lock();
+	pagepool_give(i, 0);
+	spinlock_release(&pagepool_slock);
+    }
 
-    spinlock_release(&pagepool_slock);
     _interrupt_set_state(intr_status);
 }
 
 
 
 /** @} */
-
@@ -42,9 +42,26 @@
 #define ADDR_PHYS_TO_KERNEL(addr) ((addr) | 0x80000000)
 #define ADDR_KERNEL_TO_PHYS(addr) ((addr) & 0x7fffffff)
 
+/* Lock statistics of the page pool */
+typedef struct {
+    /* times the global pool lock was taken */
+    uint32_t lock_acquisitions;
+    /* allocations and frees of small blocks served by the CPU
+       caches */
+    uint32_t magazine_hits;
+} pagepool_stats_t;
+
+/* Largest block of contiguous pages (2^order pages, 4MB) */
+#define PAGEPOOL_MAX_ORDER 10
 
 void pagepool_init(void);
 uint32_t pagepool_get_phys_page(void);
 void pagepool_free_phys_page(uint32_t phys_addr);
+uint32_t pagepool_get_phys_pages(int order);
+void pagepool_free_phys_pages(uint32_t phys_addr, int order);
+void pagepool_ref_phys_page(uint32_t phys_addr);
+int pagepool_get_refcount(uint32_t phys_addr);
+int pagepool_get_free_pages(void);
+void pagepool_get_stats(pagepool_stats_t *stats);
 
 #endif /* BUENOS_VM_PAGEPOOL_H */
@@ -39,19 +39,96 @@
 
 #include "lib/libc.h"
 #include "vm/tlb.h"
+#include "kernel/config.h"
 
-/* Number of mapping entries in one pagetable. This is the number
-   of entries that fits on a single hardware memory page (4k). */
-#define PAGETABLE_ENTRIES 340
+/* Page table entry of one virtual page. The low 26 bits match the
+   CP0 EntryLo registers (and the corresponding fields of
+   tlb_entry_t), the top bits are free for the VM system. */
+typedef struct {
+    /* Bits used by the VM system, ignored by the hardware. */
+    unsigned int soft:6     __attribute__ ((packed));
+    /* Physical page number */
+    unsigned int PFN:20     __attribute__ ((packed));
+    /* Cache settings. Not used. */
+    unsigned int C:3        __attribute__ ((packed));
+    /* Dirty (write enable) bit */
+    unsigned int D:1        __attribute__ ((packed));
+    /* Valid bit */
+    unsigned int V:1        __attribute__ ((packed));
+    /* Global bit. Not used. */
+    unsigned int G:1        __attribute__ ((packed));
+} pte_t;
+
+/* Bits in the soft field of pte_t */
+/* Writable page shared copy-on-write, D is cleared while shared */
+#define PTE_COW 0x01
+/* Read-only page from the page cache, released with pagecache_put */
+#define PTE_SHARED 0x02
+/* Page loaded into a TLB since the swap clock last passed it */
+#define PTE_REF 0x04
+/* Page is on the swap disk, PFN holds the swap slot, V is clear */
+#define PTE_SWAPPED 0x08
+/* Page is being written to the swap disk, V is clear */
+#define PTE_EVICTING 0x10
+/* Part of a large page, see vm_map_large */
+#define PTE_LARGE 0x20
+
+/* Large pages. A TLB entry maps an even/odd pair of them, so the
+   pairs are aligned to twice the large page size. */
+#define VM_LARGE_PAGE_SIZE (PAGE_SIZE << CONFIG_VM_LARGE_PAGE_ORDER)
+#define VM_LARGE_PAGE_PAGES (1 << CONFIG_VM_LARGE_PAGE_ORDER)
+/* PageMask register value for the TLB entries of large pages */
+#define VM_LARGE_PAGE_MASK ((VM_LARGE_PAGE_PAGES - 1) << 13)
+
+/* A page table entry as a word, for atomic updates with _atomic_cas */
+typedef union {
+    pte_t pte;
+    int word;
+} pte_word_t;
+
+/* The page table has two levels. The directory has an entry for
+   each 4MB region of the user address space (the lower 2GB). An
+   entry points to a leaf table of the PTEs of the 1024 pages in the
+   region, or is NULL if nothing is mapped in the region. A leaf
+   table takes one physical page. */
+#define PAGETABLE_DIR_ENTRIES  512
+#define PAGETABLE_LEAF_ENTRIES 1024
+
+#define PAGETABLE_DIR_INDEX(vaddr)  ((vaddr) >> 22)
+#define PAGETABLE_LEAF_INDEX(vaddr) (((vaddr) >> 12) & 0x3ff)
+
+/* Counters of memory events, kept for each CPU and for each page
+   table (that is, each process), see vm_stat_inc. */
+#define VM_STAT_PAGE_FAULTS    0 /* faults served by loading or swapping
+                                    in a page */
+#define VM_STAT_PAGE_INS       1 /* pages read from the swap disk */
+#define VM_STAT_PAGE_OUTS      2 /* pages written to the swap disk */
+#define VM_STAT_TLB_REFILLS    3 /* TLB misses served from page tables */
+#define VM_STAT_TLB_MODIFIED   4 /* TLB modified exceptions */
+#define VM_STAT_ZERO_FILLS     5 /* pages loaded without file data */
+#define VM_STAT_COW_COPIES     6 /* copy-on-write pages copied */
+#define VM_STAT_ASID_ROLLOVERS 7 /* times the ASIDs ran out */
+#define VM_STAT_COUNTERS       8
+
+typedef struct {
+    uint32_t count[VM_STAT_COUNTERS];
+} vm_stats_t;
 
 /* A pagetable. This structure fits on one physical page (4k). */
 typedef struct pagetable_struct_t{
-    /* Address space identifier. We use Thread Ids in Buenos. */
+    /* Address space identifier, valid only if asid_generation is
+       current. Assigned by tlb_switch. */
     uint32_t ASID;
-    /* Number of valid consecutive mappings in this pagetable. */
+    uint32_t asid_generation;
+    /* Number of mapped pages in this pagetable. */
     uint32_t valid_count;
-    /* Actual virtual memory mapping entries*/
-    tlb_entry_t entries[PAGETABLE_ENTRIES];
+    /* CPUs whose TLB may hold mappings of this pagetable (bit N for
+       CPU N). Set by tlb_switch, used to direct TLB shootdowns. */
+    volatile uint32_t cpumask;
+    /* Memory events of this address space */
+    vm_stats_t stats;
+    /* Leaf tables, NULL for regions without mappings */
+    pte_t *directory[PAGETABLE_DIR_ENTRIES];
 } pagetable_t;
 
 #endif /* BUENOS_VM_PAGETABLE_H */
@@ -0,0 +1,572 @@
+/*
+ * Swapping of user pages
+ *
+ * Copyright (C) 2003 Juha Aatrokoski, Timo Lilja,
+ *   Leena Salmela, Teemu Takanen, Aleksi Virtanen.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "vm/swap.h"
+#include "vm/vm.h"
+#include "vm/pagepool.h"
+#include "kernel/kmalloc.h"
+#include "kernel/spinlock.h"
+#include "kernel/interrupt.h"
+#include "kernel/mutex.h"
+#include "kernel/assert.h"
+#include "drivers/device.h"
+#include "drivers/bootargs.h"
+#include "drivers/yams.h"
+#include "lib/bitmap.h"
+#include "lib/libc.h"
+
+/** @name Swapping
+ *
+ * When the page pool runs out of pages, user pages are written to a
+ * swap disk and their frames are reused. The swap disk is a YAMS disk
+ * of its own, selected with the boot argument "swap" (the number of
+ * the disk device, see vfs_mount_all which skips it). Without the
+ * boot argument there is no swapping and running out of memory kills
+ * the process as before.
+ *
+ * The victim is selected with the clock (second chance) algorithm
+ * over the physical frames. The MIPS TLB has no reference bits, so
+ * they are emulated: vm_get_tlb_entry sets PTE_REF whenever a page is
+ * loaded into a TLB, and the clock clears it. Once the clock has
+ * cleared reference bits it flushes the TLBs, so that pages still in
+ * use fault again and get their bit set.
+ *
+ * Only private pages are swapped: frames are tracked (swap_track) by
+ * vm_map for the pages mapped in exactly one page table. Pages shared
+ * copy-on-write or through the page cache are not tracked.
+ *
+ * A swapped out page keeps its PTE with V clear, PTE_SWAPPED set and
+ * the swap slot in PFN. It is read back by swap_in from the user page
+ * fault handler. While a page is being written out its PTE has
+ * PTE_EVICTING set instead, and a fault on it waits for the write to
+ * finish.
+ *
+ * The frames of the buffers of a system call are pinned (swap_pin)
+ * while the kernel uses them, and the clock skips pinned frames. The
+ * rest of the address space can still be swapped out, also while the
+ * process waits in the system call.
+ *
+ * Eviction and the other users of the swap slots and swapped PTEs
+ * (swap_in, vm_destroy_pagetable, vm_copy_pagetable and
+ * vm_unmap_range) are serialized with a mutex, so they must be
+ * called in thread context. The frame table is protected by a
+ * spinlock, so that pages can be tracked without the mutex (vm_map,
+ * vm_copy_on_write).
+ *
+ * @{
+ */
+
+/* Owner of a physical frame */
+typedef struct {
+    /* Page table mapping the frame, NULL if the frame is not tracked */
+    pagetable_t *pagetable;
+    /* Virtual address of the mapping */
+    uint32_t vaddr;
+    /* Number of system calls using the frame, it is not evicted while
+       this is non-zero (see swap_pin) */
+    int pins;
+} swap_frame_t;
+
+/* Frame table, indexed by physical page number */
+static swap_frame_t *swap_frames;
+static int swap_num_frames;
+
+/* Next frame to examine */
+static int swap_clock_hand;
+
+/* Protects the frame table and the clock hand */
+static spinlock_t swap_frame_slock;
+
+/* The swap disk, NULL if swapping is disabled */
+static gbd_t *swap_disk;
+
+/* Disk blocks per page and the number of page slots on the disk */
+static uint32_t swap_blocks_per_page;
+static int swap_num_slots;
+
+/* Used slots */
+static bitmap_t *swap_slots;
+
+/* Serializes eviction, swap_in and the use of the slots */
+static mutex_t swap_mutex;
+
+/**
+ * Initializes swapping. Opens the swap disk given in the boot
+ * arguments. Must be called after the devices have been initialized
+ * and before kmalloc is disabled.
+ */
+void swap_init(void)
+{
+    char *arg;
+    device_t *dev;
+    uint32_t block_size;
+
+    swap_num_frames = kmalloc_get_numpages();
+    swap_frames = (swap_frame_t *)
+	kmalloc(swap_num_frames * sizeof(swap_frame_t));
+    memoryset(swap_frames, 0, swap_num_frames * sizeof(swap_frame_t));
+    swap_clock_hand = 0;
+    spinlock_reset(&swap_frame_slock);
+    mutex_init(&swap_mutex);
+
+    swap_disk = NULL;
+
+    arg = bootargs_get("swap");
+    if (arg == NULL)
+	return;
+
+    dev = device_get(YAMS_TYPECODE_DISK, atoi(arg));
+    if (dev == NULL || dev->generic_device == NULL) {
+	kprintf("Swap: no disk %s, swapping disabled\n", arg);
+	return;
+    }
+    swap_disk = (gbd_t *) dev->generic_device;
+
+    block_size = swap_disk->block_size(swap_disk);
+    KERNEL_ASSERT(block_size > 0 && PAGE_SIZE % block_size == 0);
+
+    swap_blocks_per_page = PAGE_SIZE / block_size;
+    swap_num_slots = swap_disk->total_blocks(swap_disk)
+	/ swap_blocks_per_page;
+
+    swap_slots = (bitmap_t *) kmalloc(bitmap_sizeof(swap_num_slots));
+    bitmap_init(swap_slots, swap_num_slots);
+
+    kprintf("Swap: %d pages on disk %s\n", swap_num_slots, arg);
+}
+
+/**
+ * Returns the swap disk, or NULL if swapping is disabled.
+ */
+gbd_t *swap_get_disk(void)
+{
+    return swap_disk;
+}
+
+/**
+ * Marks a frame as the private page of the given mapping, making it
+ * a candidate for eviction.
+ *
+ * @param phys_page Physical address of the frame
+ *
+ * @param pagetable Page table mapping the frame
+ *
+ * @param vaddr Virtual address of the mapping
+ */
+void swap_track(uint32_t phys_page, pagetable_t *pagetable, uint32_t vaddr)
+{
+    interrupt_status_t intr_status;
+    swap_frame_t *frame = &swap_frames[phys_page / PAGE_SIZE];
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&swap_frame_slock);
+
+    frame->pagetable = pagetable;
+    frame->vaddr = vaddr & PAGE_SIZE_MASK;
+
+    spinlock_release(&swap_frame_slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Stops tracking a frame, it will not be evicted.
+ *
+ * @param phys_page Physical address of the frame
+ */
+void swap_untrack(uint32_t phys_page)
+{
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&swap_frame_slock);
+
+    swap_frames[phys_page / PAGE_SIZE].pagetable = NULL;
+
+    spinlock_release(&swap_frame_slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Acquires the swap mutex. Must be called in thread context.
+ */
+void swap_lock(void)
+{
+    mutex_acquire(&swap_mutex);
+}
+
+/**
+ * Releases the swap mutex.
+ */
+void swap_unlock(void)
+{
+    mutex_release(&swap_mutex);
+}
+
+/* Reads or writes one page slot from or to the given frame. */
+static void swap_transfer(uint32_t slot, uint32_t phys_page, int write)
+{
+    gbd_request_t req;
+    uint32_t i, block_size;
+    int r;
+
+    block_size = PAGE_SIZE / swap_blocks_per_page;
+
+    for (i = 0; i < swap_blocks_per_page; i++) {
+	req.block = slot * swap_blocks_per_page + i;
+	req.buf = phys_page + i * block_size;
+	req.sem = NULL;
+
+	if (write)
+	    r = swap_disk->write_block(swap_disk, &req);
+	else
+	    r = swap_disk->read_block(swap_disk, &req);
+
+	if (r == 0)
+	    KERNEL_PANIC("Swap disk I/O error");
+    }
+}
+
+/* Runs the clock until it finds a frame whose reference bit is clear,
+ * and invalidates the PTE of the frame. Returns the physical address
+ * of the frame and its owner, or 0 (and no owner) if there is
+ * nothing to evict.
+ */
+static uint32_t swap_select_victim(pagetable_t **pagetable, uint32_t *vaddr)
+{
+    interrupt_status_t intr_status;
+    swap_frame_t *frame;
+    pte_word_t *pte, old, new;
+    uint32_t phys;
+    int i, cleared;
+
+    phys = 0;
+    cleared = 0;
+    *pagetable = NULL;
+    *vaddr = 0;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&swap_frame_slock);
+
+    /* Two rounds: the first one may only clear reference bits */
+    for (i = 0; i < 2 * swap_num_frames && phys == 0; i++) {
+	frame = &swap_frames[swap_clock_hand];
+	swap_clock_hand = (swap_clock_hand + 1) % swap_num_frames;
+
+	if (frame->pagetable == NULL || frame->pins > 0)
+	    continue;
+
+	pte = (pte_word_t *) vm_lookup(frame->pagetable, frame->vaddr);
+	KERNEL_ASSERT(pte != NULL);
+
+	/* Mapped more than once (kernel tests), not a private page */
+	if (pagepool_get_refcount(pte->pte.PFN << 12) != 1)
+	    continue;
+
+	/* The reference bit is set concurrently by TLB refills */
+	do {
+	    old.word = pte->word;
+	    new = old;
+	    if (!old.pte.V || (old.pte.soft & (PTE_COW | PTE_SHARED)))
+		break;
+	    if (old.pte.soft & PTE_REF) {
+		new.pte.soft &= ~PTE_REF;
+	    } else {
+		new.pte.V = 0;
+		new.pte.soft |= PTE_EVICTING;
+	    }
+	} while (_atomic_cas(&pte->word, old.word, new.word) != old.word);
+
+	if (!old.pte.V || (old.pte.soft & (PTE_COW | PTE_SHARED)))
+	    continue;
+
+	if (old.pte.soft & PTE_REF) {
+	    cleared = 1;
+	    continue;
+	}
+
+	phys = old.pte.PFN << 12;
+	*pagetable = frame->pagetable;
+	*vaddr = frame->vaddr;
+	frame->pagetable = NULL;
+    }
+
+    spinlock_release(&swap_frame_slock);
+    _interrupt_set_state(intr_status);
+
+    /* Pages whose reference bit was cleared may still be in the TLBs
+       and would never fault again */
+    if (cleared)
+	tlb_invalidate_all();
+
+    return phys;
+}
+
+/* Writes one page to the swap disk and frees its frame. The swap
+ * mutex must be held. Returns 1 if a frame was freed, 0 if there is
+ * nothing to evict or the swap disk is full.
+ */
+static int swap_evict(void)
+{
+    pagetable_t *pagetable;
+    uint32_t vaddr, phys;
+    pte_t *pte;
+    int slot;
+
+    if (swap_disk == NULL)
+	return 0;
+
+    phys = swap_select_victim(&pagetable, &vaddr);
+    if (phys == 0)
+	return 0;
+
+    pte = vm_lookup(pagetable, vaddr);
+
+    /* The PTE is invalid now, drop it from the TLBs before writing
+       so that the page can not change under the write */
+    tlb_shootdown(pagetable, vaddr, 1);
+
+    slot = bitmap_findnset(swap_slots, swap_num_slots);
+    if (slot < 0) {
+	/* Swap is full, put the page back */
+	pte->soft &= ~PTE_EVICTING;
+	pte->V = 1;
+	swap_track(phys, pagetable, vaddr);
+	return 0;
+    }
+
+    swap_transfer(slot, phys, 1);
+
+    pte->PFN = slot;
+    pte->soft = (pte->soft & ~PTE_EVICTING) | PTE_SWAPPED;
+
+    pagepool_free_phys_page(phys);
+    vm_stat_inc(pagetable, VM_STAT_PAGE_OUTS);
+
+    return 1;
+}
+
+/**
+ * Allocates a physical page, evicting a page to the swap disk if the
+ * page pool is empty. The swap mutex must be held.
+ *
+ * @return Physical address of the page, 0 if out of memory
+ */
+uint32_t swap_get_phys_page_locked(void)
+{
+    uint32_t phys;
+
+    for (;;) {
+	phys = pagepool_get_phys_page();
+	if (phys != 0)
+	    return phys;
+	if (!swap_evict())
+	    return 0;
+    }
+}
+
+/**
+ * Allocates a physical page for a user mapping, evicting a page to
+ * the swap disk if the page pool is empty. Must be called in thread
+ * context.
+ *
+ * @return Physical address of the page, 0 if out of memory
+ */
+uint32_t swap_get_phys_page(void)
+{
+    uint32_t phys;
+
+    phys = pagepool_get_phys_page();
+    if (phys != 0 || swap_disk == NULL)
+	return phys;
+
+    swap_lock();
+    phys = swap_get_phys_page_locked();
+    swap_unlock();
+
+    return phys;
+}
+
+/**
+ * Evicts one page to the swap disk. Used when memory runs out for a
+ * copy-on-write copy, which does not evict by itself. Must be called
+ * in thread context.
+ *
+ * @return 1 if a frame was freed, 0 if not
+ */
+int swap_reclaim(void)
+{
+    int r;
+
+    swap_lock();
+    r = swap_evict();
+    swap_unlock();
+
+    return r;
+}
+
+/**
+ * Reads a swapped out page back into memory and maps it. Does nothing
+ * if the page is not swapped out (any more). The swap mutex must be
+ * held.
+ *
+ * @param pagetable Page table of the page
+ *
+ * @param vaddr Virtual address of the page
+ *
+ * @return 1 on success, 0 if out of memory
+ */
+int swap_in_locked(pagetable_t *pagetable, uint32_t vaddr)
+{
+    pte_t *pte;
+    uint32_t phys, slot;
+
+    pte = vm_lookup(pagetable, vaddr);
+    if (pte == NULL || !(pte->soft & PTE_SWAPPED))
+	return 1;
+
+    phys = swap_get_phys_page_locked();
+    if (phys == 0)
+	return 0;
+
+    slot = pte->PFN;
+    swap_transfer(slot, phys, 0);
+    swap_free_slot(slot);
+
+    pte->PFN = phys >> 12;
+    pte->soft &= ~PTE_SWAPPED;
+    pte->V = 1;
+
+    swap_track(phys, pagetable, vaddr);
+    vm_stat_inc(pagetable, VM_STAT_PAGE_INS);
+
+    return 1;
+}
+
+/**
+ * Reads a swapped out page back into memory, waiting for an eviction
+ * of the page in progress. Must be called in thread context.
+ *
+ * @param pagetable Page table of the page
+ *
+ * @param vaddr Virtual address of the page
+ *
+ * @return 1 on success, 0 if out of memory
+ */
+int swap_in(pagetable_t *pagetable, uint32_t vaddr)
+{
+    int r;
+
+    swap_lock();
+    r = swap_in_locked(pagetable, vaddr);
+    swap_unlock();
+
+    return r;
+}
+
+/**
+ * Frees a swap slot of a page which is no longer needed. The swap
+ * mutex must be held.
+ *
+ * @param slot The slot (PFN of the swapped out PTE)
+ */
+void swap_free_slot(uint32_t slot)
+{
+    KERNEL_ASSERT(bitmap_get(swap_slots, slot));
+    bitmap_set(swap_slots, slot, 0);
+}
+
+/**
+ * Keeps the page at the given address in memory, used while the
+ * kernel accesses user memory with interrupts enabled (system calls).
+ * Only the frame of the page is pinned, the other pages of the page
+ * table can still be swapped out. Pins are counted, every successful
+ * call must be matched with swap_unpin.
+ *
+ * @param pagetable Page table mapping the page
+ *
+ * @param vaddr Virtual address of the page
+ *
+ * @return 1 if the page was pinned, 0 if it is not in memory (it is
+ * not mapped, or is being or has been swapped out). The caller should
+ * fault it in and try again.
+ */
+int swap_pin(pagetable_t *pagetable, uint32_t vaddr)
+{
+    interrupt_status_t intr_status;
+    pte_t *pte;
+    int pinned = 0;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&swap_frame_slock);
+
+    /* The clock invalidates the PTE under the frame lock before it
+       evicts a page, so a valid PTE here can not be evicted anymore
+       once its frame is pinned */
+    pte = vm_lookup(pagetable, vaddr);
+    if (pte != NULL && pte->V) {
+	swap_frames[pte->PFN].pins++;
+	pinned = 1;
+    }
+
+    spinlock_release(&swap_frame_slock);
+    _interrupt_set_state(intr_status);
+
+    return pinned;
+}
+
+/**
+ * Releases a pin taken with swap_pin. The page may be swapped out
+ * again when it has no pins left.
+ *
+ * @param pagetable Page table mapping the page
+ *
+ * @param vaddr Virtual address of the page
+ */
+void swap_unpin(pagetable_t *pagetable, uint32_t vaddr)
+{
+    interrupt_status_t intr_status;
+    pte_t *pte;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&swap_frame_slock);
+
+    pte = vm_lookup(pagetable, vaddr);
+    KERNEL_ASSERT(pte != NULL && pte->V
+		  && swap_frames[pte->PFN].pins > 0);
+    swap_frames[pte->PFN].pins--;
+
+    spinlock_release(&swap_frame_slock);
+    _interrupt_set_state(intr_status);
+}
+
+/** @} */
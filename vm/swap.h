@@ -0,0 +1,60 @@
+/*
+ * Swapping of user pages
+ *
+ * Copyright (C) 2003 Juha Aatrokoski, Timo Lilja,
+ *   Leena Salmela, Teemu Takanen, Aleksi Virtanen.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BUENOS_VM_SWAP_H
+#define BUENOS_VM_SWAP_H
+
+#include "lib/types.h"
+#include "drivers/gbd.h"
+#include "vm/pagetable.h"
+
+void swap_init(void);
+gbd_t *swap_get_disk(void);
+
+void swap_track(uint32_t phys_page, pagetable_t *pagetable, uint32_t vaddr);
+void swap_untrack(uint32_t phys_page);
+
+uint32_t swap_get_phys_page(void);
+int swap_reclaim(void);
+int swap_in(pagetable_t *pagetable, uint32_t vaddr);
+void swap_free_slot(uint32_t slot);
+
+void swap_lock(void);
+void swap_unlock(void);
+uint32_t swap_get_phys_page_locked(void);
+int swap_in_locked(pagetable_t *pagetable, uint32_t vaddr);
+
+int swap_pin(pagetable_t *pagetable, uint32_t vaddr);
+void swap_unpin(pagetable_t *pagetable, uint32_t vaddr);
+
+#endif /* BUENOS_VM_SWAP_H */
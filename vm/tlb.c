@@ -36,47 +36,440 @@
 
 #include "kernel/panic.h"
 #include "kernel/assert.h"
+#include "kernel/thread.h"
+#include "kernel/spinlock.h"
+#include "kernel/interrupt.h"
+#include "kernel/config.h"
+#include "kernel/mutex.h"
+#include "drivers/device.h"
+#include "drivers/metadev.h"
 #include "vm/tlb.h"
 #include "vm/pagetable.h"
+#include "vm/vm.h"
 
-void tlb_modified_exception(void)
+/** @name TLB handling
+ *
+ * The TLB is filled on demand. A TLB miss (load or store exception)
+ * is handled by looking up the faulting page from the page table of
+ * the current thread and writing the mapping to the TLB with
+ * _tlb_write_random. If the page is not mapped, the access is
+ * invalid and the exception handler must kill the process (or panic
+ * in kernel mode).
+ *
+ * Whenever the TLBs may hold stale mappings, tlb_generation is
+ * incremented, and each CPU flushes its own TLB before it runs a
+ * thread with a page table if its TLB is older than the current
+ * generation (see tlb_switch).
+ *
+ * Page tables get their ASIDs from a global allocator when they are
+ * first run. The ASIDs are handed out in order and never returned, so
+ * the TLBs may keep the mappings of a destroyed page table: its ASID
+ * is not used again before all TLBs have been flushed. When the ASIDs
+ * run out, the ASID generation is incremented and the TLBs are
+ * flushed lazily by incrementing tlb_generation. Page tables of an
+ * older ASID generation get a new ASID the next time they are run.
+ * A CPU which has not flushed its TLB since may still run a page
+ * table with its old ASID, so such a CPU flushes its whole TLB on a
+ * shootdown and switches to the new ASID on its next TLB miss.
+ *
+ * Removing single mappings (vm_unmap_range) invalidates them with a
+ * TLB shootdown: the initiating CPU invalidates the pages in its own
+ * TLB and sends an inter-CPU interrupt to the other CPUs which have
+ * run the page table, and waits until they have done the same.
+ *
+ * @{
+ */
+
+/* Incremented whenever cached mappings may have become stale */
+static volatile int tlb_generation = 0;
+
+/* The generation of the TLB contents of each CPU */
+static int tlb_cpu_generation[CONFIG_MAX_CPUS];
+
+/* Largest hardware ASID. ASID 0 is not used for page tables, the
+   invalid entries written by tlb_flush_local have it. */
+#define TLB_MAX_ASID 255
+
+/* The ASID allocator */
+static struct {
+    spinlock_t slock;
+    /* The next free ASID of the current generation */
+    uint32_t next;
+    /* Generation of the ASIDs in use, page tables with another
+       generation have no valid ASID */
+    volatile uint32_t generation;
+} tlb_asids;
+
+/* Ranges longer than this are shot down by flushing the whole TLB
+   instead of probing for each page pair */
+#define TLB_SHOOTDOWN_MAX_PAGES 16
+
+/* The shootdown in progress. Only one shootdown is done at a time. */
+static struct {
+    /* Serializes shootdowns */
+    mutex_t lock;
+    /* The mappings to invalidate */
+    uint32_t asid;
+    uint32_t vaddr;
+    uint32_t pages;
+    /* CPUs which have not yet invalidated the mappings */
+    volatile uint32_t pending;
+} tlb_shootdown_request;
+
+/**
+ * Initializes TLB handling.
+ */
+void tlb_init(void)
 {
-    KERNEL_PANIC("Unhandled TLB modified exception");
+    mutex_init(&tlb_shootdown_request.lock);
+    tlb_shootdown_request.pending = 0;
+
+    spinlock_reset(&tlb_asids.slock);
+    tlb_asids.next = 1;
+    tlb_asids.generation = 1;
 }
 
-void tlb_load_exception(void)
+/* Builds the TLB entry pair mapping the given address from the page
+ * table of the current thread, and the PageMask for it. Returns 0 if
+ * the address is not mapped.
+ */
+static int tlb_lookup(uint32_t vaddr, tlb_entry_t *entry, uint32_t *pagemask)
 {
-    KERNEL_PANIC("Unhandled TLB load exception");
+    pagetable_t *pagetable;
+
+    pagetable = thread_get_current_thread_entry()->pagetable;
+    if (pagetable == NULL)
+	return 0;
+
+    /* The ASID of the page table may have changed since the thread
+       was switched to, the entry must have the one in use */
+    if (tlb_cpu_generation[_interrupt_getcpu()] != tlb_generation)
+	tlb_switch(pagetable);
+
+    return vm_get_tlb_entry(pagetable, vaddr, entry, pagemask);
 }
 
-void tlb_store_exception(void)
+/* Writes the given entry pair into the TLB, replacing an existing
+ * entry for the same pair if there is one (the TLB must never hold
+ * two matching entries). Large page entries are written with their
+ * PageMask, the register is 0 otherwise.
+ */
+static void tlb_update(tlb_entry_t *entry, uint32_t pagemask)
 {
-    KERNEL_PANIC("Unhandled TLB store exception");
+    int index;
+
+    if (pagemask != 0)
+	_tlb_set_pagemask(pagemask);
+
+    index = _tlb_probe(entry);
+    if (index >= 0)
+	_tlb_write(entry, index, 1);
+    else
+	_tlb_write_random(entry);
+
+    if (pagemask != 0)
+	_tlb_set_pagemask(0);
+}
+
+/* Handles a TLB miss: loads the mapping of the faulting address from
+ * the page table to the TLB. Returns 1 if the address was mapped, 0
+ * otherwise.
+ */
+static int tlb_refill(void)
+{
+    tlb_exception_state_t state;
+    tlb_entry_t entry;
+    uint32_t pagemask;
+
+    _tlb_get_exception_state(&state);
+
+    if (!tlb_lookup(state.badvaddr, &entry, &pagemask))
+	return 0;
+
+    tlb_update(&entry, pagemask);
+    vm_stat_inc(thread_get_current_thread_entry()->pagetable,
+		VM_STAT_TLB_REFILLS);
+    return 1;
+}
+
+/**
+ * Handles a TLB modified exception, i.e. a store to a page whose TLB
+ * entry is write protected. If the page table allows writing (the
+ * TLB entry was stale), the TLB entry is updated. Copy-on-write pages
+ * are left to process_page_fault, which copies them in thread
+ * context.
+ *
+ * @return 1 if the exception was handled, 0 if the store was to a
+ * read-only, copy-on-write or unmapped page.
+ */
+int tlb_modified_exception(void)
+{
+    tlb_exception_state_t state;
+    tlb_entry_t entry;
+    uint32_t pagemask;
+    int odd;
+
+    _tlb_get_exception_state(&state);
+
+    if (!tlb_lookup(state.badvaddr, &entry, &pagemask))
+	return 0;
+
+    vm_stat_inc(thread_get_current_thread_entry()->pagetable,
+		VM_STAT_TLB_MODIFIED);
+
+    /* Which half of the pair the address is on depends on the page
+       size of the entry */
+    odd = state.badvaddr & (((pagemask >> 1) | 0xfff) + 1);
+    if (odd ? !entry.D1 : !entry.D0)
+	return 0;
+
+    tlb_update(&entry, pagemask);
+    return 1;
+}
+
+/**
+ * Handles a TLB miss on load or instruction fetch.
+ *
+ * @return 1 if the exception was handled, 0 if the address is not
+ * mapped.
+ */
+int tlb_load_exception(void)
+{
+    return tlb_refill();
 }
 
 /**
- * Fill TLB with given pagetable. This function is used to set memory
- * mappings in CP0's TLB before we have a proper TLB handling system.
- * This approach limits the maximum mapping size to 128kB.
+ * Handles a TLB miss on store.
  *
- * @param pagetable Mappings to write to TLB.
+ * @return 1 if the exception was handled, 0 if the address is not
+ * mapped.
+ */
+int tlb_store_exception(void)
+{
+    return tlb_refill();
+}
+
+/* Invalidates every entry in the TLB of this CPU. Each row gets a
+ * distinct unmapped (kseg0) VPN2, so that no two rows match the same
+ * address.
+ */
+static void tlb_flush_local(void)
+{
+    tlb_entry_t entry;
+    uint32_t i, maxindex;
+
+    maxindex = _tlb_get_maxindex();
+    memoryset(&entry, 0, sizeof(entry));
+
+    for (i = 0; i <= maxindex; i++) {
+	entry.VPN2 = (0x80000000 >> 13) + i;
+	_tlb_write(&entry, i, 1);
+    }
+}
+
+/* Starts a new TLB generation, returns its number. */
+static int tlb_new_generation(void)
+{
+    int gen;
+
+    do {
+	gen = tlb_generation;
+    } while (_atomic_cas((int *)&tlb_generation, gen, gen + 1) != gen);
+
+    return gen + 1;
+}
+
+/**
+ * Marks the contents of all TLBs stale. Every CPU flushes its TLB
+ * before it next switches to a thread with a page table; this CPU
+ * flushes immediately. Called when mappings are removed or write
+ * protected.
+ */
+void tlb_invalidate_all(void)
+{
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+
+    tlb_cpu_generation[_interrupt_getcpu()] = tlb_new_generation();
+    tlb_flush_local();
+
+    /* Flushing overwrote the ASID in EntryHi */
+    tlb_switch(thread_get_current_thread_entry()->pagetable);
+
+    _interrupt_set_state(intr_status);
+}
+
+/* Gives the page table an ASID of the current generation, starting a
+ * new generation if they have run out. Interrupts must be disabled.
+ */
+static void tlb_asid_alloc(pagetable_t *pagetable)
+{
+    spinlock_acquire(&tlb_asids.slock);
+
+    /* Another thread of the process may have done it already */
+    if (pagetable->asid_generation != tlb_asids.generation) {
+	if (tlb_asids.next > TLB_MAX_ASID) {
+	    /* The TLBs may hold mappings with any ASID */
+	    tlb_asids.generation++;
+	    tlb_asids.next = 1;
+	    tlb_new_generation();
+	    vm_stat_inc(NULL, VM_STAT_ASID_ROLLOVERS);
+	}
+
+	pagetable->ASID = tlb_asids.next++;
+	pagetable->asid_generation = tlb_asids.generation;
+    }
+
+    spinlock_release(&tlb_asids.slock);
+}
+
+/* Invalidates the mappings of the given pages with the given ASID in
+ * the TLB of this CPU. Must be called with interrupts disabled.
+ */
+static void tlb_invalidate_local(uint32_t asid, uint32_t vaddr,
+				 uint32_t pages)
+{
+    tlb_entry_t entry;
+    uint32_t vpn2, last;
+    int index, cpu, gen;
+
+    /* A TLB older than the ASID generation may hold the mappings
+       under an old ASID of the page table */
+    cpu = _interrupt_getcpu();
+    gen = tlb_generation;
+    if (pages > TLB_SHOOTDOWN_MAX_PAGES || tlb_cpu_generation[cpu] != gen) {
+	tlb_flush_local();
+	tlb_cpu_generation[cpu] = gen;
+    } else {
+	memoryset(&entry, 0, sizeof(entry));
+	last = (vaddr + (pages - 1) * PAGE_SIZE) >> 13;
+
+	for (vpn2 = vaddr >> 13; vpn2 <= last; vpn2++) {
+	    entry.VPN2 = vpn2;
+	    entry.ASID = asid;
+	    index = _tlb_probe(&entry);
+	    if (index < 0)
+		continue;
+
+	    /* Same invalid entry as tlb_flush_local writes to the row */
+	    entry.VPN2 = (0x80000000 >> 13) + index;
+	    entry.ASID = 0;
+	    _tlb_write(&entry, index, 1);
+	}
+    }
+
+    /* Probing and flushing overwrote the ASID in EntryHi */
+    tlb_switch(thread_get_current_thread_entry()->pagetable);
+}
+
+/**
+ * Removes the mappings of the given pages of a page table from the
+ * TLBs of all CPUs. The page table entries must already be invalid.
+ * Other CPUs which may hold the mappings are interrupted and this
+ * function waits until they have invalidated them, so it must not be
+ * called while holding a spinlock or with interrupts disabled.
  *
+ * @param pagetable The page table whose mappings are removed
+ * @param vaddr First virtual address of the range
+ * @param pages Number of pages in the range
+ */
+void tlb_shootdown(pagetable_t *pagetable, uint32_t vaddr, uint32_t pages)
+{
+    interrupt_status_t intr_status;
+    uint32_t targets, asid;
+    int cpu, i;
+
+    if (pages == 0)
+	return;
+
+    mutex_acquire(&tlb_shootdown_request.lock);
+    intr_status = _interrupt_disable();
+
+    /* Another CPU may give the page table a new ASID meanwhile, but
+       it flushes its TLB before using the new one */
+    asid = pagetable->ASID;
+
+    cpu = _interrupt_getcpu();
+    tlb_invalidate_local(asid, vaddr, pages);
+
+    targets = pagetable->cpumask & ~(1 << cpu);
+    if (targets != 0) {
+	tlb_shootdown_request.asid = asid;
+	tlb_shootdown_request.vaddr = vaddr;
+	tlb_shootdown_request.pages = pages;
+	tlb_shootdown_request.pending = targets;
+
+	for (i = 0; i < CONFIG_MAX_CPUS; i++) {
+	    if (targets & (1 << i))
+		cpustatus_send_ipi(device_get(YAMS_TYPECODE_CPUSTATUS + i, 0),
+				   CPU_IPI_TLB_SHOOTDOWN);
+	}
+
+	/* The other CPUs clear their bits in the interrupt handler */
+	while (tlb_shootdown_request.pending != 0)
+	    ;
+    }
+
+    _interrupt_set_state(intr_status);
+    mutex_release(&tlb_shootdown_request.lock);
+}
+
+/**
+ * Handles a TLB shootdown request on this CPU. Called from the CPU
+ * status device interrupt handler.
  */
+void tlb_shootdown_interrupt(void)
+{
+    uint32_t bit;
+    int pending;
+
+    bit = 1 << _interrupt_getcpu();
+    if (!(tlb_shootdown_request.pending & bit))
+	return;
+
+    tlb_invalidate_local(tlb_shootdown_request.asid,
+			 tlb_shootdown_request.vaddr,
+			 tlb_shootdown_request.pages);
+
+    do {
+	pending = tlb_shootdown_request.pending;
+    } while (_atomic_cas((int *)&tlb_shootdown_request.pending,
+			 pending, pending & ~bit) != pending);
+}
 
-void tlb_fill(pagetable_t *pagetable)
+/**
+ * Prepares the TLB of this CPU for running a thread with the given
+ * page table: gives the page table a new ASID if its ASID is from an
+ * older generation, flushes the TLB if it may hold stale mappings and
+ * sets the current ASID. Must be called with interrupts disabled.
+ *
+ * @param pagetable The page table of the thread, may be NULL for
+ * kernel threads.
+ */
+void tlb_switch(pagetable_t *pagetable)
 {
-    if(pagetable == NULL)
+    int cpu, gen;
+
+    if (pagetable == NULL)
 	return;
 
-    /* Check that the pagetable can fit into TLB. This is needed until
-     we have proper VM system, because the whole pagetable must fit
-     into TLB. */
-    KERNEL_ASSERT(pagetable->valid_count <= (_tlb_get_maxindex()+1));
+    if (pagetable->asid_generation != tlb_asids.generation)
+	tlb_asid_alloc(pagetable);
+
+    cpu = _interrupt_getcpu();
+    gen = tlb_generation;
+    if (tlb_cpu_generation[cpu] != gen) {
+	tlb_flush_local();
+	tlb_cpu_generation[cpu] = gen;
+    }
 
-    _tlb_write(pagetable->entries, 0, pagetable->valid_count);
+    /* Only the CPU running the thread of the page table modifies the
+       mask, so a plain update is enough */
+    if (!(pagetable->cpumask & (1 << cpu)))
+	pagetable->cpumask |= 1 << cpu;
 
-    /* Set ASID field in Co-Processor 0 to match thread ID so that
-       only entries with the ASID of the current thread will match in
-       the TLB hardware. */
     _tlb_set_asid(pagetable->ASID);
 }
+
+/** @} */
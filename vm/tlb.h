@@ -50,7 +50,8 @@ typedef struct {
     unsigned int VPN2:19    __attribute__ ((packed));
     unsigned int dummy1:5   __attribute__ ((packed));
     /* Address space identifier. When ASID matches CP0 setted ASID
-       this entry is valid. In Buenos, we use mapping ASID = Thread Id. */
+       this entry is valid. In Buenos, page tables get ASIDs from the
+       allocator in vm/tlb.c. */
     unsigned int ASID:8     __attribute__ ((packed));
 
     unsigned int dummy2:6   __attribute__ ((packed));
@@ -90,14 +91,19 @@ typedef struct {
     uint32_t asid; /* ASID of the causing process, only 8 lowest bits used */
 } tlb_exception_state_t;
 
-/* exception handlers */
-void tlb_modified_exception(void);
-void tlb_load_exception(void);
-void tlb_store_exception(void);
+/* exception handlers, return 1 if handled and 0 on invalid access */
+int tlb_modified_exception(void);
+int tlb_load_exception(void);
+int tlb_store_exception(void);
 
 /* Forward declare pagetable_t (== struct pagetable_struct_t) */
 struct pagetable_struct_t;
-void tlb_fill(struct pagetable_struct_t *pagetable);
+void tlb_init(void);
+void tlb_switch(struct pagetable_struct_t *pagetable);
+void tlb_invalidate_all(void);
+void tlb_shootdown(struct pagetable_struct_t *pagetable,
+                   uint32_t vaddr, uint32_t pages);
+void tlb_shootdown_interrupt(void);
 
 /* assembler function wrappers */
 void _tlb_get_exception_state(tlb_exception_state_t *state);
@@ -108,6 +114,7 @@ int _tlb_probe(tlb_entry_t *entry);
 int _tlb_read(tlb_entry_t *entries, uint32_t index, uint32_t num);
 int _tlb_write(tlb_entry_t *entries, uint32_t index, uint32_t num);
 void _tlb_write_random(tlb_entry_t *entry);
+void _tlb_set_pagemask(uint32_t mask);
 
 
 #endif /* BUENOS_VM_TLB_H */
@@ -37,8 +37,14 @@
 #include "vm/pagetable.h"
 #include "vm/vm.h"
 #include "vm/pagepool.h"
+#include "vm/pagecache.h"
+#include "vm/swap.h"
 #include "kernel/kmalloc.h"
+#include "kernel/slab.h"
 #include "kernel/assert.h"
+#include "kernel/interrupt.h"
+#include "kernel/spinlock.h"
+#include "drivers/bootargs.h"
 
 /** @name Virtual memory system
  *
@@ -53,11 +59,21 @@
 #define ADDR_IS_ON_ODD_PAGE(addr)  ((addr) & 0x00001000)  
 #define ADDR_IS_ON_EVEN_PAGE(addr) (!((addr) & 0x00001000))  
 
+/* The user address space ends here, pagetables map only below it */
+#define VM_USER_TOP 0x80000000
+
+/* Counters of the VM system, for each CPU */
+static vm_stats_t vm_cpu_stats[CONFIG_MAX_CPUS];
+
+/* Whether user memory may be mapped with large pages */
+static int vm_large_pages;
+
 
 /**
  * Initializes virtual memory system. Initialization consists of page
  * pool initialization and disabling static memory reservation. After
- * this kmalloc() may not be used anymore.
+ * this kmalloc() may not be used anymore, kernel objects are allocated
+ * from the object caches (kernel/slab.c) instead.
  */ 
 void vm_init(void)
 {
@@ -68,26 +84,106 @@ void vm_init(void)
        in this form. */
     KERNEL_ASSERT(sizeof(tlb_entry_t) == 12);
 
+    /* These allocate their tables with kmalloc, so they must run
+       before the page pool takes over the remaining memory */
+    pagecache_init();
+    swap_init();
     pagepool_init();
     kmalloc_disable();
+    kmem_init();
+    tlb_init();
+
+    vm_large_pages = (bootargs_get("largepages") != NULL);
+    if (vm_large_pages)
+	kprintf("VM: Using %dk large pages\n", VM_LARGE_PAGE_SIZE / 1024);
+}
+
+/**
+ * Returns non-zero if user memory may be mapped with large pages
+ * (boot argument "largepages").
+ */
+int vm_use_large_pages(void)
+{
+    return vm_large_pages;
 }
 
 /**
- *  Creates a new page table. Reserves memory (one page) for the table
- *  and sets the address space identifier for the created page table.
+ * Counts a memory event on the current CPU and in the given page
+ * table. The CPU counters are only updated by their own CPU, while
+ * the threads of a process may update its page table concurrently.
  *
- *  @param asid Address space identifier
+ * @param pagetable Page table of the event, NULL if there is none
+ *
+ * @param counter One of VM_STAT_*
+ */
+void vm_stat_inc(pagetable_t *pagetable, int counter)
+{
+    interrupt_status_t intr_status;
+    int *count, old;
+
+    intr_status = _interrupt_disable();
+    vm_cpu_stats[_interrupt_getcpu()].count[counter]++;
+    _interrupt_set_state(intr_status);
+
+    if (pagetable == NULL)
+	return;
+
+    count = (int *) &pagetable->stats.count[counter];
+    do {
+	old = *(volatile int *)count;
+    } while (_atomic_cas(count, old, old + 1) != old);
+}
+
+/**
+ * Returns a counter of memory events.
  *
- *  @return The created page table
+ * @param cpu The CPU, or -1 for the sum over all CPUs
  *
+ * @param counter One of VM_STAT_*
  */
+uint32_t vm_get_stat(int cpu, int counter)
+{
+    uint32_t sum;
+    int i;
+
+    if (cpu >= 0)
+	return vm_cpu_stats[cpu].count[counter];
+
+    sum = 0;
+    for (i = 0; i < CONFIG_MAX_CPUS; i++)
+	sum += vm_cpu_stats[i].count[counter];
+    return sum;
+}
 
-pagetable_t *vm_create_pagetable(uint32_t asid)
+/* Drops the reference of a mapping to its page. */
+static void vm_release_page(pte_t *pte)
+{
+    swap_untrack(pte->PFN << 12);
+
+    if (pte->soft & PTE_SHARED)
+	pagecache_put(pte->PFN << 12);
+    else
+	pagepool_free_phys_page(pte->PFN << 12);
+}
+
+/**
+ *  Creates a new page table. Reserves memory (one page) for the table,
+ *  evicting a page to the swap disk if needed, so it must be called in
+ *  thread context. The leaf tables are allocated as mappings are
+ *  added, and the address space identifier when the page table is
+ *  first run (see tlb_switch).
+ *
+ *  @return The created page table, NULL if out of memory
+ *
+ */
+
+pagetable_t *vm_create_pagetable(void)
 {
     pagetable_t *table;
     uint32_t addr;
+    int i;
 
-    addr = pagepool_get_phys_page();
+    addr = swap_get_phys_page();
     if(addr == 0) {
 	return NULL;
     }
@@ -98,15 +194,26 @@ pagetable_t *vm_create_pagetable(uint32_t asid)
        physical memory. */
     table = (pagetable_t *) (ADDR_PHYS_TO_KERNEL(addr));
 
-    table->ASID        = asid;
+    table->ASID        = 0;
+    table->asid_generation = 0;
     table->valid_count = 0;
+    table->cpumask     = 0;
+    memoryset(&table->stats, 0, sizeof(vm_stats_t));
+
+    for (i = 0; i < PAGETABLE_DIR_ENTRIES; i++)
+	table->directory[i] = NULL;
 
     return table;
 }
 
 /**
- * Destroys given pagetable. Frees the memory (one page) allocated for
- * the pagetable. Does not remove mappings from the TLB.
+ * Destroys given pagetable. Frees the memory allocated for the
+ * pagetable and its leaf tables, and drops the references to the
+ * mapped pages (freeing the pages not shared with other page
+ * tables) and swap slots. The mappings may stay in the TLBs, since
+ * the ASID of the page table is not reused before the TLBs have been
+ * flushed (see tlb_switch). Must be called in thread context,
+ * since it waits for evictions in progress (see swap_lock).
  *
  * @param pagetable Page table to destroy
  *
@@ -114,9 +221,165 @@ pagetable_t *vm_create_pagetable(uint32_t asid)
 
 void vm_destroy_pagetable(pagetable_t *pagetable)
 {
+    pte_t *leaf;
+    int i, j;
+
+    swap_lock();
+
+    for (i = 0; i < PAGETABLE_DIR_ENTRIES; i++) {
+	leaf = pagetable->directory[i];
+	if (leaf == NULL)
+	    continue;
+
+	for (j = 0; j < PAGETABLE_LEAF_ENTRIES; j++) {
+	    if (leaf[j].V)
+		vm_release_page(&leaf[j]);
+	    else if (leaf[j].soft & PTE_SWAPPED)
+		swap_free_slot(leaf[j].PFN);
+	}
+
+	pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS((uint32_t) leaf));
+    }
+
+    swap_unlock();
+
     pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS((uint32_t) pagetable));
 }
 
+/**
+ * Finds the page table entry of the given virtual address. The entry
+ * is valid only if its V bit is set.
+ *
+ * @param pagetable Page table to search
+ *
+ * @param vaddr Virtual address
+ *
+ * @return The page table entry, or NULL if there is no leaf table for
+ * the address (and so no mapping).
+ */
+
+pte_t *vm_lookup(pagetable_t *pagetable, uint32_t vaddr)
+{
+    pte_t *leaf;
+
+    if (vaddr >= VM_USER_TOP)
+	return NULL;
+
+    leaf = pagetable->directory[PAGETABLE_DIR_INDEX(vaddr)];
+    if (leaf == NULL)
+	return NULL;
+
+    return &leaf[PAGETABLE_LEAF_INDEX(vaddr)];
+}
+
+/**
+ * Builds the TLB entry for the page pair containing the given virtual
+ * address. Both pages of a pair are always in the same leaf table.
+ * Sets the reference bits (PTE_REF) of the valid pages of the pair.
+ * If the address is on a large page, the entry maps the pair of large
+ * pages containing it.
+ *
+ * @param pagetable Page table to use
+ *
+ * @param vaddr Virtual address
+ *
+ * @param entry The TLB entry to fill
+ *
+ * @param pagemask Set to the PageMask for the entry, 0 for 4k pages
+ *
+ * @return 1 if the page of vaddr is mapped, 0 if not (entry is then
+ * not filled).
+ */
+
+int vm_get_tlb_entry(pagetable_t *pagetable, uint32_t vaddr,
+                     tlb_entry_t *entry, uint32_t *pagemask)
+{
+    pte_t *even, *odd;
+    pte_word_t *pte, old, new;
+    uint32_t size;
+    int i;
+
+    even = vm_lookup(pagetable, vaddr);
+    if (even == NULL || !even->V)
+	return 0;
+
+    if (even->soft & PTE_LARGE) {
+	size = VM_LARGE_PAGE_SIZE;
+	*pagemask = VM_LARGE_PAGE_MASK;
+    } else {
+	size = PAGE_SIZE;
+	*pagemask = 0;
+    }
+
+    /* A large page is described by the PTE of its first 4k page */
+    vaddr &= ~(2 * size - 1);
+    even = vm_lookup(pagetable, vaddr);
+    odd = even + size / PAGE_SIZE;
+
+    /* The pair is either all large or all 4k pages */
+    KERNEL_ASSERT(size == PAGE_SIZE
+		  || ((!even->V || (even->soft & PTE_LARGE))
+		      && (!odd->V || (odd->soft & PTE_LARGE))));
+
+    /* The swap clock clears the bits concurrently */
+    for (i = 0; i < 2; i++) {
+	pte = (pte_word_t *) (i == 0 ? even : odd);
+	do {
+	    old.word = pte->word;
+	    if (!old.pte.V || (old.pte.soft & PTE_REF))
+		break;
+	    new = old;
+	    new.pte.soft |= PTE_REF;
+	} while (_atomic_cas(&pte->word, old.word, new.word) != old.word);
+    }
+
+    entry->VPN2 = vaddr >> 13;
+    entry->dummy1 = 0;
+    entry->ASID = pagetable->ASID;
+
+    entry->dummy2 = 0;
+    entry->PFN0 = even->PFN;
+    entry->C0 = even->C;
+    entry->D0 = even->D;
+    entry->V0 = even->V;
+    entry->G0 = 0;
+
+    entry->dummy3 = 0;
+    entry->PFN1 = odd->PFN;
+    entry->C1 = odd->C;
+    entry->D1 = odd->D;
+    entry->V1 = odd->V;
+    entry->G1 = 0;
+
+    return 1;
+}
+
+/* Returns the leaf table for the given address, allocating it if
+ * this is the first mapping in its region. A page is evicted for the
+ * table if needed; swap_locked tells whether the caller holds the
+ * swap lock. Returns NULL if out of memory.
+ */
+static pte_t *vm_get_leaf(pagetable_t *pagetable, uint32_t vaddr,
+			  int swap_locked)
+{
+    pte_t **leaf;
+    uint32_t addr;
+
+    leaf = &pagetable->directory[PAGETABLE_DIR_INDEX(vaddr)];
+    if (*leaf == NULL) {
+	if (swap_locked)
+	    addr = swap_get_phys_page_locked();
+	else
+	    addr = swap_get_phys_page();
+	if (addr == 0)
+	    return NULL;
+	*leaf = (pte_t *) ADDR_PHYS_TO_KERNEL(addr);
+	memoryset(*leaf, 0, PAGE_SIZE);
+    }
+
+    return *leaf;
+}
+
 /**
  * Maps given virtual address to given physical address in given page
  * table. Does not modify TLB. The mapping is done in 4k chunks (pages).
@@ -133,82 +396,310 @@ void vm_destroy_pagetable(pagetable_t *pagetable)
  * page is not dirty (write-protected). The terminology comes
  * from hardware, in reality, this is write enabling bit.
  *
+ * @return 1 on success, 0 if there is no memory for the leaf table.
+ * A leaf table may be allocated by evicting a page, so this must be
+ * called in thread context.
+ *
  */
 
-void vm_map(pagetable_t *pagetable, 
-	    uint32_t physaddr, 
-	    uint32_t vaddr,
-            int dirty)
+int vm_map(pagetable_t *pagetable, 
+	   uint32_t physaddr, 
+	   uint32_t vaddr,
+	   int dirty)
 {
-    unsigned int i;
+    pte_t *leaf, *pte;
 
     KERNEL_ASSERT(dirty == 0 || dirty == 1);
+    KERNEL_ASSERT(vaddr < VM_USER_TOP);
 
-    for(i=0; i<pagetable->valid_count; i++) {
-	if(pagetable->entries[i].VPN2 == (vaddr >> 13)) {
-	    /* TLB has separate mappings for even and odd 
-	       virtual pages. Let's handle them separately here,
-	       and we have much more fun when updating the TLB later.*/
-	    if(ADDR_IS_ON_EVEN_PAGE(vaddr)) {
-		if(pagetable->entries[i].V0 == 1) {
-		    KERNEL_PANIC("Tried to re-map same virtual page");
-		} else {
-		    /* Map the page on a pair entry */
-		    pagetable->entries[i].PFN0 = physaddr >> 12;
-		    pagetable->entries[i].V0 = 1;
-		    pagetable->entries[i].G0 = 0;
-		    pagetable->entries[i].D0 = dirty;
-		    return;
-		}
-	    } else {
-		if(pagetable->entries[i].V1 == 1) {
-		    KERNEL_PANIC("Tried to re-map same virtual page");
-		} else {
-		    /* Map the page on a pair entry */
-		    pagetable->entries[i].PFN1 = physaddr >> 12;
-		    pagetable->entries[i].V1 = 1;
-		    pagetable->entries[i].G1 = 0;
-		    pagetable->entries[i].D1 = dirty;
-		    return;
-		}
-	    }
+    leaf = vm_get_leaf(pagetable, vaddr, 0);
+    if (leaf == NULL)
+	return 0;
+
+    pte = &leaf[PAGETABLE_LEAF_INDEX(vaddr)];
+    if (pte->V == 1)
+	KERNEL_PANIC("Tried to re-map same virtual page");
+
+    pte->soft = 0;
+    pte->PFN = physaddr >> 12;
+    pte->D   = dirty;
+    pte->V   = 1;
+    pte->G   = 0;
+
+    pagetable->valid_count++;
+
+    swap_track(physaddr, pagetable, vaddr);
+
+    return 1;
+}
+
+/**
+ * Maps a large page: VM_LARGE_PAGE_PAGES contiguous physical pages
+ * (e.g. a block from pagepool_get_phys_pages) to as many contiguous
+ * virtual pages. The large page is mapped with one TLB entry, shared
+ * with the other large page of its pair. All pages of a pair must be
+ * mapped as large pages or not at all, vm_split_large turns them back
+ * into ordinary pages. Large pages are not swapped out. Each 4k page
+ * takes over the reference given by the page pool.
+ *
+ * @param pagetable Page table in which to do the mapping
+ *
+ * @param physaddr First physical page, aligned to VM_LARGE_PAGE_SIZE
+ *
+ * @param vaddr Virtual address, aligned to VM_LARGE_PAGE_SIZE
+ *
+ * @param dirty 1 if the page is writable, 0 if not
+ *
+ * @return 1 on success, 0 if there is no memory for the leaf table
+ *
+ */
+
+int vm_map_large(pagetable_t *pagetable, uint32_t physaddr, uint32_t vaddr,
+                 int dirty)
+{
+    uint32_t i;
+
+    KERNEL_ASSERT((physaddr & (VM_LARGE_PAGE_SIZE - 1)) == 0);
+    KERNEL_ASSERT((vaddr & (VM_LARGE_PAGE_SIZE - 1)) == 0);
+
+    /* A large page is within one leaf table, so after this vm_map
+       does not fail */
+    if (vm_get_leaf(pagetable, vaddr, 0) == NULL)
+	return 0;
+
+    for (i = 0; i < VM_LARGE_PAGE_PAGES; i++) {
+	vm_map(pagetable, physaddr + i*PAGE_SIZE, vaddr + i*PAGE_SIZE, dirty);
+	vm_lookup(pagetable, vaddr + i*PAGE_SIZE)->soft |= PTE_LARGE;
+	swap_untrack(physaddr + i*PAGE_SIZE);
+    }
+
+    return 1;
+}
+
+/* Turns the large pages of the pair containing vaddr into ordinary
+ * pages, which may be swapped out. Does not touch the TLB. The swap
+ * lock must be held.
+ */
+static void vm_demote_large(pagetable_t *pagetable, uint32_t vaddr)
+{
+    pte_t *pte;
+    uint32_t i;
+
+    vaddr &= ~(2 * VM_LARGE_PAGE_SIZE - 1);
+    pte = vm_lookup(pagetable, vaddr);
+
+    for (i = 0; i < 2 * VM_LARGE_PAGE_PAGES; i++) {
+	if (pte[i].soft & PTE_LARGE) {
+	    pte[i].soft &= ~PTE_LARGE;
+	    swap_track(pte[i].PFN << 12, pagetable, vaddr + i*PAGE_SIZE);
 	}
     }
-    /* No previous or pairing mapping was found */
-
-    /* Make sure that pagetable is not full */
-    if(pagetable->valid_count >= PAGETABLE_ENTRIES) {
-	kprintf("Thread with ASID=%d run out of pagetable mapping entries\n",
-		pagetable->ASID);
-	kprintf("during an attempt to map vaddr 0x%8.8x => phys 0x%8.8x.\n",
-		vaddr, physaddr);
-	KERNEL_PANIC("Thread run out of pagetable mapping entries.");
+}
+
+/**
+ * Makes sure that the pair of large pages containing the given
+ * address consists of ordinary pages, so that 4k pages may be mapped
+ * or unmapped in it. Removes the large page entries from the TLBs, so
+ * it must be called in thread context.
+ *
+ * @param pagetable Page table to operate on
+ *
+ * @param vaddr Virtual address in the pair
+ *
+ */
+
+void vm_split_large(pagetable_t *pagetable, uint32_t vaddr)
+{
+    pte_t *pte;
+    uint32_t i;
+
+    vaddr &= ~(2 * VM_LARGE_PAGE_SIZE - 1);
+    pte = vm_lookup(pagetable, vaddr);
+    if (pte == NULL)
+	return;
+
+    for (i = 0; i < 2 * VM_LARGE_PAGE_PAGES; i++) {
+	if (pte[i].soft & PTE_LARGE)
+	    break;
     }
+    if (i == 2 * VM_LARGE_PAGE_PAGES)
+	return;
 
-    /* Map the page on a new entry */
+    swap_lock();
+    vm_demote_large(pagetable, vaddr);
+    swap_unlock();
 
-    pagetable->entries[pagetable->valid_count].VPN2 = vaddr >> 13;
-    pagetable->entries[pagetable->valid_count].ASID = pagetable->ASID;
+    tlb_shootdown(pagetable, vaddr, 2 * VM_LARGE_PAGE_PAGES);
+}
 
-    if(ADDR_IS_ON_EVEN_PAGE(vaddr)) {
-	pagetable->entries[pagetable->valid_count].PFN0 = physaddr >> 12;
-	pagetable->entries[pagetable->valid_count].D0   = dirty;
-	pagetable->entries[pagetable->valid_count].V0   = 1;
-	pagetable->entries[pagetable->valid_count].G0   = 0;
-	pagetable->entries[pagetable->valid_count].V1   = 0;
-    } else {
-	pagetable->entries[pagetable->valid_count].PFN1 = physaddr >> 12;
-	pagetable->entries[pagetable->valid_count].D1   = dirty;
-	pagetable->entries[pagetable->valid_count].V1   = 1;
-	pagetable->entries[pagetable->valid_count].G1   = 0;
-	pagetable->entries[pagetable->valid_count].V0   = 0;
+/**
+ * Maps a read-only page from the page cache. The mapping takes over
+ * the reference to the page given by pagecache_get or
+ * pagecache_insert, and releases it with pagecache_put. Shared pages
+ * are never swapped out.
+ *
+ * @param pagetable Page table in which to do the mapping
+ *
+ * @param physaddr Physical address of the cached page
+ *
+ * @param vaddr Virtual address to map, page aligned
+ *
+ * @return 1 on success, 0 if there is no memory for the leaf table
+ * (the caller keeps the reference then)
+ *
+ */
+
+int vm_map_shared(pagetable_t *pagetable, uint32_t physaddr, uint32_t vaddr)
+{
+    if (!vm_map(pagetable, physaddr, vaddr, 0))
+	return 0;
+    vm_lookup(pagetable, vaddr)->soft |= PTE_SHARED;
+    swap_untrack(physaddr);
+
+    return 1;
+}
+
+/**
+ * Copies all mappings of a page table to another, empty page table.
+ * The pages are shared between the two tables: each mapping takes a
+ * reference to its page, and writable pages are write protected in
+ * both tables and marked copy-on-write (see vm_copy_on_write). Large
+ * pages are split into ordinary pages. Pages
+ * on the swap disk are read back first, shared pages are not swapped
+ * out. Must be called in thread context, see tlb_shootdown and
+ * swap_lock.
+ *
+ * @param from Page table to copy
+ *
+ * @param to Page table to copy to
+ *
+ * @return 1 on success, 0 if out of memory for the leaf tables or the
+ * pages on the swap disk. The mappings copied so far stay in to,
+ * which the caller destroys.
+ *
+ */
+
+int vm_copy_pagetable(pagetable_t *from, pagetable_t *to)
+{
+    pte_t *src, *dst;
+    int i, j, ok;
+
+    KERNEL_ASSERT(to->valid_count == 0);
+
+    swap_lock();
+
+    ok = 1;
+    for (i = 0; i < PAGETABLE_DIR_ENTRIES && ok; i++) {
+	src = from->directory[i];
+	if (src == NULL)
+	    continue;
+
+	dst = vm_get_leaf(to, (uint32_t)i << 22, 1);
+	if (dst == NULL) {
+	    ok = 0;
+	    break;
+	}
+
+	for (j = 0; j < PAGETABLE_LEAF_ENTRIES; j++) {
+	    /* The copy-on-write copies are made per 4k page */
+	    if (src[j].soft & PTE_LARGE)
+		vm_demote_large(from, ((uint32_t)i << 22) | (j << 12));
+
+	    if ((src[j].soft & PTE_SWAPPED)
+		&& !swap_in_locked(from, ((uint32_t)i << 22) | (j << 12))) {
+		ok = 0;
+		break;
+	    }
+
+	    if (!src[j].V)
+		continue;
+
+	    swap_untrack(src[j].PFN << 12);
+
+	    if (src[j].D) {
+		src[j].D = 0;
+		src[j].soft |= PTE_COW;
+	    }
+	    dst[j] = src[j];
+	    pagepool_ref_phys_page(src[j].PFN << 12);
+	    to->valid_count++;
+	}
     }
 
-    pagetable->valid_count++;
+    /* Drop the writable mappings of the source from the TLBs, also
+       when the copy failed half way */
+    tlb_shootdown(from, 0, VM_USER_TOP / PAGE_SIZE);
+
+    swap_unlock();
+
+    return ok;
 }
 
 /**
- * Unmaps given virtual address from given pagetable.
+ * Makes a copy-on-write page writable. If the page is still shared,
+ * the mapping is moved to a private copy of the page and the old
+ * mapping is shot down on the CPUs which have run the page table.
+ * Called from the user page fault handler and when a system call
+ * prefaults a buffer it writes to. Must be called in thread context
+ * with interrupts enabled, for the shootdown. Does not evict pages,
+ * callers retry after swap_reclaim if there is no memory.
+ *
+ * @param pagetable Page table of the current process
+ *
+ * @param vaddr The address written to
+ *
+ * @return 1 if the page is now writable, 0 if it is not a
+ * copy-on-write page or there is no memory for the copy.
+ */
+
+int vm_copy_on_write(pagetable_t *pagetable, uint32_t vaddr)
+{
+    pte_t *pte;
+    uint32_t old, new;
+
+    vaddr &= PAGE_SIZE_MASK;
+
+    pte = vm_lookup(pagetable, vaddr);
+    if (pte == NULL || !pte->V || !(pte->soft & PTE_COW))
+	return 0;
+
+    old = pte->PFN << 12;
+    if (pagepool_get_refcount(old) == 1) {
+	/* The other mappings are gone, take the page over. TLBs still
+	   holding it write protected take a modified exception and
+	   reload the entry. */
+	pte->soft &= ~PTE_COW;
+	pte->D = 1;
+	swap_track(old, pagetable, vaddr);
+	return 1;
+    }
+
+    new = pagepool_get_phys_page();
+    if (new == 0)
+	return 0;
+
+    memcopy(PAGE_SIZE, (void *)ADDR_PHYS_TO_KERNEL(new),
+	    (void *)ADDR_PHYS_TO_KERNEL(old));
+    pte->PFN = new >> 12;
+    pte->soft &= ~PTE_COW;
+    pte->D = 1;
+
+    /* The old page may change under stale entries once it is freed */
+    tlb_shootdown(pagetable, vaddr, 1);
+    pagepool_free_phys_page(old);
+
+    vm_stat_inc(pagetable, VM_STAT_COW_COPIES);
+
+    /* The page is private now */
+    swap_track(new, pagetable, vaddr);
+
+    return 1;
+}
+
+/**
+ * Unmaps given virtual address from given pagetable and drops the
+ * reference to the physical page which was mapped to it. Must not be
+ * called while holding a spinlock, see vm_unmap_range.
  *
  * @param pagetable Page table to operate on
  *
@@ -218,10 +709,85 @@ void vm_map(pagetable_t *pagetable,
 
 void vm_unmap(pagetable_t *pagetable, uint32_t vaddr)
 {
-    pagetable = pagetable;
-    vaddr     = vaddr;
-    
-    /* Not implemented */
+    vm_unmap_range(pagetable, vaddr, 1);
+}
+
+/**
+ * Unmaps a range of pages from given pagetable and drops the
+ * references to the physical pages which were mapped to them (freeing
+ * the pages not shared with other page tables). Pages in the range
+ * which are not mapped are skipped.
+ *
+ * The mappings are removed from the TLBs of all CPUs before the pages
+ * are freed, with one shootdown for the whole range. This may wait
+ * for the other CPUs, so it must not be called while holding a
+ * spinlock or with interrupts disabled. Pages of the range on the
+ * swap disk are dropped with their swap slots.
+ *
+ * @param pagetable Page table to operate on
+ *
+ * @param vaddr First virtual address to unmap, page aligned
+ *
+ * @param pages Number of pages to unmap
+ *
+ */
+
+void vm_unmap_range(pagetable_t *pagetable, uint32_t vaddr, uint32_t pages)
+{
+    pte_t *pte;
+    uint32_t i, unmapped;
+
+    KERNEL_ASSERT((vaddr & ~PAGE_SIZE_MASK) == 0);
+
+    /* Invalidate the page table entries first, so that the TLBs can
+       not be refilled with them while we shoot them down. The PFNs
+       are kept for freeing the pages. */
+    unmapped = 0;
+
+    swap_lock();
+
+    for (i = 0; i < pages; i++) {
+	pte = vm_lookup(pagetable, vaddr + i*PAGE_SIZE);
+	if (pte == NULL)
+	    continue;
+
+	if (pte->V) {
+	    /* The rest of a large page stays mapped with 4k pages, the
+	       large TLB entry is shot down with the range */
+	    if (pte->soft & PTE_LARGE)
+		vm_demote_large(pagetable, vaddr + i*PAGE_SIZE);
+	    pte->V = 0;
+	    unmapped++;
+	} else if (pte->soft & PTE_SWAPPED) {
+	    swap_free_slot(pte->PFN);
+	    pte->PFN  = 0;
+	    pte->D    = 0;
+	    pte->soft = 0;
+	    pagetable->valid_count--;
+	}
+    }
+
+    if (unmapped == 0) {
+	swap_unlock();
+	return;
+    }
+
+    tlb_shootdown(pagetable, vaddr, pages);
+
+    /* No CPU can access the pages any more, release them */
+    for (i = 0; i < pages; i++) {
+	pte = vm_lookup(pagetable, vaddr + i*PAGE_SIZE);
+	if (pte != NULL && !pte->V && pte->PFN != 0) {
+	    vm_release_page(pte);
+	    pte->PFN  = 0;
+	    pte->D    = 0;
+	    pte->soft = 0;
+	}
+    }
+
+    pagetable->valid_count -= unmapped;
+
+    swap_unlock();
 }
 
 /**
@@ -238,35 +804,15 @@ void vm_unmap(pagetable_t *pagetable, uint32_t vaddr)
  */
 void vm_set_dirty(pagetable_t *pagetable, uint32_t vaddr, int dirty)
 {
-    unsigned int i;
+    pte_t *pte;
 
     KERNEL_ASSERT(dirty == 0 || dirty == 1);
 
-    for(i=0; i<pagetable->valid_count; i++) {
-	if(pagetable->entries[i].VPN2 == (vaddr >> 13)) {
-            /* Check whether this is an even or odd page */
-	    if(ADDR_IS_ON_EVEN_PAGE(vaddr)) {
-		if(pagetable->entries[i].V0 == 0) {
-		    KERNEL_PANIC("Tried to set dirty bit of an unmapped "
-                                 "entry");
-		} else {
-		    pagetable->entries[i].D0 = dirty;
-		    return;
-		}
-	    } else {
-		if(pagetable->entries[i].V1 == 0) {
-		    KERNEL_PANIC("Tried to set dirty bit of an unmapped "
-                                 "entry");
-		} else {
-		    pagetable->entries[i].D1 = dirty;
-		    return;
-		}
-	    }
-	}
-    }
-    /* No mapping was found */
+    pte = vm_lookup(pagetable, vaddr);
+    if (pte == NULL || pte->V == 0)
+	KERNEL_PANIC("Tried to set dirty bit of an unmapped entry");
 
-    KERNEL_PANIC("Tried to set dirty bit of an unmapped entry");
+    pte->D = dirty;
 }
 
 /** @} */
@@ -41,13 +41,30 @@
 
 void vm_init(void);
 
-pagetable_t *vm_create_pagetable(uint32_t asid);
+void vm_stat_inc(pagetable_t *pagetable, int counter);
+uint32_t vm_get_stat(int cpu, int counter);
+
+pagetable_t *vm_create_pagetable(void);
 void vm_destroy_pagetable(pagetable_t *pagetable);
 
-void vm_map(pagetable_t *pagetable, uint32_t physaddr, 
-	    uint32_t vaddr, int dirty);
+int vm_map(pagetable_t *pagetable, uint32_t physaddr, 
+	   uint32_t vaddr, int dirty);
+int vm_map_large(pagetable_t *pagetable, uint32_t physaddr,
+                 uint32_t vaddr, int dirty);
+void vm_split_large(pagetable_t *pagetable, uint32_t vaddr);
+int vm_use_large_pages(void);
+int vm_map_shared(pagetable_t *pagetable, uint32_t physaddr,
+                  uint32_t vaddr);
 void vm_unmap(pagetable_t *pagetable, uint32_t vaddr);
+void vm_unmap_range(pagetable_t *pagetable, uint32_t vaddr, uint32_t pages);
 
 void vm_set_dirty(pagetable_t *pagetable, uint32_t vaddr, int dirty);
 
+int vm_copy_pagetable(pagetable_t *from, pagetable_t *to);
+int vm_copy_on_write(pagetable_t *pagetable, uint32_t vaddr);
+
+pte_t *vm_lookup(pagetable_t *pagetable, uint32_t vaddr);
+int vm_get_tlb_entry(pagetable_t *pagetable, uint32_t vaddr,
+                     tlb_entry_t *entry, uint32_t *pagemask);
+
 #endif /* BUENOS_VM_VM_H */